@@ -0,0 +1,908 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include "v4l2core.h"
+#include "v4l2engine.h"
+#include "v4l2sim.h"
+#include "v4l2log.h"
+#include "v4l2pool.h"
+#include "v4l2copy.h"
+#include "v4l2raw.h"
+#include "v4l2idx.h"
+#include "v4l2conv.h"
+
+#define BENCH_MAX_AXIS      16
+#define BENCH_MAX_DEVICES   64
+#define BENCH_POOL_FDS      (VIDIOC_REQBUFS_MAX * V4L2CORE_MAX_PLANES)
+#define BENCH_RAW_FILE      (1ull << 30)
+
+typedef enum wait_method{
+    WAIT_ENGINE,        //devices multiplexed on a v4l2engine
+    WAIT_BLOCK,         //a library capture thread per device, sleeping in select()
+    WAIT_BUSY,          //the same threads busy polling DQBUF, one core each
+}wait_method;
+
+/*
+    Capture benchmark: runs every combination of the axes below and prints
+    one result per line, CSV by default or JSON with -j.
+*/
+typedef struct BenchAxes{
+    uint32_t     width[BENCH_MAX_AXIS], height[BENCH_MAX_AXIS];
+    unsigned int n_res;
+    uint32_t     format[BENCH_MAX_AXIS];
+    unsigned int n_format;
+    unsigned int buffers[BENCH_MAX_AXIS];
+    unsigned int n_buffers;
+    io_method    io[BENCH_MAX_AXIS];
+    unsigned int n_io;
+    unsigned int devices[BENCH_MAX_AXIS];
+    unsigned int n_devices;
+    wait_method  wait[BENCH_MAX_AXIS];
+    unsigned int n_wait;
+}BenchAxes;
+
+typedef struct BenchCase{
+    uint32_t     width, height, format;
+    unsigned int buffers;
+    io_method    io;
+    unsigned int devices;
+    wait_method  wait;
+}BenchCase;
+
+typedef struct BenchResult{
+    double       seconds;
+    uint64_t     frames;
+    uint64_t     bytes;
+    uint64_t     dropped;
+    uint64_t     errors;
+    double       cpu_ns;
+    v4l2_hist_t  capture_to_dequeue;
+    v4l2_hist_t  dequeue_to_callback;
+    v4l2_hist_t  callback;
+    const char*  copy;          //method copying frames out, NULL without -C
+    uint8_t      has_saved;
+    double       saved_us;      //busy polling's c2d p50 gain over blocking
+    uint64_t     raw_stalls;    //with -W, times the capture side waited for the disk
+    uint64_t     raw_stall_ns;
+}BenchResult;
+
+typedef struct CopyOut{
+    const v4l2_dev_t* vd;
+    uint8_t*     buf;
+    size_t       size;
+}CopyOut;
+
+typedef struct RawOut{
+    const v4l2_dev_t* vd;
+    v4l2_raw_t*  raw;
+    char         path[PATH_MAX];
+}RawOut;
+
+static const char* ioNames[] = { "read", "mmap", "userptr", "dmabuf" };
+static const char* waitNames[] = { "engine", "block", "busy" };
+
+static double duration = 1.0;
+static unsigned int fps = 0;
+static unsigned int threads = 0;
+static unsigned int touch = 0;
+static unsigned int userptr_flags = 0; //pool_flags of the USERPTR pool
+static unsigned int copy_threads = 0;   //copy every frame out on this many threads, 0 doesn't
+static v4l2_copy_t* copier;
+static CopyOut copyOut[BENCH_MAX_DEVICES];     //per device destination, its callbacks never overlap
+static char* raw_dir = NULL;        //record every device raw into this directory
+static RawOut rawOut[BENCH_MAX_DEVICES];
+static int busy_priority = 0;    //SCHED_FIFO priority of busy polling threads
+static unsigned int json = 0;
+static char* devices = NULL;       //comma separated real devices instead of the simulator
+static char* replay = NULL;        //recording the simulated devices play back
+static unsigned int convert = 0;   //time the pixel format conversions instead of capturing
+
+static volatile uint64_t sink;
+static uint64_t payload;           //bytesused summed over all devices
+
+static uint64_t nowNs(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t cpuNs(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ull
+		+ (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ull;
+}
+
+/**
+	consume a frame, reading one word per cache line with -c
+*/
+static void frameCopy(struct v4l2_dev_t* vd, const v4l2_frame_t* frame)
+{
+	unsigned int i;
+
+	for (i = 0; i < BENCH_MAX_DEVICES && copyOut[i].vd; ++i) {
+		if (copyOut[i].vd == vd) {
+			v4l2copy_frame(copier, frame, copyOut[i].buf, copyOut[i].size);
+			return;
+		}
+	}
+}
+
+static void frameRecord(struct v4l2_dev_t* vd, const v4l2_frame_t* frame)
+{
+	unsigned int i;
+
+	for (i = 0; i < BENCH_MAX_DEVICES && rawOut[i].vd; ++i) {
+		if (rawOut[i].vd == vd) {
+			v4l2raw_frame(rawOut[i].raw, frame);
+			return;
+		}
+	}
+}
+
+static void frameCallback(struct v4l2_dev_t* vd, const v4l2_frame_t* frame)
+{
+	uint64_t sum = 0, bytes = 0;
+	uint32_t i, p;
+
+	if (copier)
+		frameCopy(vd, frame);
+	if (raw_dir)
+		frameRecord(vd, frame);
+
+	for (p = 0; p < frame->n_planes; ++p) {
+		const v4l2_frame_plane_t* plane = &frame->planes[p];
+
+		bytes += plane->bytesused;
+		if (touch)
+			for (i = 0; i + sizeof(uint64_t) <= plane->bytesused; i += 64)
+				sum += *(const uint64_t*)((const uint8_t*)plane->start + i);
+	}
+	__atomic_add_fetch(&payload, bytes, __ATOMIC_RELAXED);
+	sink += sum;
+}
+
+static void histMerge(v4l2_hist_t* total, const v4l2_hist_t* hist)
+{
+	v4l2_hist_t snap;
+	int i;
+
+	v4l2hist_snapshot(hist, &snap);
+	total->count += snap.count;
+	total->sum += snap.sum;
+	if (snap.max > total->max)
+		total->max = snap.max;
+	for (i = 0; i < V4L2HIST_BUCKETS; ++i)
+		total->buckets[i] += snap.buckets[i];
+}
+
+static v4l2_dev_t* benchOpen(const BenchCase* bc, unsigned int n)
+{
+	v4l2sim_config_t cfg;
+	v4l2_dev_t* vd;
+	char* list;
+	char* name;
+	char* save;
+	unsigned int i;
+
+	if (!devices) {
+		memset(&cfg, 0, sizeof(cfg));
+		cfg.pixelformat = bc->format;
+		cfg.width = bc->width;
+		cfg.height = bc->height;
+		cfg.fps = fps;
+		cfg.replay_path = replay;
+		cfg.replay_timed = 1;
+		cfg.replay_zero_copy = 1;
+		return v4l2sim_open(&cfg);
+	}
+
+	list = strdup(devices);
+	name = strtok_r(list, ",", &save);
+	for (i = 0; name && i < n; ++i)
+		name = strtok_r(NULL, ",", &save);
+	vd = name ? v4l2core_dev_open(name) : NULL;
+	free(list);
+	return vd;
+}
+
+/**
+	one dmabuf per plane of every buffer, in buffer order
+*/
+static int dmabufPool(v4l2_dev_t* vd, unsigned int count, int* fds)
+{
+	static int udmabuf = -1;
+	const struct v4l2_pix_format_mplane* mp = &vd->fmt.fmt.pix_mp;
+	unsigned int i, planes = 1;
+	uint32_t size;
+
+	if (udmabuf < 0)
+		udmabuf = 0 == access("/dev/udmabuf", R_OK | W_OK);
+
+	if (V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE == vd->buf_type)
+		planes = mp->num_planes ? mp->num_planes : 1;
+	count *= planes;
+
+	for (i = 0; i < count; ++i) {
+		size = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE == vd->buf_type
+			? mp->plane_fmt[i % planes].sizeimage : vd->fmt.fmt.pix.sizeimage;
+		fds[i] = (udmabuf || devices) ? v4l2core_dmabuf_alloc(size) : -1;
+		/* The simulator maps any fd, so a plain memfd stands in without udmabuf. */
+		if (fds[i] < 0 && !devices) {
+			fds[i] = memfd_create("bench", MFD_CLOEXEC);
+			if (fds[i] >= 0 && -1 == ftruncate(fds[i], size)) {
+				close(fds[i]);
+				fds[i] = -1;
+			}
+		}
+		if (fds[i] < 0)
+			return -1;
+	}
+	return v4l2core_capture_set_dmabuf_pool(vd, fds, count);
+}
+
+static void benchClose(v4l2_dev_t* vd, int started, int* fds, unsigned int n_fds)
+{
+	unsigned int i;
+
+	if (started) {
+		v4l2core_capture_stop(vd);
+		/* Leaked rather than freed under a frame someone still holds. */
+		if (v4l2core_capture_uninit(vd) < 0)
+			return;
+	}
+	v4l2core_dev_close(vd);
+	free(vd);
+	for (i = 0; i < n_fds; ++i) {
+		if (fds[i] >= 0)
+			close(fds[i]);
+		fds[i] = -1;
+	}
+}
+
+static v4l2_dev_t* benchSetup(const BenchCase* bc, unsigned int n, int* fds)
+{
+	v4l2_dev_t* vd = benchOpen(bc, n);
+
+	if (!vd)
+		return NULL;
+
+	vd->io = bc->io;
+	vd->VFrameCallback = frameCallback;
+	if (v4l2core_dev_set_fmt(vd, bc->format, bc->width, bc->height) < 0
+	 || (devices && fps && v4l2core_dev_set_fps(vd, 1, fps) < 0)
+	 || (bc->io != IO_METHOD_READ && v4l2core_capture_set_ring(vd, bc->buffers, 0) < 0)
+	 || (bc->io == IO_METHOD_DMABUF && dmabufPool(vd, bc->buffers, fds) < 0)
+	 || (bc->io == IO_METHOD_USERPTR && v4l2core_capture_set_userptr_pool(vd, userptr_flags) < 0)
+	 || v4l2core_capture_init(vd) < 0) {
+		benchClose(vd, 0, fds, bc->io == IO_METHOD_DMABUF ? BENCH_POOL_FDS : 0);
+		return NULL;
+	}
+	if (bc->wait == WAIT_BUSY) {
+		BusyPoll bp;
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		memset(&bp, 0, sizeof(bp));
+		bp.cpu = cpus > 0 ? (int)(n % cpus) : -1;
+		bp.priority = busy_priority;
+		bp.spins = 64;
+		if (v4l2core_capture_set_busy_poll(vd, &bp) < 0) {
+			benchClose(vd, 1, fds, bc->io == IO_METHOD_DMABUF ? BENCH_POOL_FDS : 0);
+			return NULL;
+		}
+	}
+	if (v4l2core_capture_start(vd) < 0) {
+		benchClose(vd, 1, fds, bc->io == IO_METHOD_DMABUF ? BENCH_POOL_FDS : 0);
+		return NULL;
+	}
+	return vd;
+}
+
+/**
+	give every device a copy destination and calibrate the copier on a mapped buffer
+*/
+static int copySetup(v4l2_dev_t** vds, unsigned int n, BenchResult* res)
+{
+	const buffer_plane* bp;
+	unsigned int i, p;
+	size_t size;
+
+	for (i = 0; i < n; ++i) {
+		size = 0;
+		for (p = 0; p < vds[i]->n_planes; ++p)
+			size += vds[i]->buffers[0].planes[p].length;
+		copyOut[i].vd = vds[i];
+		copyOut[i].size = size;
+		copyOut[i].buf = aligned_alloc(64, (size + 63) & ~(size_t)63);
+		if (!copyOut[i].buf)
+			return -1;
+		memset(copyOut[i].buf, 0, size);
+	}
+
+	bp = &vds[0]->buffers[0].planes[0];
+	res->copy = v4l2copy_name(v4l2copy_calibrate(copier, bp->start, bp->length));
+	return 0;
+}
+
+/**
+	a blocking raw recorder per device, rotating every BENCH_RAW_FILE bytes
+*/
+static int rawSetup(v4l2_dev_t** vds, unsigned int n)
+{
+	RawConfig cfg;
+	unsigned int i;
+
+	for (i = 0; i < n; ++i) {
+		memset(&cfg, 0, sizeof(cfg));
+		snprintf(rawOut[i].path, sizeof(rawOut[i].path), "%s/bench%u-%%04u.raw", raw_dir, i);
+		cfg.path = rawOut[i].path;
+		cfg.file_bytes = BENCH_RAW_FILE;
+		cfg.block = 1;
+		rawOut[i].raw = v4l2raw_open(&cfg);
+		if (!rawOut[i].raw)
+			return -1;
+		rawOut[i].vd = vds[i];
+	}
+	return 0;
+}
+
+/**
+	collect the backpressure counters, then close the recorders and delete what they wrote
+*/
+static void rawFinish(BenchResult* res)
+{
+	char name[PATH_MAX];
+	RawStats st;
+	unsigned int i, f;
+
+	for (i = 0; i < BENCH_MAX_DEVICES && rawOut[i].raw; ++i) {
+		v4l2raw_stats(rawOut[i].raw, &st);
+		res->raw_stalls += st.stalls;
+		res->raw_stall_ns += st.stall_ns;
+		v4l2raw_close(rawOut[i].raw);
+		for (f = 0; f < st.files + 1; ++f) {
+			snprintf(name, sizeof(name), rawOut[i].path, f);
+			unlink(name);
+		}
+	}
+	memset(rawOut, 0, sizeof(rawOut));
+}
+
+/**
+	capture on bc->devices devices for the configured duration,
+	through one engine or a library capture thread per device
+*/
+static int benchRun(const BenchCase* bc, BenchResult* res)
+{
+	v4l2_dev_t* vds[BENCH_MAX_DEVICES];
+	int fds[BENCH_MAX_DEVICES][BENCH_POOL_FDS];
+	v4l2_engine_t* engine = NULL;
+	CaptureStats stats;
+	LatencyStats latency;
+	uint64_t t0, c0;
+	unsigned int i, n;
+	int r = -1;
+
+	memset(res, 0, sizeof(*res));
+	memset(fds, -1, sizeof(fds));
+
+	if (bc->wait == WAIT_ENGINE) {
+		engine = v4l2engine_create(threads);
+		if (!engine)
+			return -1;
+	}
+
+	for (n = 0; n < bc->devices; ++n) {
+		vds[n] = benchSetup(bc, n, fds[n]);
+		if (!vds[n])
+			goto out;
+		if (engine && v4l2engine_add(engine, vds[n]) < 0) {
+			benchClose(vds[n], 1, fds[n], bc->io == IO_METHOD_DMABUF ? BENCH_POOL_FDS : 0);
+			goto out;
+		}
+	}
+
+	if (copier && copySetup(vds, n, res) < 0)
+		goto out;
+	if (raw_dir && rawSetup(vds, n) < 0)
+		goto out;
+
+	__atomic_store_n(&payload, 0, __ATOMIC_RELAXED);
+	c0 = cpuNs();
+	t0 = nowNs(CLOCK_MONOTONIC);
+	if (engine) {
+		if (v4l2engine_start(engine) < 0)
+			goto out;
+	} else {
+		for (i = 0; i < n; ++i)
+			if (v4l2core_capture_thread_start(vds[i]) < 0)
+				goto out;
+	}
+	usleep((useconds_t)(duration * 1000000));
+	if (engine)
+		v4l2engine_stop(engine);
+	for (i = 0; i < n; ++i)
+		__atomic_store_n(&vds[i]->bcapture, 0, __ATOMIC_RELAXED);
+	for (i = 0; i < n; ++i)
+		v4l2core_capture_thread_stop(vds[i]);
+	res->seconds = (nowNs(CLOCK_MONOTONIC) - t0) / 1e9;
+	res->cpu_ns = cpuNs() - c0;
+	res->bytes = __atomic_load_n(&payload, __ATOMIC_RELAXED);
+
+	for (i = 0; i < n; ++i) {
+		v4l2core_get_stats(vds[i], &stats);
+		v4l2core_get_latency(vds[i], &latency);
+		res->frames += stats.frames;
+		res->dropped += stats.dropped;
+		res->errors += stats.errors;
+		histMerge(&res->capture_to_dequeue, &latency.capture_to_dequeue);
+		histMerge(&res->dequeue_to_callback, &latency.dequeue_to_callback);
+		histMerge(&res->callback, &latency.callback);
+	}
+	r = 0;
+
+out:
+	for (i = 0; i < n; ++i) {
+		if (engine)
+			v4l2engine_remove(engine, vds[i]);
+		benchClose(vds[i], 1, fds[i], bc->io == IO_METHOD_DMABUF ? BENCH_POOL_FDS : 0);
+	}
+	rawFinish(res);
+	if (engine)
+		v4l2engine_destroy(engine);
+	for (i = 0; i < BENCH_MAX_DEVICES; ++i)
+		free(copyOut[i].buf);
+	memset(copyOut, 0, sizeof(copyOut));
+	return r;
+}
+
+static void fourcc(uint32_t f, char* s)
+{
+	s[0] = f & 0xFF;
+	s[1] = (f >> 8) & 0xFF;
+	s[2] = (f >> 16) & 0xFF;
+	s[3] = (f >> 24) & 0xFF;
+	s[4] = '\0';
+}
+
+static void printHeader(void)
+{
+	if (json)
+		return;
+	printf("width,height,format,buffers,io,devices,target_fps,seconds,frames,fps,mb_per_s,dropped,errors,cpu_us_per_frame,"
+		"c2d_p50_us,c2d_p99_us,c2d_max_us,d2cb_p50_us,d2cb_p99_us,d2cb_max_us,cb_p50_us,cb_p99_us,cb_max_us,copy,wait,saved_us,raw_stalls,raw_stall_ms\n");
+	fflush(stdout);
+}
+
+static void printResult(const BenchCase* bc, const BenchResult* res)
+{
+	const v4l2_hist_t* h[3] = { &res->capture_to_dequeue, &res->dequeue_to_callback, &res->callback };
+	static const char* hname[3] = { "capture_to_dequeue", "dequeue_to_callback", "callback" };
+	double rate = res->seconds > 0 ? res->frames / res->seconds : 0;
+	double mbps = res->seconds > 0 ? res->bytes / res->seconds / 1e6 : 0;
+	double cpu = res->frames ? res->cpu_ns / res->frames / 1000.0 : 0;
+	char fmt[5];
+	int i;
+
+	fourcc(bc->format, fmt);
+	if (json) {
+		printf("{\"width\":%u,\"height\":%u,\"format\":\"%s\",\"buffers\":%u,\"io\":\"%s\",\"devices\":%u,\"target_fps\":%u,"
+			"\"seconds\":%.3f,\"frames\":%" PRIu64 ",\"fps\":%.1f,\"mb_per_s\":%.1f,\"dropped\":%" PRIu64 ",\"errors\":%" PRIu64 ","
+			"\"cpu_us_per_frame\":%.2f",
+			bc->width, bc->height, fmt, bc->buffers, ioNames[bc->io], bc->devices, fps,
+			res->seconds, res->frames, rate, mbps, res->dropped, res->errors, cpu);
+		for (i = 0; i < 3; ++i)
+			printf(",\"%s_us\":{\"p50\":%.1f,\"p99\":%.1f,\"max\":%.1f}", hname[i],
+				v4l2hist_percentile(h[i], 50) / 1000.0, v4l2hist_percentile(h[i], 99) / 1000.0, h[i]->max / 1000.0);
+		printf(",\"copy\":\"%s\",\"wait\":\"%s\"", res->copy ? res->copy : "none", waitNames[bc->wait]);
+		if (res->has_saved)
+			printf(",\"saved_us\":%.1f", res->saved_us);
+		if (raw_dir)
+			printf(",\"raw\":{\"stalls\":%" PRIu64 ",\"stall_ms\":%.1f}", res->raw_stalls, res->raw_stall_ns / 1e6);
+		printf("}\n");
+	} else {
+		printf("%u,%u,%s,%u,%s,%u,%u,%.3f,%" PRIu64 ",%.1f,%.1f,%" PRIu64 ",%" PRIu64 ",%.2f",
+			bc->width, bc->height, fmt, bc->buffers, ioNames[bc->io], bc->devices, fps,
+			res->seconds, res->frames, rate, mbps, res->dropped, res->errors, cpu);
+		for (i = 0; i < 3; ++i)
+			printf(",%.1f,%.1f,%.1f", v4l2hist_percentile(h[i], 50) / 1000.0,
+				v4l2hist_percentile(h[i], 99) / 1000.0, h[i]->max / 1000.0);
+		printf(",%s,%s,", res->copy ? res->copy : "none", waitNames[bc->wait]);
+		if (res->has_saved)
+			printf("%.1f", res->saved_us);
+		if (raw_dir)
+			printf(",%" PRIu64 ",%.1f\n", res->raw_stalls, res->raw_stall_ns / 1e6);
+		else
+			printf(",,\n");
+	}
+	fflush(stdout);
+}
+
+/**
+	time every conversion kernel on every supported isa, one line each;
+	returns -1 if any failed
+*/
+static int convBench(const BenchAxes* ax)
+{
+	static const uint32_t from[] = { V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_UYVY, V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_YUV420, V4L2_PIX_FMT_RGB24 };
+	static const uint32_t to[] = { V4L2_PIX_FMT_RGB24, V4L2_PIX_FMT_BGR24, V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_YUV420 };
+	uint64_t budget = duration * 1e8, start, ns;
+	v4l2_conv_t* conv = v4l2conv_create();
+	v4l2_image_t src, dst;
+	unsigned int r, f, t, frames;
+	size_t in, out, i;
+	void* sbuf;
+	void* dbuf;
+	char sf[5], df[5];
+	int isa, failed = 0;
+
+	if (!conv)
+		return -1;
+	if (!json)
+		printf("width,height,from,to,isa,frames,ms_per_frame,in_gb_per_s,out_gb_per_s\n");
+
+	for (r = 0; r < ax->n_res; ++r)
+	for (f = 0; f < sizeof(from) / sizeof(from[0]); ++f)
+	for (t = 0; t < sizeof(to) / sizeof(to[0]); ++t) {
+		if (from[f] == to[t])
+			continue;
+		in = v4l2conv_image(&src, from[f], ax->width[r], ax->height[r], NULL, 0);
+		out = v4l2conv_image(&dst, to[t], ax->width[r], ax->height[r], NULL, 0);
+		if (posix_memalign(&sbuf, 64, in) || posix_memalign(&dbuf, 64, out)) {
+			fprintf(stderr, "out of memory\n");
+			v4l2conv_destroy(conv);
+			return -1;
+		}
+		for (i = 0; i < in; ++i)
+			((uint8_t*)sbuf)[i] = rand();
+		memset(dbuf, 0, out);
+		v4l2conv_image(&src, from[f], ax->width[r], ax->height[r], sbuf, in);
+		v4l2conv_image(&dst, to[t], ax->width[r], ax->height[r], dbuf, out);
+		fourcc(from[f], sf);
+		fourcc(to[t], df);
+
+		for (isa = CONV_SCALAR; isa < CONV_ISAS; ++isa) {
+			if (!v4l2conv_isa_supported(isa))
+				continue;
+			v4l2conv_set_isa(conv, isa);
+			if (v4l2conv(conv, &src, &dst) < 0) {
+				failed = 1;
+				continue;
+			}
+			start = nowNs(CLOCK_MONOTONIC);
+			frames = 0;
+			do {
+				v4l2conv(conv, &src, &dst);
+				++frames;
+				ns = nowNs(CLOCK_MONOTONIC) - start;
+			} while (ns < budget);
+
+			if (json)
+				printf("{\"width\":%u,\"height\":%u,\"from\":\"%s\",\"to\":\"%s\",\"isa\":\"%s\",\"frames\":%u,"
+					"\"ms_per_frame\":%.3f,\"in_gb_per_s\":%.2f,\"out_gb_per_s\":%.2f}\n",
+					ax->width[r], ax->height[r], sf, df, v4l2conv_isa_name(isa), frames,
+					ns / 1e6 / frames, (double)in * frames / ns, (double)out * frames / ns);
+			else
+				printf("%u,%u,%s,%s,%s,%u,%.3f,%.2f,%.2f\n", ax->width[r], ax->height[r], sf, df, v4l2conv_isa_name(isa),
+					frames, ns / 1e6 / frames, (double)in * frames / ns, (double)out * frames / ns);
+			fflush(stdout);
+		}
+		free(sbuf);
+		free(dbuf);
+	}
+	v4l2conv_destroy(conv);
+	return failed ? -1 : 0;
+}
+
+/**
+	split a comma separated option into tokens, returns the count or -1
+*/
+static int splitList(char* arg, char** tok)
+{
+	char* save;
+	int n = 0;
+
+	for (arg = strtok_r(arg, ",", &save); arg; arg = strtok_r(NULL, ",", &save)) {
+		if (n == BENCH_MAX_AXIS)
+			return -1;
+		tok[n++] = arg;
+	}
+	return n;
+}
+
+static int parseAxis(int opt, char* arg, BenchAxes* ax)
+{
+	char* tok[BENCH_MAX_AXIS];
+	int i, n = splitList(arg, tok);
+
+	if (n <= 0)
+		return -1;
+
+	for (i = 0; i < n; ++i) {
+		switch (opt) {
+			case 'r':
+				if (sscanf(tok[i], "%ux%u", &ax->width[i], &ax->height[i]) != 2)
+					return -1;
+				break;
+			case 'f':
+				if (strlen(tok[i]) != 4)
+					return -1;
+				ax->format[i] = v4l2_fourcc(tok[i][0], tok[i][1], tok[i][2], tok[i][3]);
+				break;
+			case 'b':
+				ax->buffers[i] = atoi(tok[i]);
+				if (ax->buffers[i] < 2 || ax->buffers[i] > VIDIOC_REQBUFS_MAX)
+					return -1;
+				break;
+			case 'i':
+				for (ax->io[i] = IO_METHOD_READ; ax->io[i] <= IO_METHOD_DMABUF; ++ax->io[i])
+					if (!strcmp(tok[i], ioNames[ax->io[i]]))
+						break;
+				if (ax->io[i] > IO_METHOD_DMABUF)
+					return -1;
+				break;
+			case 'n':
+				ax->devices[i] = atoi(tok[i]);
+				if (ax->devices[i] < 1 || ax->devices[i] > BENCH_MAX_DEVICES)
+					return -1;
+				break;
+			case 'w':
+				for (ax->wait[i] = WAIT_ENGINE; ax->wait[i] <= WAIT_BUSY; ++ax->wait[i])
+					if (!strcmp(tok[i], waitNames[ax->wait[i]]))
+						break;
+				if (ax->wait[i] > WAIT_BUSY)
+					return -1;
+				break;
+		}
+	}
+
+	switch (opt) {
+		case 'r': ax->n_res = n; break;
+		case 'f': ax->n_format = n; break;
+		case 'b': ax->n_buffers = n; break;
+		case 'i': ax->n_io = n; break;
+		case 'n': ax->n_devices = n; break;
+		case 'w': ax->n_wait = n; break;
+	}
+	return 0;
+}
+
+/**
+	print usage information
+*/
+static void usage(FILE* fp, int argc, char** argv)
+{
+	fprintf(fp,
+		"Usage: %s [options]\n\n"
+		"Runs every combination of the list options and prints one result per line.\n\n"
+		"Options:\n"
+		"\t-r | --resolution list   WxH,... [default:640x480,1920x1080]\n"
+		"\t-f | --format list       fourcc,... [default:YUYV,MJPG]\n"
+		"\t-b | --buffers list      buffer counts [default:2,4,8]\n"
+		"\t-i | --io list           read,mmap,userptr,dmabuf [default:mmap,userptr,read]\n"
+		"\t-n | --devices list      simulated device counts [default:1,4]\n"
+		"\t-w | --wait list         engine,block,busy; busy also reports the us saved over block [default:engine]\n"
+		"\t-d | --device names      benchmark these devices instead of the simulator\n"
+		"\t-R | --replay file       simulated devices replay this recording zero-copy, at its own pace unless -F 0;\n"
+		"\t                         a v4l2idx recording sets format and resolution\n"
+		"\t-F | --fps n             frame rate, 0 captures as fast as possible [default:0]\n"
+		"\t-t | --time seconds      duration of each run [default:1]\n"
+		"\t-T | --threads n         engine threads [default:%d]\n"
+		"\t-P | --priority n        SCHED_FIFO priority of busy polling threads [default:0]\n"
+		"\t-c | --touch             read every cache line of each frame\n"
+		"\t-H | --hugepages         node local, prefaulted hugepage pool for userptr\n"
+		"\t-C | --copy threads      copy every frame out with v4l2copy, calibrated per run\n"
+		"\t-W | --record dir        record every frame raw into dir with O_DIRECT, deleted after each run\n"
+		"\t-X | --convert           time the pixel format conversions on every isa instead, a tenth of -t each\n"
+		"\t-j | --json              print JSON lines instead of CSV\n"
+		"\t-h | --help              Print this message\n"
+		"",
+		argv[0], V4L2ENGINE_THREADS);
+}
+
+static const char short_options [] = "r:f:b:i:n:w:d:R:F:t:T:P:cHC:W:Xjh";
+
+static const struct option
+long_options [] = {
+	{ "resolution",         required_argument,      NULL,           'r' },
+	{ "format",             required_argument,      NULL,           'f' },
+	{ "buffers",            required_argument,      NULL,           'b' },
+	{ "io",                 required_argument,      NULL,           'i' },
+	{ "devices",            required_argument,      NULL,           'n' },
+	{ "wait",               required_argument,      NULL,           'w' },
+	{ "device",             required_argument,      NULL,           'd' },
+	{ "replay",             required_argument,      NULL,           'R' },
+	{ "fps",                required_argument,      NULL,           'F' },
+	{ "time",               required_argument,      NULL,           't' },
+	{ "threads",            required_argument,      NULL,           'T' },
+	{ "priority",           required_argument,      NULL,           'P' },
+	{ "touch",              no_argument,            NULL,           'c' },
+	{ "hugepages",          no_argument,            NULL,           'H' },
+	{ "copy",               required_argument,      NULL,           'C' },
+	{ "record",             required_argument,      NULL,           'W' },
+	{ "convert",            no_argument,            NULL,           'X' },
+	{ "json",               no_argument,            NULL,           'j' },
+	{ "help",               no_argument,            NULL,           'h' },
+	{ 0, 0, 0, 0 }
+};
+
+int main(int argc, char** argv)
+{
+	char res[] = "640x480,1920x1080", fmt[] = "YUYV,MJPG", bufs[] = "2,4,8", io[] = "mmap,userptr,read", devs[] = "1,4", wait[] = "engine";
+	BenchAxes ax;
+	BenchCase bc;
+	BenchResult result;
+	unsigned int r, f, b, i, n, w;
+	double block_p50 = -1;     //c2d p50 of this case's block run, -1 before one
+	int failed = 0;
+
+	memset(&ax, 0, sizeof(ax));
+	parseAxis('r', res, &ax);
+	parseAxis('f', fmt, &ax);
+	parseAxis('b', bufs, &ax);
+	parseAxis('i', io, &ax);
+	parseAxis('n', devs, &ax);
+	parseAxis('w', wait, &ax);
+
+	for (;;) {
+		int index;
+		int c;
+
+		c = getopt_long(argc, argv, short_options, long_options, &index);
+		if (-1 == c)
+			break;
+
+		switch (c) {
+			case 'r':
+			case 'f':
+			case 'b':
+			case 'i':
+			case 'n':
+			case 'w':
+				if (parseAxis(c, optarg, &ax) < 0) {
+					fprintf(stderr, "bad list for -%c: %s\n", c, optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'd':
+				devices = optarg;
+				break;
+			case 'R':
+				replay = optarg;
+				break;
+			case 'F':
+				fps = atoi(optarg);
+				break;
+			case 't':
+				duration = atof(optarg);
+				break;
+			case 'T':
+				threads = atoi(optarg);
+				break;
+			case 'P':
+				busy_priority = atoi(optarg);
+				break;
+			case 'c':
+				touch = 1;
+				break;
+			case 'H':
+				userptr_flags = POOL_HUGEPAGE | POOL_NUMA_LOCAL | POOL_PREFAULT;
+				break;
+			case 'C':
+				copy_threads = atoi(optarg);
+				break;
+			case 'W':
+				raw_dir = optarg;
+				break;
+			case 'X':
+				convert = 1;
+				break;
+			case 'j':
+				json = 1;
+				break;
+			case 'h':
+			default:
+				usage(c == 'h' ? stdout : stderr, argc, argv);
+				exit(c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+
+	/* Real devices are benchmarked all together, one run per setting. */
+	if (devices) {
+		char* p;
+
+		ax.n_devices = 1;
+		ax.devices[0] = 1;
+		for (p = devices; *p; ++p)
+			if (*p == ',')
+				ax.devices[0]++;
+	}
+
+	v4l2log_set_level(LOG_LEVEL_WARN);
+	v4l2log_start();
+	if (convert) {
+		failed = convBench(&ax) < 0;
+		v4l2log_stop();
+		return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	/* An indexed recording only plays back in the format it was made in. */
+	if (replay && !devices) {
+		char ipath[PATH_MAX];
+		v4l2_idx_t* idx;
+
+		snprintf(ipath, sizeof(ipath), "%s.idx", replay);
+		if (0 == access(ipath, F_OK)) {
+			idx = v4l2idx_open(replay);
+			if (!idx) {
+				v4l2log_stop();
+				return EXIT_FAILURE;
+			}
+			ax.n_res = ax.n_format = 1;
+			ax.width[0] = v4l2idx_header(idx)->width;
+			ax.height[0] = v4l2idx_header(idx)->height;
+			ax.format[0] = v4l2idx_header(idx)->pixelformat;
+			v4l2idx_close(idx);
+		}
+	}
+	if (copy_threads && !(copier = v4l2copy_create(copy_threads))) {
+		v4l2log_stop();
+		return EXIT_FAILURE;
+	}
+	printHeader();
+
+	for (r = 0; r < ax.n_res; ++r)
+	for (f = 0; f < ax.n_format; ++f)
+	for (i = 0; i < ax.n_io; ++i)
+	for (b = 0; b < ax.n_buffers; ++b)
+	for (n = 0; n < ax.n_devices; ++n)
+	for (w = 0; w < ax.n_wait; ++w) {
+		/* read() i/o has no buffer ring, one run is enough. */
+		if (ax.io[i] == IO_METHOD_READ && b > 0)
+			continue;
+		if (w == 0)
+			block_p50 = -1;
+
+		bc.width = ax.width[r];
+		bc.height = ax.height[r];
+		bc.format = ax.format[f];
+		bc.io = ax.io[i];
+		bc.buffers = ax.io[i] == IO_METHOD_READ ? 1 : ax.buffers[b];
+		bc.devices = ax.devices[n];
+		bc.wait = ax.wait[w];
+
+		if (benchRun(&bc, &result) < 0) {
+			char s[5];
+
+			fourcc(bc.format, s);
+			fprintf(stderr, "%ux%u %s %s x%u %s: setup failed\n", bc.width, bc.height, s, ioNames[bc.io], bc.devices, waitNames[bc.wait]);
+			failed = 1;
+			continue;
+		}
+		if (bc.wait == WAIT_BLOCK)
+			block_p50 = v4l2hist_percentile(&result.capture_to_dequeue, 50) / 1000.0;
+		else if (bc.wait == WAIT_BUSY && block_p50 >= 0) {
+			result.has_saved = 1;
+			result.saved_us = block_p50 - v4l2hist_percentile(&result.capture_to_dequeue, 50) / 1000.0;
+		}
+		printResult(&bc, &result);
+	}
+
+	v4l2copy_destroy(copier);
+	v4l2log_stop();
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
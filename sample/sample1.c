@@ -10,28 +10,13 @@
 #include <pthread.h>
 #include "v4l2core.h"
 #include "v4l2xu.h"
+#include "v4l2log.h"
+#include "v4l2rec.h"
 
 v4l2_dev_t* vd = NULL;
 static char* deviceName = "/dev/video0";
 static unsigned int bSaveVideo = 0;
-
-void* thread_task_capture(void)
-{
-    if(v4l2core_capture_init(vd)<0)
-    {
-        puts("Capture init error.");
-        pthread_exit(NULL);
-    }
-    if(v4l2core_capture_start(vd)<0)
-    {
-        puts("Can not start capture");
-        pthread_exit(NULL);
-    }
-    v4l2core_capture_loop(vd);
-    v4l2core_capture_stop(vd);
-    v4l2core_capture_uninit(vd);    
-    pthread_exit(NULL);
-}
+static CaptureThread capThread = { NULL, SCHED_OTHER, 0, CAPTURE_NODE_DEVICE };
 
 /**
 SIGINT interput handler
@@ -67,17 +52,21 @@ static void usage(FILE* fp, int argc, char** argv)
 		"Options:\n"
 		"\t-d | --device name       Video device name [default:/dev/video0]\n"
 		"\t-v | --save video file   Save video data to file,file name:out.avi\n"
+		"\t-c | --cpus list         Run the capture thread on these cpus, like 2,4-7\n"
+		"\t-p | --priority n        SCHED_FIFO priority of the capture thread\n"
         "\t-h | --help              Print this message\n"
 		"",
 		argv[0]);
 }
 
-static const char short_options [] = "d:vh";
+static const char short_options [] = "d:vc:p:h";
 
 static const struct option
 long_options [] = {
 	{ "device",             required_argument,      NULL,           'd' },
 	{ "save video",         no_argument,            NULL,           'v' },
+	{ "cpus",               required_argument,      NULL,           'c' },
+	{ "priority",           required_argument,      NULL,           'p' },
     { "help",               no_argument,            NULL,           'h' },
 	{ 0, 0, 0, 0 }
 };
@@ -102,6 +91,13 @@ int main(int argc,char **argv)
             case 'v':
                 bSaveVideo = 1;
                 break;
+            case 'c':
+                capThread.cpus = optarg;
+                break;
+            case 'p':
+                capThread.priority = atoi(optarg);
+                capThread.policy = capThread.priority ? SCHED_FIFO : SCHED_OTHER;
+                break;
             case 'h':
             default:
 				usage(stderr, argc, argv);
@@ -123,17 +119,58 @@ int main(int argc,char **argv)
 
     InstallSIGINTHandler();
 
-    int ret = 0;
-    pthread_t tid_capture;
-    ret = pthread_create(&tid_capture,NULL,(void*)thread_task_capture(),NULL);
-    if(ret)
+    //keep log output off the capture thread
+    v4l2log_start();
+
+    //capture on a library thread, on the device's NUMA node unless -c says otherwise
+    if(v4l2core_capture_set_thread(vd,&capThread)<0)
+    {
+        puts("Bad capture thread settings.");
+        exit(EXIT_FAILURE);
+    }
+    //the recorder holds leases while it writes, give the driver buffers to spare
+    if(bSaveVideo && v4l2core_capture_set_ring(vd,8,0)<0)
+    {
+        puts("Can't set up capture buffers.");
+        exit(EXIT_FAILURE);
+    }
+    if(v4l2core_capture_init(vd)<0)
+    {
+        puts("Capture init error.");
+        exit(EXIT_FAILURE);
+    }
+    v4l2_rec_t* rec = NULL;
+    if(bSaveVideo)
+    {
+        rec = v4l2rec_open(vd,"out.avi",REC_AVI,4);
+        if(rec == NULL)
+            puts("Can't record out.avi, capturing without saving.");
+    }
+    if(v4l2core_capture_start(vd)<0 || v4l2core_capture_thread_start(vd)<0)
     {
-        puts("create capture thread error!");
+        puts("Can not start capture");
         exit(EXIT_FAILURE);
     }
 
-    pthread_join(tid_capture,NULL);
+    while(vd->bcapture)
+        sleep(1);
+
+    CaptureStats stats;
+    v4l2core_capture_thread_stop(vd);
+    if(rec)
+    {
+        RecStats rs;
+        v4l2rec_stats(rec,&rs);
+        v4l2rec_close(rec);
+        printf("out.avi: %" PRIu64 " frames dropped by the writer\n",rs.dropped);
+    }
+    v4l2core_capture_stop(vd);
+    v4l2core_get_stats(vd,&stats);
+    printf("%" PRIu64 " frames, %" PRIu64 " dropped, capture thread cpu %.3f s\n",
+        stats.frames, stats.dropped, stats.thread_cpu_ns / 1e9);
+    v4l2core_capture_uninit(vd);
     v4l2core_dev_close(vd);
+    v4l2log_stop();
 
     return 0;
 }
\ No newline at end of file
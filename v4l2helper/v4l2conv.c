@@ -0,0 +1,1004 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include "v4l2conv.h"
+#include "v4l2log.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CONV_X86
+#endif
+#if defined(__aarch64__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define CONV_HAVE_NEON
+#endif
+
+#define CONV_ALIGN          64
+
+/* BT.601 limited range in 6 fractional bits: small enough for 16 bit
+   lanes, the one sum that can overflow saturates past 255 either way. */
+#define CONV_YG             75      //1.164
+#define CONV_RV             102     //1.596
+#define CONV_GU             25      //0.392
+#define CONV_GV             52      //0.813
+#define CONV_BU             129     //2.017
+
+typedef enum conv_layout{
+    LAYOUT_PACKED,      //Y0 U Y1 V, or U Y0 V Y1 when swapped
+    LAYOUT_PLANAR,      //Y, U and V planes, V before U in memory when swapped
+    LAYOUT_SEMI,        //Y and interleaved UV, VU when swapped
+    LAYOUT_GREY,
+    LAYOUT_RGB,         //BGR when swapped
+}conv_layout;
+
+typedef struct ConvFormat{
+    uint32_t     pixelformat;
+    conv_layout  layout;
+    uint8_t      swap;
+    uint8_t      mplane;        //one memory plane per image plane
+}ConvFormat;
+
+static const ConvFormat convFormats[] = {
+	{ V4L2_PIX_FMT_YUYV,    LAYOUT_PACKED, 0, 0 },
+	{ V4L2_PIX_FMT_UYVY,    LAYOUT_PACKED, 1, 0 },
+	{ V4L2_PIX_FMT_GREY,    LAYOUT_GREY,   0, 0 },
+	{ V4L2_PIX_FMT_NV12,    LAYOUT_SEMI,   0, 0 },
+	{ V4L2_PIX_FMT_NV21,    LAYOUT_SEMI,   1, 0 },
+	{ V4L2_PIX_FMT_NV12M,   LAYOUT_SEMI,   0, 1 },
+	{ V4L2_PIX_FMT_NV21M,   LAYOUT_SEMI,   1, 1 },
+	{ V4L2_PIX_FMT_YUV420,  LAYOUT_PLANAR, 0, 0 },
+	{ V4L2_PIX_FMT_YVU420,  LAYOUT_PLANAR, 1, 0 },
+	{ V4L2_PIX_FMT_YUV420M, LAYOUT_PLANAR, 0, 1 },
+	{ V4L2_PIX_FMT_YVU420M, LAYOUT_PLANAR, 1, 1 },
+	{ V4L2_PIX_FMT_RGB24,   LAYOUT_RGB,    0, 0 },
+	{ V4L2_PIX_FMT_BGR24,   LAYOUT_RGB,    1, 0 },
+};
+
+/*
+    Row kernels; widths are in pixels and even wherever chroma is
+    subsampled, n counts chroma samples.
+*/
+typedef struct ConvKernels{
+    void (*rgb)(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* dst, unsigned int w, int bgr);
+    void (*split422)(const uint8_t* src, uint8_t* y, uint8_t* u, uint8_t* v, unsigned int w, int uyvy);
+    void (*merge422)(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* dst, unsigned int w, int uyvy);
+    void (*splitUv)(const uint8_t* uv, uint8_t* u, uint8_t* v, unsigned int n);
+    void (*mergeUv)(const uint8_t* u, const uint8_t* v, uint8_t* uv, unsigned int n);
+    void (*average)(const uint8_t* a, const uint8_t* b, uint8_t* dst, unsigned int n);
+}ConvKernels;
+
+struct v4l2_conv_t{
+    conv_isa     isa;
+    uint8_t*     scratch;
+    unsigned int width;         //the scratch rows fit this wide an image
+    uint8_t*     y[2];          //unpacked rows, by row parity
+    uint8_t*     u[2];
+    uint8_t*     v[2];
+    uint8_t*     cu;            //chroma averaged over a row pair
+    uint8_t*     cv;
+    uint8_t*     neutral;       //chroma of grey
+};
+
+static inline uint8_t clamp8(int x)
+{
+	return x < 0 ? 0 : x > 255 ? 255 : x;
+}
+
+static void rgbScalar(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* dst, unsigned int w, int bgr)
+{
+	unsigned int x;
+
+	for (x = 0; x < w; ++x, dst += 3) {
+		int c = (y[x] - 16) * CONV_YG + 32;
+		int d = u[x / 2] - 128;
+		int e = v[x / 2] - 128;
+		uint8_t r = clamp8((c + CONV_RV * e) >> 6);
+		uint8_t g = clamp8((c - CONV_GU * d - CONV_GV * e) >> 6);
+		uint8_t b = clamp8((c + CONV_BU * d) >> 6);
+
+		dst[0] = bgr ? b : r;
+		dst[1] = g;
+		dst[2] = bgr ? r : b;
+	}
+}
+
+static void split422Scalar(const uint8_t* src, uint8_t* y, uint8_t* u, uint8_t* v, unsigned int w, int uyvy)
+{
+	int yo = uyvy ? 1 : 0, co = uyvy ? 0 : 1;
+	unsigned int x;
+
+	for (x = 0; x + 1 < w; x += 2, src += 4) {
+		y[x] = src[yo];
+		y[x + 1] = src[yo + 2];
+		u[x / 2] = src[co];
+		v[x / 2] = src[co + 2];
+	}
+}
+
+static void merge422Scalar(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* dst, unsigned int w, int uyvy)
+{
+	int yo = uyvy ? 1 : 0, co = uyvy ? 0 : 1;
+	unsigned int x;
+
+	for (x = 0; x + 1 < w; x += 2, dst += 4) {
+		dst[yo] = y[x];
+		dst[yo + 2] = y[x + 1];
+		dst[co] = u[x / 2];
+		dst[co + 2] = v[x / 2];
+	}
+}
+
+static void splitUvScalar(const uint8_t* uv, uint8_t* u, uint8_t* v, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; ++i) {
+		u[i] = uv[2 * i];
+		v[i] = uv[2 * i + 1];
+	}
+}
+
+static void mergeUvScalar(const uint8_t* u, const uint8_t* v, uint8_t* uv, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; ++i) {
+		uv[2 * i] = u[i];
+		uv[2 * i + 1] = v[i];
+	}
+}
+
+/**
+	rounding up like pavgb, so every isa agrees
+*/
+static void averageScalar(const uint8_t* a, const uint8_t* b, uint8_t* dst, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; ++i)
+		dst[i] = (a[i] + b[i] + 1) >> 1;
+}
+
+/**
+	RGB to Y and horizontally averaged U and V; scalar on every isa,
+	camera pipelines rarely go this way
+*/
+static void rgbToYuv(const uint8_t* src, uint8_t* y, uint8_t* u, uint8_t* v, unsigned int w, int bgr)
+{
+	int ri = bgr ? 2 : 0, bi = bgr ? 0 : 2;
+	unsigned int x;
+
+	for (x = 0; x < w; ++x)
+		y[x] = ((66 * src[3 * x + ri] + 129 * src[3 * x + 1] + 25 * src[3 * x + bi] + 128) >> 8) + 16;
+	for (x = 0; x < w; x += 2, src += 6) {
+		const uint8_t* p = x + 1 < w ? src + 3 : src;
+		int r = (src[ri] + p[ri] + 1) >> 1;
+		int g = (src[1] + p[1] + 1) >> 1;
+		int b = (src[bi] + p[bi] + 1) >> 1;
+
+		u[x / 2] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+		v[x / 2] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+	}
+}
+
+/**
+	RGB24 to BGR24 and back, without a lossy trip through YUV
+*/
+static void rgbSwap(const uint8_t* src, uint8_t* dst, unsigned int w)
+{
+	unsigned int x;
+
+	for (x = 0; x < w; ++x, src += 3, dst += 3) {
+		uint8_t r = src[0];
+
+		dst[0] = src[2];
+		dst[1] = src[1];
+		dst[2] = r;
+	}
+}
+
+#ifdef CONV_X86
+__attribute__((target("sse2")))
+static void rgbSse2(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* dst, unsigned int w, int bgr)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i k16 = _mm_set1_epi16(16), k128 = _mm_set1_epi16(128), round = _mm_set1_epi16(32);
+	const __m128i yg = _mm_set1_epi16(CONV_YG), rv = _mm_set1_epi16(CONV_RV);
+	const __m128i gu = _mm_set1_epi16(-CONV_GU), gv = _mm_set1_epi16(-CONV_GV), bu = _mm_set1_epi16(CONV_BU);
+	uint32_t px[16] __attribute__((aligned(16)));
+	unsigned int x, i;
+
+	/* Pixels go out as 4 byte stores, each overwriting the spare byte of the
+	   one before, so the last needs a pixel after the block to spill into. */
+	for (x = 0; x + 16 < w; x += 16, dst += 48) {
+		__m128i yy = _mm_loadu_si128((const __m128i*)(y + x));
+		__m128i d = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(u + x / 2)), zero), k128);
+		__m128i e = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(v + x / 2)), zero), k128);
+		__m128i rc = _mm_mullo_epi16(e, rv);
+		__m128i gc = _mm_add_epi16(_mm_mullo_epi16(d, gu), _mm_mullo_epi16(e, gv));
+		__m128i bc = _mm_mullo_epi16(d, bu);
+		__m128i ylo = _mm_add_epi16(_mm_mullo_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(yy, zero), k16), yg), round);
+		__m128i yhi = _mm_add_epi16(_mm_mullo_epi16(_mm_sub_epi16(_mm_unpackhi_epi8(yy, zero), k16), yg), round);
+		__m128i r, g, b, t, rg, bz;
+
+		r = _mm_packus_epi16(_mm_srai_epi16(_mm_adds_epi16(ylo, _mm_unpacklo_epi16(rc, rc)), 6),
+			_mm_srai_epi16(_mm_adds_epi16(yhi, _mm_unpackhi_epi16(rc, rc)), 6));
+		g = _mm_packus_epi16(_mm_srai_epi16(_mm_adds_epi16(ylo, _mm_unpacklo_epi16(gc, gc)), 6),
+			_mm_srai_epi16(_mm_adds_epi16(yhi, _mm_unpackhi_epi16(gc, gc)), 6));
+		b = _mm_packus_epi16(_mm_srai_epi16(_mm_adds_epi16(ylo, _mm_unpacklo_epi16(bc, bc)), 6),
+			_mm_srai_epi16(_mm_adds_epi16(yhi, _mm_unpackhi_epi16(bc, bc)), 6));
+		if (bgr) {
+			t = r;
+			r = b;
+			b = t;
+		}
+
+		rg = _mm_unpacklo_epi8(r, g);
+		bz = _mm_unpacklo_epi8(b, zero);
+		_mm_store_si128((__m128i*)(px + 0), _mm_unpacklo_epi16(rg, bz));
+		_mm_store_si128((__m128i*)(px + 4), _mm_unpackhi_epi16(rg, bz));
+		rg = _mm_unpackhi_epi8(r, g);
+		bz = _mm_unpackhi_epi8(b, zero);
+		_mm_store_si128((__m128i*)(px + 8), _mm_unpacklo_epi16(rg, bz));
+		_mm_store_si128((__m128i*)(px + 12), _mm_unpackhi_epi16(rg, bz));
+		for (i = 0; i < 16; ++i)
+			memcpy(dst + 3 * i, &px[i], 4);
+	}
+	rgbScalar(y + x, u + x / 2, v + x / 2, dst, w - x, bgr);
+}
+
+__attribute__((target("sse2")))
+static void split422Sse2(const uint8_t* src, uint8_t* y, uint8_t* u, uint8_t* v, unsigned int w, int uyvy)
+{
+	const __m128i m = _mm_set1_epi16(0xFF), zero = _mm_setzero_si128();
+	unsigned int x;
+
+	for (x = 0; x + 16 <= w; x += 16, src += 32) {
+		__m128i a = _mm_loadu_si128((const __m128i*)src);
+		__m128i b = _mm_loadu_si128((const __m128i*)(src + 16));
+		__m128i ya, yb, ca, cb, c;
+
+		if (uyvy) {
+			ya = _mm_srli_epi16(a, 8);
+			yb = _mm_srli_epi16(b, 8);
+			ca = _mm_and_si128(a, m);
+			cb = _mm_and_si128(b, m);
+		} else {
+			ya = _mm_and_si128(a, m);
+			yb = _mm_and_si128(b, m);
+			ca = _mm_srli_epi16(a, 8);
+			cb = _mm_srli_epi16(b, 8);
+		}
+		_mm_storeu_si128((__m128i*)(y + x), _mm_packus_epi16(ya, yb));
+		c = _mm_packus_epi16(ca, cb);
+		_mm_storel_epi64((__m128i*)(u + x / 2), _mm_packus_epi16(_mm_and_si128(c, m), zero));
+		_mm_storel_epi64((__m128i*)(v + x / 2), _mm_packus_epi16(_mm_srli_epi16(c, 8), zero));
+	}
+	split422Scalar(src, y + x, u + x / 2, v + x / 2, w - x, uyvy);
+}
+
+__attribute__((target("sse2")))
+static void merge422Sse2(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* dst, unsigned int w, int uyvy)
+{
+	unsigned int x;
+
+	for (x = 0; x + 16 <= w; x += 16, dst += 32) {
+		__m128i yy = _mm_loadu_si128((const __m128i*)(y + x));
+		__m128i c = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(u + x / 2)), _mm_loadl_epi64((const __m128i*)(v + x / 2)));
+
+		if (uyvy) {
+			_mm_storeu_si128((__m128i*)dst, _mm_unpacklo_epi8(c, yy));
+			_mm_storeu_si128((__m128i*)(dst + 16), _mm_unpackhi_epi8(c, yy));
+		} else {
+			_mm_storeu_si128((__m128i*)dst, _mm_unpacklo_epi8(yy, c));
+			_mm_storeu_si128((__m128i*)(dst + 16), _mm_unpackhi_epi8(yy, c));
+		}
+	}
+	merge422Scalar(y + x, u + x / 2, v + x / 2, dst, w - x, uyvy);
+}
+
+__attribute__((target("sse2")))
+static void splitUvSse2(const uint8_t* uv, uint8_t* u, uint8_t* v, unsigned int n)
+{
+	const __m128i m = _mm_set1_epi16(0xFF);
+	unsigned int i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(uv + 2 * i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(uv + 2 * i + 16));
+
+		_mm_storeu_si128((__m128i*)(u + i), _mm_packus_epi16(_mm_and_si128(a, m), _mm_and_si128(b, m)));
+		_mm_storeu_si128((__m128i*)(v + i), _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+	}
+	splitUvScalar(uv + 2 * i, u + i, v + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void mergeUvSse2(const uint8_t* u, const uint8_t* v, uint8_t* uv, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m128i uu = _mm_loadu_si128((const __m128i*)(u + i));
+		__m128i vv = _mm_loadu_si128((const __m128i*)(v + i));
+
+		_mm_storeu_si128((__m128i*)(uv + 2 * i), _mm_unpacklo_epi8(uu, vv));
+		_mm_storeu_si128((__m128i*)(uv + 2 * i + 16), _mm_unpackhi_epi8(uu, vv));
+	}
+	mergeUvScalar(u + i, v + i, uv + 2 * i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void averageSse2(const uint8_t* a, const uint8_t* b, uint8_t* dst, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i + 16 <= n; i += 16)
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(a + i)),
+			_mm_loadu_si128((const __m128i*)(b + i))));
+	averageScalar(a + i, b + i, dst + i, n - i);
+}
+
+/**
+	16 bit channel sums of 16 pixels in two vectors to 16 bytes in pixel order
+*/
+__attribute__((target("avx2")))
+static inline __m256i avx2Pack(__m256i lo, __m256i hi)
+{
+	return _mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_srai_epi16(lo, 6), _mm256_srai_epi16(hi, 6)), 0xD8);
+}
+
+__attribute__((target("avx2")))
+static void rgbAvx2(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* dst, unsigned int w, int bgr)
+{
+	const __m256i k16 = _mm256_set1_epi16(16), k128 = _mm256_set1_epi16(128), round = _mm256_set1_epi16(32);
+	const __m256i yg = _mm256_set1_epi16(CONV_YG), rv = _mm256_set1_epi16(CONV_RV);
+	const __m256i gu = _mm256_set1_epi16(-CONV_GU), gv = _mm256_set1_epi16(-CONV_GV), bu = _mm256_set1_epi16(CONV_BU);
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i pack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	unsigned int x, h;
+
+	/* 16 byte stores of 12 byte groups spill 4 bytes past the block. */
+	for (x = 0; x + 34 <= w; x += 32, dst += 96) {
+		__m256i yy = _mm256_loadu_si256((const __m256i*)(y + x));
+		__m256i d = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(u + x / 2))), k128);
+		__m256i e = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(v + x / 2))), k128);
+		__m256i ya = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm256_castsi256_si128(yy)), k16), yg), round);
+		__m256i yb = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm256_extracti128_si256(yy, 1)), k16), yg), round);
+		__m256i cc[3], lo, hi;
+		__m256i rgb[3];
+		__m128i r, g, b, rg, bz;
+		int c;
+
+		cc[0] = _mm256_mullo_epi16(e, rv);
+		cc[1] = _mm256_add_epi16(_mm256_mullo_epi16(d, gu), _mm256_mullo_epi16(e, gv));
+		cc[2] = _mm256_mullo_epi16(d, bu);
+		for (c = 0; c < 3; ++c) {
+			/* Each chroma term serves two pixels; unpacking works per lane, so swap the middle quarters back. */
+			lo = _mm256_unpacklo_epi16(cc[c], cc[c]);
+			hi = _mm256_unpackhi_epi16(cc[c], cc[c]);
+			rgb[c] = avx2Pack(_mm256_adds_epi16(ya, _mm256_permute2x128_si256(lo, hi, 0x20)),
+				_mm256_adds_epi16(yb, _mm256_permute2x128_si256(lo, hi, 0x31)));
+		}
+		if (bgr) {
+			lo = rgb[0];
+			rgb[0] = rgb[2];
+			rgb[2] = lo;
+		}
+
+		for (h = 0; h < 2; ++h) {
+			r = h ? _mm256_extracti128_si256(rgb[0], 1) : _mm256_castsi256_si128(rgb[0]);
+			g = h ? _mm256_extracti128_si256(rgb[1], 1) : _mm256_castsi256_si128(rgb[1]);
+			b = h ? _mm256_extracti128_si256(rgb[2], 1) : _mm256_castsi256_si128(rgb[2]);
+			rg = _mm_unpacklo_epi8(r, g);
+			bz = _mm_unpacklo_epi8(b, zero);
+			_mm_storeu_si128((__m128i*)(dst + 48 * h + 0), _mm_shuffle_epi8(_mm_unpacklo_epi16(rg, bz), pack));
+			_mm_storeu_si128((__m128i*)(dst + 48 * h + 12), _mm_shuffle_epi8(_mm_unpackhi_epi16(rg, bz), pack));
+			rg = _mm_unpackhi_epi8(r, g);
+			bz = _mm_unpackhi_epi8(b, zero);
+			_mm_storeu_si128((__m128i*)(dst + 48 * h + 24), _mm_shuffle_epi8(_mm_unpacklo_epi16(rg, bz), pack));
+			_mm_storeu_si128((__m128i*)(dst + 48 * h + 36), _mm_shuffle_epi8(_mm_unpackhi_epi16(rg, bz), pack));
+		}
+	}
+	_mm256_zeroupper();
+	rgbScalar(y + x, u + x / 2, v + x / 2, dst, w - x, bgr);
+}
+
+__attribute__((target("avx2")))
+static void split422Avx2(const uint8_t* src, uint8_t* y, uint8_t* u, uint8_t* v, unsigned int w, int uyvy)
+{
+	const __m256i m = _mm256_set1_epi16(0xFF);
+	unsigned int x;
+
+	for (x = 0; x + 32 <= w; x += 32, src += 64) {
+		__m256i a = _mm256_loadu_si256((const __m256i*)src);
+		__m256i b = _mm256_loadu_si256((const __m256i*)(src + 32));
+		__m256i ya, yb, ca, cb, c;
+
+		if (uyvy) {
+			ya = _mm256_srli_epi16(a, 8);
+			yb = _mm256_srli_epi16(b, 8);
+			ca = _mm256_and_si256(a, m);
+			cb = _mm256_and_si256(b, m);
+		} else {
+			ya = _mm256_and_si256(a, m);
+			yb = _mm256_and_si256(b, m);
+			ca = _mm256_srli_epi16(a, 8);
+			cb = _mm256_srli_epi16(b, 8);
+		}
+		_mm256_storeu_si256((__m256i*)(y + x), _mm256_permute4x64_epi64(_mm256_packus_epi16(ya, yb), 0xD8));
+		c = _mm256_permute4x64_epi64(_mm256_packus_epi16(ca, cb), 0xD8);
+		/* U0-7 V0-7 U8-15 V8-15 to U0-15 V0-15 */
+		c = _mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_and_si256(c, m), _mm256_srli_epi16(c, 8)), 0xD8);
+		_mm_storeu_si128((__m128i*)(u + x / 2), _mm256_castsi256_si128(c));
+		_mm_storeu_si128((__m128i*)(v + x / 2), _mm256_extracti128_si256(c, 1));
+	}
+	_mm256_zeroupper();
+	split422Sse2(src, y + x, u + x / 2, v + x / 2, w - x, uyvy);
+}
+
+__attribute__((target("avx2")))
+static void merge422Avx2(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* dst, unsigned int w, int uyvy)
+{
+	unsigned int x;
+
+	for (x = 0; x + 32 <= w; x += 32, dst += 64) {
+		__m256i yy = _mm256_loadu_si256((const __m256i*)(y + x));
+		__m128i uu = _mm_loadu_si128((const __m128i*)(u + x / 2));
+		__m128i vv = _mm_loadu_si128((const __m128i*)(v + x / 2));
+		__m256i c = _mm256_set_m128i(_mm_unpackhi_epi8(uu, vv), _mm_unpacklo_epi8(uu, vv));
+		__m256i lo, hi;
+
+		if (uyvy) {
+			lo = _mm256_unpacklo_epi8(c, yy);
+			hi = _mm256_unpackhi_epi8(c, yy);
+		} else {
+			lo = _mm256_unpacklo_epi8(yy, c);
+			hi = _mm256_unpackhi_epi8(yy, c);
+		}
+		_mm256_storeu_si256((__m256i*)dst, _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i*)(dst + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+	_mm256_zeroupper();
+	merge422Sse2(y + x, u + x / 2, v + x / 2, dst, w - x, uyvy);
+}
+
+__attribute__((target("avx2")))
+static void splitUvAvx2(const uint8_t* uv, uint8_t* u, uint8_t* v, unsigned int n)
+{
+	const __m256i m = _mm256_set1_epi16(0xFF);
+	unsigned int i;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i*)(uv + 2 * i));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(uv + 2 * i + 32));
+
+		_mm256_storeu_si256((__m256i*)(u + i),
+			_mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_and_si256(a, m), _mm256_and_si256(b, m)), 0xD8));
+		_mm256_storeu_si256((__m256i*)(v + i),
+			_mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8)), 0xD8));
+	}
+	_mm256_zeroupper();
+	splitUvSse2(uv + 2 * i, u + i, v + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void mergeUvAvx2(const uint8_t* u, const uint8_t* v, uint8_t* uv, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		__m256i uu = _mm256_loadu_si256((const __m256i*)(u + i));
+		__m256i vv = _mm256_loadu_si256((const __m256i*)(v + i));
+		__m256i lo = _mm256_unpacklo_epi8(uu, vv);
+		__m256i hi = _mm256_unpackhi_epi8(uu, vv);
+
+		_mm256_storeu_si256((__m256i*)(uv + 2 * i), _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i*)(uv + 2 * i + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+	_mm256_zeroupper();
+	mergeUvSse2(u + i, v + i, uv + 2 * i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void averageAvx2(const uint8_t* a, const uint8_t* b, uint8_t* dst, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i + 32 <= n; i += 32)
+		_mm256_storeu_si256((__m256i*)(dst + i), _mm256_avg_epu8(_mm256_loadu_si256((const __m256i*)(a + i)),
+			_mm256_loadu_si256((const __m256i*)(b + i))));
+	_mm256_zeroupper();
+	averageSse2(a + i, b + i, dst + i, n - i);
+}
+#endif
+
+#ifdef CONV_HAVE_NEON
+/**
+	one channel of 16 pixels from the Y terms and 8 chroma terms
+*/
+static inline uint8x16_t neonChannel(int16x8_t ylo, int16x8_t yhi, int16x8_t cc)
+{
+	int16x8x2_t dup = vzipq_s16(cc, cc);
+
+	return vcombine_u8(vqmovun_s16(vshrq_n_s16(vqaddq_s16(ylo, dup.val[0]), 6)),
+		vqmovun_s16(vshrq_n_s16(vqaddq_s16(yhi, dup.val[1]), 6)));
+}
+
+static void rgbNeon(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* dst, unsigned int w, int bgr)
+{
+	const uint8x8_t k16 = vdup_n_u8(16), k128 = vdup_n_u8(128);
+	const int16x8_t round = vdupq_n_s16(32);
+	unsigned int x;
+
+	for (x = 0; x + 16 <= w; x += 16, dst += 48) {
+		uint8x16_t yy = vld1q_u8(y + x);
+		int16x8_t d = vreinterpretq_s16_u16(vsubl_u8(vld1_u8(u + x / 2), k128));
+		int16x8_t e = vreinterpretq_s16_u16(vsubl_u8(vld1_u8(v + x / 2), k128));
+		int16x8_t ylo = vmlaq_n_s16(round, vreinterpretq_s16_u16(vsubl_u8(vget_low_u8(yy), k16)), CONV_YG);
+		int16x8_t yhi = vmlaq_n_s16(round, vreinterpretq_s16_u16(vsubl_u8(vget_high_u8(yy), k16)), CONV_YG);
+		uint8x16x3_t out;
+
+		out.val[1] = neonChannel(ylo, yhi, vmlaq_n_s16(vmulq_n_s16(d, -CONV_GU), e, -CONV_GV));
+		out.val[bgr ? 2 : 0] = neonChannel(ylo, yhi, vmulq_n_s16(e, CONV_RV));
+		out.val[bgr ? 0 : 2] = neonChannel(ylo, yhi, vmulq_n_s16(d, CONV_BU));
+		vst3q_u8(dst, out);
+	}
+	rgbScalar(y + x, u + x / 2, v + x / 2, dst, w - x, bgr);
+}
+
+static void split422Neon(const uint8_t* src, uint8_t* y, uint8_t* u, uint8_t* v, unsigned int w, int uyvy)
+{
+	unsigned int x;
+
+	for (x = 0; x + 32 <= w; x += 32, src += 64) {
+		uint8x16x4_t q = vld4q_u8(src);
+		uint8x16x2_t yy;
+
+		yy.val[0] = q.val[uyvy ? 1 : 0];
+		yy.val[1] = q.val[uyvy ? 3 : 2];
+		vst2q_u8(y + x, yy);
+		vst1q_u8(u + x / 2, q.val[uyvy ? 0 : 1]);
+		vst1q_u8(v + x / 2, q.val[uyvy ? 2 : 3]);
+	}
+	split422Scalar(src, y + x, u + x / 2, v + x / 2, w - x, uyvy);
+}
+
+static void merge422Neon(const uint8_t* y, const uint8_t* u, const uint8_t* v, uint8_t* dst, unsigned int w, int uyvy)
+{
+	unsigned int x;
+
+	for (x = 0; x + 32 <= w; x += 32, dst += 64) {
+		uint8x16x2_t yy = vld2q_u8(y + x);
+		uint8x16x4_t q;
+
+		q.val[uyvy ? 1 : 0] = yy.val[0];
+		q.val[uyvy ? 3 : 2] = yy.val[1];
+		q.val[uyvy ? 0 : 1] = vld1q_u8(u + x / 2);
+		q.val[uyvy ? 2 : 3] = vld1q_u8(v + x / 2);
+		vst4q_u8(dst, q);
+	}
+	merge422Scalar(y + x, u + x / 2, v + x / 2, dst, w - x, uyvy);
+}
+
+static void splitUvNeon(const uint8_t* uv, uint8_t* u, uint8_t* v, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		uint8x16x2_t q = vld2q_u8(uv + 2 * i);
+
+		vst1q_u8(u + i, q.val[0]);
+		vst1q_u8(v + i, q.val[1]);
+	}
+	splitUvScalar(uv + 2 * i, u + i, v + i, n - i);
+}
+
+static void mergeUvNeon(const uint8_t* u, const uint8_t* v, uint8_t* uv, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		uint8x16x2_t q;
+
+		q.val[0] = vld1q_u8(u + i);
+		q.val[1] = vld1q_u8(v + i);
+		vst2q_u8(uv + 2 * i, q);
+	}
+	mergeUvScalar(u + i, v + i, uv + 2 * i, n - i);
+}
+
+static void averageNeon(const uint8_t* a, const uint8_t* b, uint8_t* dst, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i + 16 <= n; i += 16)
+		vst1q_u8(dst + i, vrhaddq_u8(vld1q_u8(a + i), vld1q_u8(b + i)));
+	averageScalar(a + i, b + i, dst + i, n - i);
+}
+#endif
+
+static const ConvKernels convKernels[CONV_ISAS] = {
+	[CONV_SCALAR] = { rgbScalar, split422Scalar, merge422Scalar, splitUvScalar, mergeUvScalar, averageScalar },
+#ifdef CONV_X86
+	[CONV_SSE2] = { rgbSse2, split422Sse2, merge422Sse2, splitUvSse2, mergeUvSse2, averageSse2 },
+	[CONV_AVX2] = { rgbAvx2, split422Avx2, merge422Avx2, splitUvAvx2, mergeUvAvx2, averageAvx2 },
+#endif
+#ifdef CONV_HAVE_NEON
+	[CONV_NEON] = { rgbNeon, split422Neon, merge422Neon, splitUvNeon, mergeUvNeon, averageNeon },
+#endif
+};
+
+int v4l2conv_isa_supported(conv_isa isa)
+{
+	switch (isa) {
+		case CONV_SCALAR:
+			return 1;
+#ifdef CONV_X86
+		case CONV_SSE2:
+			__builtin_cpu_init();
+			return __builtin_cpu_supports("sse2");
+		case CONV_AVX2:
+			__builtin_cpu_init();
+			return __builtin_cpu_supports("avx2");
+#endif
+#ifdef CONV_HAVE_NEON
+		case CONV_NEON:
+			return 1;
+#endif
+		default:
+			return 0;
+	}
+}
+
+const char* v4l2conv_isa_name(conv_isa isa)
+{
+	static const char* names[CONV_ISAS] = { "scalar", "sse2", "avx2", "neon" };
+
+	return isa < CONV_ISAS ? names[isa] : "unknown";
+}
+
+/**
+	create a converter using the widest kernels this cpu runs; one per thread,
+	it keeps scratch rows
+*/
+v4l2_conv_t* v4l2conv_create(void)
+{
+	v4l2_conv_t* conv;
+	int isa;
+
+	conv = calloc(1, sizeof(v4l2_conv_t));
+	if (!conv) {
+		log_error("Out of memory");
+		return NULL;
+	}
+	for (isa = CONV_ISAS - 1; isa > CONV_SCALAR; --isa)
+		if (v4l2conv_isa_supported(isa))
+			break;
+	conv->isa = isa;
+	return conv;
+}
+
+void v4l2conv_destroy(v4l2_conv_t* conv)
+{
+	if (!conv)
+		return;
+	free(conv->scratch);
+	free(conv);
+}
+
+int v4l2conv_set_isa(v4l2_conv_t* conv, conv_isa isa)
+{
+	if (isa >= CONV_ISAS || !v4l2conv_isa_supported(isa)) {
+		log_error("conversion kernels for %s not supported here", v4l2conv_isa_name(isa));
+		return -1;
+	}
+	conv->isa = isa;
+	return 0;
+}
+
+conv_isa v4l2conv_isa(const v4l2_conv_t* conv)
+{
+	return conv->isa;
+}
+
+static const ConvFormat* convFormat(uint32_t pixelformat)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(convFormats) / sizeof(convFormats[0]); ++i)
+		if (convFormats[i].pixelformat == pixelformat)
+			return &convFormats[i];
+	return NULL;
+}
+
+int v4l2conv_supported(uint32_t pixelformat)
+{
+	return NULL != convFormat(pixelformat);
+}
+
+/**
+	bytes per row and rows of image plane p, 0 past the last plane
+*/
+static uint32_t convPlane(const ConvFormat* f, uint32_t width, uint32_t height, unsigned int p, uint32_t* rows)
+{
+	*rows = p ? height / 2 : height;
+	switch (f->layout) {
+		case LAYOUT_PACKED:
+			return p ? 0 : width * 2;
+		case LAYOUT_RGB:
+			return p ? 0 : width * 3;
+		case LAYOUT_GREY:
+			return p ? 0 : width;
+		case LAYOUT_SEMI:
+			return p < 2 ? width : 0;
+		case LAYOUT_PLANAR:
+			return p ? width / 2 : width;
+	}
+	return 0;
+}
+
+/**
+	lay out a tightly packed pixelformat image in buf, returns the bytes it
+	takes, 0 for formats not converted; img is set up only when it fits
+*/
+size_t v4l2conv_image(v4l2_image_t* img, uint32_t pixelformat, uint32_t width, uint32_t height, void* buf, size_t cap)
+{
+	const ConvFormat* f = convFormat(pixelformat);
+	uint32_t bpl, rows;
+	size_t size = 0, at[3] = { 0, 0, 0 };
+	unsigned int p;
+
+	if (!f)
+		return 0;
+	for (p = 0; p < 3 && (bpl = convPlane(f, width, height, p, &rows)); ++p) {
+		at[p] = size;
+		size += (size_t)bpl * rows;
+	}
+	if (!buf || size > cap)
+		return size;
+
+	memset(img, 0, sizeof(*img));
+	img->pixelformat = pixelformat;
+	img->width = width;
+	img->height = height;
+	for (p = 0; p < 3 && (bpl = convPlane(f, width, height, p, &rows)); ++p) {
+		img->planes[p] = (uint8_t*)buf + at[p];
+		img->bytesperline[p] = bpl;
+	}
+	/* YVU420 keeps V first in memory, planes[] stay Y, U, V. */
+	if (LAYOUT_PLANAR == f->layout && f->swap) {
+		img->planes[1] = (uint8_t*)buf + at[2];
+		img->planes[2] = (uint8_t*)buf + at[1];
+	}
+	return size;
+}
+
+/**
+	describe the planes of a captured frame, -1 for formats not converted
+	or a frame too short for its format
+*/
+int v4l2conv_frame_image(const v4l2_frame_t* frame, v4l2_image_t* img)
+{
+	const ConvFormat* f = convFormat(frame->pixelformat);
+	uint32_t bpl, rows, need = 0;
+	unsigned int p;
+
+	if (!f)
+		return -1;
+	memset(img, 0, sizeof(*img));
+	img->pixelformat = frame->pixelformat;
+	img->width = frame->width;
+	img->height = frame->height;
+
+	if (f->mplane) {
+		for (p = 0; p < 3 && convPlane(f, frame->width, frame->height, p, &rows); ++p) {
+			const v4l2_frame_plane_t* fp = &frame->planes[p];
+
+			if (p >= frame->n_planes || fp->bytesused < fp->data_offset
+			 || fp->bytesused - fp->data_offset < (size_t)fp->bytesperline * rows)
+				return -1;
+			img->planes[p] = (uint8_t*)fp->start + fp->data_offset;
+			img->bytesperline[p] = fp->bytesperline;
+		}
+	} else {
+		/* Contiguous planes follow Y at its line length, chroma lines halved for planar 4:2:0. */
+		const v4l2_frame_plane_t* fp = &frame->planes[0];
+		uint8_t* at = (uint8_t*)fp->start + fp->data_offset;
+		uint32_t y_bpl = frame->bytesperline ? frame->bytesperline : convPlane(f, frame->width, frame->height, 0, &rows);
+
+		for (p = 0; p < 3 && (bpl = convPlane(f, frame->width, frame->height, p, &rows)); ++p) {
+			bpl = LAYOUT_PLANAR == f->layout && p ? y_bpl / 2 : y_bpl;
+			img->planes[p] = at;
+			img->bytesperline[p] = bpl;
+			at += (size_t)bpl * rows;
+			need += bpl * rows;
+		}
+		if (fp->bytesused < fp->data_offset || fp->bytesused - fp->data_offset < need)
+			return -1;
+	}
+	if (LAYOUT_PLANAR == f->layout && f->swap) {
+		uint8_t* t = img->planes[1];
+
+		img->planes[1] = img->planes[2];
+		img->planes[2] = t;
+	}
+	return 0;
+}
+
+/**
+	scratch rows for images up to width pixels wide
+*/
+static int convScratch(v4l2_conv_t* conv, uint32_t width)
+{
+	size_t row = (width + CONV_ALIGN - 1) & ~(size_t)(CONV_ALIGN - 1);
+	size_t crow = ((width + 1) / 2 + CONV_ALIGN - 1) & ~(size_t)(CONV_ALIGN - 1);
+	void* p;
+	int i;
+
+	if (conv->scratch && width <= conv->width)
+		return 0;
+	if (posix_memalign(&p, CONV_ALIGN, 2 * row + 7 * crow)) {
+		log_error("Out of memory");
+		return -1;
+	}
+	free(conv->scratch);
+	conv->scratch = p;
+	conv->width = width;
+	for (i = 0; i < 2; ++i) {
+		conv->y[i] = conv->scratch + i * row;
+		conv->u[i] = conv->scratch + 2 * row + (2 * i) * crow;
+		conv->v[i] = conv->scratch + 2 * row + (2 * i + 1) * crow;
+	}
+	conv->cu = conv->scratch + 2 * row + 4 * crow;
+	conv->cv = conv->scratch + 2 * row + 5 * crow;
+	conv->neutral = conv->scratch + 2 * row + 6 * crow;
+	memset(conv->neutral, 128, crow);
+	return 0;
+}
+
+static int convSubsampled(const ConvFormat* f)
+{
+	return LAYOUT_PACKED == f->layout || LAYOUT_PLANAR == f->layout || LAYOUT_SEMI == f->layout;
+}
+
+static int convVertical(const ConvFormat* f)
+{
+	return LAYOUT_PLANAR == f->layout || LAYOUT_SEMI == f->layout;
+}
+
+/**
+	convert src into dst, both the same size; returns -1 for formats or
+	sizes that don't convert
+*/
+int v4l2conv(v4l2_conv_t* conv, const v4l2_image_t* src, const v4l2_image_t* dst)
+{
+	const ConvFormat* sf = convFormat(src->pixelformat);
+	const ConvFormat* df = convFormat(dst->pixelformat);
+	const ConvKernels* k = &convKernels[conv->isa];
+	uint32_t w = src->width, h = src->height, cw = (w + 1) / 2, row, bpl, rows;
+	unsigned int p;
+
+	if (!sf || !df || w != dst->width || h != dst->height) {
+		log_error("can't convert %.4s %ux%u to %.4s %ux%u", (const char*)&src->pixelformat, w, h,
+			(const char*)&dst->pixelformat, dst->width, dst->height);
+		return -1;
+	}
+	if (((convSubsampled(sf) || convSubsampled(df)) && (w & 1)) || ((convVertical(sf) || convVertical(df)) && (h & 1))) {
+		log_error("can't convert %ux%u, chroma subsampling needs even sizes", w, h);
+		return -1;
+	}
+
+	if (src->pixelformat == dst->pixelformat) {
+		for (p = 0; p < 3 && (bpl = convPlane(sf, w, h, p, &rows)); ++p)
+			for (row = 0; row < rows; ++row)
+				memcpy(dst->planes[p] + (size_t)row * dst->bytesperline[p],
+					src->planes[p] + (size_t)row * src->bytesperline[p], bpl);
+		return 0;
+	}
+	if (LAYOUT_RGB == sf->layout && LAYOUT_RGB == df->layout) {
+		for (row = 0; row < h; ++row)
+			rgbSwap(src->planes[0] + (size_t)row * src->bytesperline[0], dst->planes[0] + (size_t)row * dst->bytesperline[0], w);
+		return 0;
+	}
+	if (convScratch(conv, w) < 0)
+		return -1;
+
+	for (row = 0; row < h; ++row) {
+		const uint8_t* in = src->planes[0] + (size_t)row * src->bytesperline[0];
+		uint8_t* out = dst->planes[0] + (size_t)row * dst->bytesperline[0];
+		unsigned int odd = row & 1;
+		/* Planar targets take Y straight into their Y plane. */
+		uint8_t* yrow = LAYOUT_PACKED == df->layout || LAYOUT_RGB == df->layout ? conv->y[odd] : out;
+		const uint8_t *y = yrow, *u = conv->u[odd], *v = conv->v[odd];
+
+		switch (sf->layout) {
+			case LAYOUT_PACKED:
+				k->split422(in, yrow, conv->u[odd], conv->v[odd], w, sf->swap);
+				break;
+			case LAYOUT_RGB:
+				rgbToYuv(in, yrow, conv->u[odd], conv->v[odd], w, sf->swap);
+				break;
+			case LAYOUT_GREY:
+				y = in;
+				u = v = conv->neutral;
+				break;
+			case LAYOUT_PLANAR:
+				y = in;
+				u = src->planes[1] + (size_t)(row / 2) * src->bytesperline[1];
+				v = src->planes[2] + (size_t)(row / 2) * src->bytesperline[2];
+				break;
+			case LAYOUT_SEMI:
+				/* Both rows of a pair share the chroma row, split it once. */
+				y = in;
+				u = conv->u[0];
+				v = conv->v[0];
+				if (!odd)
+					k->splitUv(src->planes[1] + (size_t)(row / 2) * src->bytesperline[1],
+						sf->swap ? conv->v[0] : conv->u[0], sf->swap ? conv->u[0] : conv->v[0], cw);
+				break;
+		}
+
+		switch (df->layout) {
+			case LAYOUT_RGB:
+				k->rgb(y, u, v, out, w, df->swap);
+				break;
+			case LAYOUT_PACKED:
+				k->merge422(y, u, v, out, w, df->swap);
+				break;
+			case LAYOUT_GREY:
+			case LAYOUT_PLANAR:
+			case LAYOUT_SEMI:
+				if (y != out)
+					memcpy(out, y, w);
+				if (LAYOUT_GREY == df->layout)
+					break;
+
+				/* 4:2:0 sources have the pair's chroma on the first row, the
+				   others average the two rows on the second. */
+				if (convVertical(sf) || LAYOUT_GREY == sf->layout) {
+					if (odd)
+						break;
+				} else {
+					if (!odd)
+						break;
+					if (LAYOUT_PLANAR == df->layout) {
+						k->average(conv->u[0], conv->u[1], dst->planes[1] + (size_t)(row / 2) * dst->bytesperline[1], cw);
+						k->average(conv->v[0], conv->v[1], dst->planes[2] + (size_t)(row / 2) * dst->bytesperline[2], cw);
+						break;
+					}
+					k->average(conv->u[0], conv->u[1], conv->cu, cw);
+					k->average(conv->v[0], conv->v[1], conv->cv, cw);
+					u = conv->cu;
+					v = conv->cv;
+				}
+				if (LAYOUT_PLANAR == df->layout) {
+					memcpy(dst->planes[1] + (size_t)(row / 2) * dst->bytesperline[1], u, cw);
+					memcpy(dst->planes[2] + (size_t)(row / 2) * dst->bytesperline[2], v, cw);
+				} else {
+					k->mergeUv(df->swap ? v : u, df->swap ? u : v, dst->planes[1] + (size_t)(row / 2) * dst->bytesperline[1], cw);
+				}
+				break;
+		}
+	}
+	return 0;
+}
+
+/**
+	convert frame to a tightly packed pixelformat image in dst, returns the
+	bytes written or 0 when it doesn't convert or cap is too small
+*/
+size_t v4l2conv_frame(v4l2_conv_t* conv, const v4l2_frame_t* frame, uint32_t pixelformat, void* dst, size_t cap)
+{
+	v4l2_image_t in, out;
+	size_t size;
+
+	if (v4l2conv_frame_image(frame, &in) < 0)
+		return 0;
+	size = v4l2conv_image(&out, pixelformat, frame->width, frame->height, dst, cap);
+	if (!size || size > cap)
+		return 0;
+	return v4l2conv(conv, &in, &out) < 0 ? 0 : size;
+}
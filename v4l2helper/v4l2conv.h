@@ -0,0 +1,62 @@
+#ifndef V4L2CONV_H_INCLUDED
+#define V4L2CONV_H_INCLUDED
+#include "v4l2core.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+    Converts between the uncompressed formats cameras deliver: YUYV,
+    UYVY, GREY, NV12, NV21, YUV420 (I420), YVU420, their multi-planar
+    variants, RGB24 and BGR24.  Each row is unpacked to planar Y, U and V
+    and packed again in the target format, so any pair converts; the row
+    kernels are SSE2, AVX2 or NEON, picked at runtime, over a scalar
+    fallback that gives the same bytes.  Colour is BT.601 limited range.
+    MJPEG and H.264 need a decoder and are not handled here.
+*/
+typedef enum conv_isa{
+    CONV_SCALAR,
+    CONV_SSE2,
+    CONV_AVX2,
+    CONV_NEON,
+    CONV_ISAS,
+}conv_isa;
+
+typedef struct v4l2_image_t{
+    uint32_t     pixelformat;
+    uint32_t     width;
+    uint32_t     height;
+    uint8_t*     planes[3];     //Y then U and V, or the interleaved chroma, for planar formats
+    uint32_t     bytesperline[3];
+}v4l2_image_t;
+
+typedef struct v4l2_conv_t v4l2_conv_t;
+
+v4l2_conv_t* v4l2conv_create(void);
+
+void v4l2conv_destroy(v4l2_conv_t* conv);
+
+int v4l2conv_isa_supported(conv_isa isa);
+
+int v4l2conv_set_isa(v4l2_conv_t* conv, conv_isa isa);
+
+conv_isa v4l2conv_isa(const v4l2_conv_t* conv);
+
+const char* v4l2conv_isa_name(conv_isa isa);
+
+int v4l2conv_supported(uint32_t pixelformat);
+
+size_t v4l2conv_image(v4l2_image_t* img, uint32_t pixelformat, uint32_t width, uint32_t height, void* buf, size_t cap);
+
+int v4l2conv_frame_image(const v4l2_frame_t* frame, v4l2_image_t* img);
+
+int v4l2conv(v4l2_conv_t* conv, const v4l2_image_t* src, const v4l2_image_t* dst);
+
+size_t v4l2conv_frame(v4l2_conv_t* conv, const v4l2_frame_t* frame, uint32_t pixelformat, void* dst, size_t cap);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // V4L2CONV_H_INCLUDED
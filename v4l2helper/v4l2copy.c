@@ -0,0 +1,451 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <pthread.h>
+#include "v4l2copy.h"
+#include "v4l2log.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define COPY_X86
+#endif
+
+#define COPY_MAX_THREADS    16
+#define COPY_STRIPE_ALIGN   64
+#define COPY_STRIPE_MIN     (1u << 20)  //smaller stripes cost more to hand out than to copy
+#define COPY_CALIBRATE_NS   2000000     //time each candidate for at least this long
+
+typedef void (*CopyFn)(uint8_t* dst, const uint8_t* src, size_t n);
+
+typedef struct CopyJob{
+    uint8_t*        dst;
+    const uint8_t*  src;
+    size_t          n;
+    size_t          stripe;
+}CopyJob;
+
+struct v4l2_copy_t{
+    copy_method     method;
+    size_t          stripe_min;     //stripe copies of at least this many bytes
+    unsigned int    n_threads;      //workers plus the calling thread
+    pthread_t       threads[COPY_MAX_THREADS];
+    unsigned int    n_started;
+    pthread_mutex_t job_lock;       //one striped copy at a time
+    pthread_mutex_t lock;
+    pthread_cond_t  work;           //signalled when a job is posted
+    pthread_cond_t  done;           //signalled when the last stripe finished
+    CopyJob         job;
+    uint64_t        generation;     //bumped for every job
+    unsigned int    pending;        //stripes not finished yet
+    uint8_t         stop;
+};
+
+static void copyMemcpy(uint8_t* dst, const uint8_t* src, size_t n)
+{
+	memcpy(dst, src, n);
+}
+
+#ifdef COPY_X86
+/**
+	bring dst to an align boundary, the streaming stores need it
+*/
+static size_t copyHead(uint8_t* dst, const uint8_t* src, size_t n, size_t align)
+{
+	size_t head = (align - ((uintptr_t)dst & (align - 1))) & (align - 1);
+
+	if (head > n)
+		head = n;
+	memcpy(dst, src, head);
+	return head;
+}
+
+__attribute__((target("sse4.1")))
+static void copySse41(uint8_t* dst, const uint8_t* src, size_t n)
+{
+	size_t head = copyHead(dst, src, n, 16);
+
+	dst += head;
+	src += head;
+	n -= head;
+
+	if (0 == ((uintptr_t)src & 15)) {
+		for (; n >= 64; n -= 64, src += 64, dst += 64) {
+			__m128i a = _mm_stream_load_si128((__m128i*)(src + 0));
+			__m128i b = _mm_stream_load_si128((__m128i*)(src + 16));
+			__m128i c = _mm_stream_load_si128((__m128i*)(src + 32));
+			__m128i d = _mm_stream_load_si128((__m128i*)(src + 48));
+
+			_mm_stream_si128((__m128i*)(dst + 0), a);
+			_mm_stream_si128((__m128i*)(dst + 16), b);
+			_mm_stream_si128((__m128i*)(dst + 32), c);
+			_mm_stream_si128((__m128i*)(dst + 48), d);
+		}
+	} else {
+		/* Source and destination disagree on alignment, only the stores stream. */
+		for (; n >= 64; n -= 64, src += 64, dst += 64) {
+			__m128i a = _mm_loadu_si128((const __m128i*)(src + 0));
+			__m128i b = _mm_loadu_si128((const __m128i*)(src + 16));
+			__m128i c = _mm_loadu_si128((const __m128i*)(src + 32));
+			__m128i d = _mm_loadu_si128((const __m128i*)(src + 48));
+
+			_mm_stream_si128((__m128i*)(dst + 0), a);
+			_mm_stream_si128((__m128i*)(dst + 16), b);
+			_mm_stream_si128((__m128i*)(dst + 32), c);
+			_mm_stream_si128((__m128i*)(dst + 48), d);
+		}
+	}
+	_mm_sfence();
+	memcpy(dst, src, n);
+}
+
+__attribute__((target("avx2")))
+static void copyAvx2(uint8_t* dst, const uint8_t* src, size_t n)
+{
+	size_t head = copyHead(dst, src, n, 32);
+
+	dst += head;
+	src += head;
+	n -= head;
+
+	if (0 == ((uintptr_t)src & 31)) {
+		for (; n >= 128; n -= 128, src += 128, dst += 128) {
+			__m256i a = _mm256_stream_load_si256((const __m256i*)(src + 0));
+			__m256i b = _mm256_stream_load_si256((const __m256i*)(src + 32));
+			__m256i c = _mm256_stream_load_si256((const __m256i*)(src + 64));
+			__m256i d = _mm256_stream_load_si256((const __m256i*)(src + 96));
+
+			_mm256_stream_si256((__m256i*)(dst + 0), a);
+			_mm256_stream_si256((__m256i*)(dst + 32), b);
+			_mm256_stream_si256((__m256i*)(dst + 64), c);
+			_mm256_stream_si256((__m256i*)(dst + 96), d);
+		}
+	} else {
+		for (; n >= 128; n -= 128, src += 128, dst += 128) {
+			__m256i a = _mm256_loadu_si256((const __m256i*)(src + 0));
+			__m256i b = _mm256_loadu_si256((const __m256i*)(src + 32));
+			__m256i c = _mm256_loadu_si256((const __m256i*)(src + 64));
+			__m256i d = _mm256_loadu_si256((const __m256i*)(src + 96));
+
+			_mm256_stream_si256((__m256i*)(dst + 0), a);
+			_mm256_stream_si256((__m256i*)(dst + 32), b);
+			_mm256_stream_si256((__m256i*)(dst + 64), c);
+			_mm256_stream_si256((__m256i*)(dst + 96), d);
+		}
+	}
+	_mm_sfence();
+	_mm256_zeroupper();
+	memcpy(dst, src, n);
+}
+#endif
+
+static CopyFn copyFn(copy_method method)
+{
+	switch (method) {
+#ifdef COPY_X86
+		case COPY_STREAM_SSE41:
+			return copySse41;
+		case COPY_STREAM_AVX2:
+			return copyAvx2;
+#endif
+		default:
+			return copyMemcpy;
+	}
+}
+
+int v4l2copy_supported(copy_method method)
+{
+	switch (method) {
+		case COPY_MEMCPY:
+			return 1;
+#ifdef COPY_X86
+		case COPY_STREAM_SSE41:
+			__builtin_cpu_init();
+			return __builtin_cpu_supports("sse4.1");
+		case COPY_STREAM_AVX2:
+			__builtin_cpu_init();
+			return __builtin_cpu_supports("avx2");
+#endif
+		default:
+			return 0;
+	}
+}
+
+const char* v4l2copy_name(copy_method method)
+{
+	static const char* names[COPY_METHODS] = { "memcpy", "sse4.1", "avx2" };
+
+	return method < COPY_METHODS ? names[method] : "unknown";
+}
+
+/**
+	copy stripe i of the posted job
+*/
+static void copyStripe(v4l2_copy_t* cp, const CopyJob* job, unsigned int i)
+{
+	size_t off = i * job->stripe;
+	size_t n;
+
+	if (off >= job->n)
+		return;
+	n = job->n - off < job->stripe ? job->n - off : job->stripe;
+	copyFn(cp->method)(job->dst + off, job->src + off, n);
+}
+
+static void* copyWorker(void* arg)
+{
+	v4l2_copy_t* cp = arg;
+	uint64_t seen = 0;
+	unsigned int i;
+	CopyJob job;
+
+	pthread_mutex_lock(&cp->lock);
+	i = ++cp->n_started;
+	for (;;) {
+		while (!cp->stop && cp->generation == seen)
+			pthread_cond_wait(&cp->work, &cp->lock);
+		if (cp->stop)
+			break;
+		seen = cp->generation;
+		job = cp->job;
+		pthread_mutex_unlock(&cp->lock);
+
+		copyStripe(cp, &job, i);
+
+		pthread_mutex_lock(&cp->lock);
+		if (0 == --cp->pending)
+			pthread_cond_signal(&cp->done);
+	}
+	pthread_mutex_unlock(&cp->lock);
+	return NULL;
+}
+
+/**
+	create a copier using up to n_threads threads, the caller's included, on big copies
+*/
+v4l2_copy_t* v4l2copy_create(unsigned int n_threads)
+{
+	v4l2_copy_t* cp;
+	unsigned int i;
+
+	if (n_threads < 1)
+		n_threads = 1;
+	if (n_threads > COPY_MAX_THREADS)
+		n_threads = COPY_MAX_THREADS;
+
+	cp = calloc(1, sizeof(v4l2_copy_t));
+	if (!cp) {
+		log_error("Out of memory");
+		return NULL;
+	}
+	cp->method = COPY_MEMCPY;
+	cp->n_threads = n_threads;
+	cp->stripe_min = n_threads > 1 ? COPY_STRIPE_MIN * n_threads : SIZE_MAX;
+	pthread_mutex_init(&cp->job_lock, NULL);
+	pthread_mutex_init(&cp->lock, NULL);
+	pthread_cond_init(&cp->work, NULL);
+	pthread_cond_init(&cp->done, NULL);
+
+	for (i = 1; i < n_threads; ++i) {
+		if (pthread_create(&cp->threads[i], NULL, copyWorker, cp)) {
+			log_error("pthread_create failed, copying on %u threads", i);
+			cp->n_threads = i;
+			break;
+		}
+	}
+	return cp;
+}
+
+void v4l2copy_destroy(v4l2_copy_t* cp)
+{
+	unsigned int i;
+
+	if (!cp)
+		return;
+	pthread_mutex_lock(&cp->lock);
+	cp->stop = 1;
+	pthread_cond_broadcast(&cp->work);
+	pthread_mutex_unlock(&cp->lock);
+	for (i = 1; i < cp->n_threads; ++i)
+		pthread_join(cp->threads[i], NULL);
+
+	pthread_cond_destroy(&cp->done);
+	pthread_cond_destroy(&cp->work);
+	pthread_mutex_destroy(&cp->lock);
+	pthread_mutex_destroy(&cp->job_lock);
+	free(cp);
+}
+
+int v4l2copy_set_method(v4l2_copy_t* cp, copy_method method)
+{
+	if (method >= COPY_METHODS || !v4l2copy_supported(method)) {
+		log_error("copy method %s not supported here", v4l2copy_name(method));
+		return -1;
+	}
+	cp->method = method;
+	return 0;
+}
+
+copy_method v4l2copy_method(const v4l2_copy_t* cp)
+{
+	return cp->method;
+}
+
+/**
+	split the copy over every thread and wait for all stripes
+*/
+static void copyStriped(v4l2_copy_t* cp, void* dst, const void* src, size_t n)
+{
+	CopyJob job;
+
+	job.dst = dst;
+	job.src = src;
+	job.n = n;
+	/* Round the ceiling, not the floor, or n_threads stripes can fall short of n. */
+	job.stripe = ((n + cp->n_threads - 1) / cp->n_threads + COPY_STRIPE_ALIGN - 1) & ~(size_t)(COPY_STRIPE_ALIGN - 1);
+
+	pthread_mutex_lock(&cp->job_lock);
+	pthread_mutex_lock(&cp->lock);
+	cp->job = job;
+	cp->pending = cp->n_threads - 1;
+	cp->generation++;
+	pthread_cond_broadcast(&cp->work);
+	pthread_mutex_unlock(&cp->lock);
+
+	copyStripe(cp, &job, 0);
+
+	pthread_mutex_lock(&cp->lock);
+	while (cp->pending)
+		pthread_cond_wait(&cp->done, &cp->lock);
+	pthread_mutex_unlock(&cp->lock);
+	pthread_mutex_unlock(&cp->job_lock);
+}
+
+/**
+	copy n bytes with the active method; any thread may copy, striped copies take turns
+*/
+void v4l2copy(v4l2_copy_t* cp, void* dst, const void* src, size_t n)
+{
+	if (n >= cp->stripe_min)
+		copyStriped(cp, dst, src, n);
+	else
+		copyFn(cp->method)(dst, src, n);
+}
+
+/**
+	copy every plane of frame back to back into dst, returns the bytes written or 0 when cap is too small
+*/
+size_t v4l2copy_frame(v4l2_copy_t* cp, const v4l2_frame_t* frame, void* dst, size_t cap)
+{
+	uint8_t* out = dst;
+	size_t total = 0;
+	unsigned int p;
+
+	for (p = 0; p < frame->n_planes; ++p)
+		total += frame->planes[p].bytesused;
+	if (total > cap)
+		return 0;
+
+	for (p = 0; p < frame->n_planes; ++p) {
+		v4l2copy(cp, out, frame->planes[p].start, frame->planes[p].bytesused);
+		out += frame->planes[p].bytesused;
+	}
+	return total;
+}
+
+static uint64_t copyNow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+	best nanoseconds per copy of n bytes from src, striped or not
+*/
+static uint64_t copyTime(v4l2_copy_t* cp, uint8_t* dst, const void* src, size_t n, int striped)
+{
+	uint64_t best = UINT64_MAX, start, t, spent = 0;
+	unsigned int reps;
+
+	for (reps = 0; reps < 3 || (spent < COPY_CALIBRATE_NS && reps < 64); ++reps) {
+		start = copyNow();
+		if (striped)
+			copyStriped(cp, dst, src, n);
+		else
+			copyFn(cp->method)(dst, src, n);
+		t = copyNow() - start;
+		spent += t;
+		if (t < best)
+			best = t;
+	}
+	return best;
+}
+
+/**
+	byte-compare striped copies of src at sizes that leave a ragged tail
+	after n_threads stripes, nonzero when one comes up short
+*/
+static int copyCheck(v4l2_copy_t* cp, uint8_t* dst, const uint8_t* src, size_t n)
+{
+	size_t whole = (size_t)cp->n_threads * COPY_STRIPE_ALIGN;
+	size_t base = n > whole ? (n - whole) / whole * whole : 0;
+	size_t sizes[] = { n, n - 1, base + 1, base + cp->n_threads - 1 };
+	unsigned int i;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+		if (!sizes[i] || sizes[i] > n)
+			continue;
+		memset(dst, ~src[sizes[i] - 1], n);
+		copyStriped(cp, dst, src, sizes[i]);
+		if (memcmp(dst, src, sizes[i])) {
+			log_error("striped copy of %zu bytes on %u threads came out wrong", sizes[i], cp->n_threads);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+	time every supported method copying n bytes out of src, a mapped capture
+	buffer, and keep the fastest; also decides whether striping pays at this size
+*/
+copy_method v4l2copy_calibrate(v4l2_copy_t* cp, const void* src, size_t n)
+{
+	uint64_t t, best = UINT64_MAX;
+	copy_method m, fastest = COPY_MEMCPY;
+	void* dst;
+
+	if (!n || posix_memalign(&dst, COPY_STRIPE_ALIGN, n)) {
+		log_error("copy calibration: no scratch buffer");
+		return cp->method;
+	}
+	memset(dst, 0, n);
+
+	for (m = COPY_MEMCPY; m < COPY_METHODS; ++m) {
+		if (!v4l2copy_supported(m))
+			continue;
+		cp->method = m;
+		t = copyTime(cp, dst, src, n, 0);
+		log_info("copy %zu bytes with %s: %.2f GB/s", n, v4l2copy_name(m), (double)n / t);
+		if (t < best) {
+			best = t;
+			fastest = m;
+		}
+	}
+	cp->method = fastest;
+
+	if (cp->n_threads > 1 && n >= COPY_STRIPE_MIN) {
+		t = copyTime(cp, dst, src, n, 1);
+		log_info("copy %zu bytes with %s on %u threads: %.2f GB/s", n, v4l2copy_name(fastest),
+			cp->n_threads, (double)n / t);
+		cp->stripe_min = t < best && !copyCheck(cp, dst, src, n) ? n : SIZE_MAX;
+	}
+
+	free(dst);
+	return fastest;
+}
@@ -0,0 +1,48 @@
+#ifndef V4L2COPY_H_INCLUDED
+#define V4L2COPY_H_INCLUDED
+#include "v4l2core.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+    Copies frames out of capture buffers into cacheable memory.  Drivers
+    often map their buffers write-combined or uncached, where plain loads
+    crawl; the streaming methods read them with non-temporal loads and
+    write the destination with non-temporal stores.  Big frames can be
+    striped across worker threads.  Which is fastest depends on the
+    mapping, so let v4l2copy_calibrate pick against a real buffer.
+*/
+typedef enum copy_method{
+    COPY_MEMCPY,        //libc memcpy, best for cached buffers
+    COPY_STREAM_SSE41,  //movntdqa loads, movntdq stores
+    COPY_STREAM_AVX2,   //the same 32 bytes at a time
+    COPY_METHODS,
+}copy_method;
+
+typedef struct v4l2_copy_t v4l2_copy_t;
+
+v4l2_copy_t* v4l2copy_create(unsigned int n_threads);
+
+void v4l2copy_destroy(v4l2_copy_t* cp);
+
+int v4l2copy_supported(copy_method method);
+
+int v4l2copy_set_method(v4l2_copy_t* cp, copy_method method);
+
+copy_method v4l2copy_method(const v4l2_copy_t* cp);
+
+const char* v4l2copy_name(copy_method method);
+
+copy_method v4l2copy_calibrate(v4l2_copy_t* cp, const void* src, size_t n);
+
+void v4l2copy(v4l2_copy_t* cp, void* dst, const void* src, size_t n);
+
+size_t v4l2copy_frame(v4l2_copy_t* cp, const v4l2_frame_t* frame, void* dst, size_t cap);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // V4L2COPY_H_INCLUDED
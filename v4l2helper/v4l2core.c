@@ -1,4 +1,8 @@
+#define _GNU_SOURCE
 #include "v4l2core.h"
+#include "v4l2log.h"
+#include "v4l2ring.h"
+#include "v4l2pool.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -9,8 +13,33 @@
 #include <assert.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <limits.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <sched.h>
+#include <linux/dma-buf.h>
+#include <linux/udmabuf.h>
+
+#define RING_IDLE_FRAMES 300    //quiet frames before the adaptive ring sheds a buffer
+#define BUSY_IDLE_POLLS  1024   //empty polls before a busy loop starts backing off
+
+struct v4l2_thread_t{
+    cpu_set_t    cpus;
+    uint8_t      pinned;        //cpus holds an affinity to apply
+    int          policy;
+    int          priority;
+    int          node;          //resolved, -1 for none
+    pthread_t    tid;
+    uint8_t      running;       //tid is live and not yet joined
+    uint8_t      exited;        //the thread left capture_loop, cpu_ns is final
+    clockid_t    clock;
+    uint64_t     cpu_ns;
+};
 
 int xioctl(int fd, int request, void* argp)
 {
@@ -22,27 +51,154 @@ int xioctl(int fd, int request, void* argp)
 	return r;
 }
 
-static void errno_show(const char* s)
+static int bufferAlloc(v4l2_dev_t *vd, unsigned int count);
+
+static int isMplane(v4l2_dev_t *vd)
 {
-	fprintf(stderr, "%s error %d, %s\n", s, errno, strerror(errno));
+	return V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE == vd->buf_type;
 }
 
-static int readInit(v4l2_dev_t *vd)
+/**
+	bytes plane takes in fmt
+*/
+static unsigned int fmtPlaneSize(v4l2_dev_t *vd, const struct v4l2_format *fmt, unsigned int plane)
 {
-        vd->buffers = calloc(1, sizeof(*vd->buffers));
+	if (isMplane(vd))
+		return fmt->fmt.pix_mp.plane_fmt[plane].sizeimage;
+	return fmt->fmt.pix.sizeimage;
+}
 
-        if (!vd->buffers) {
-                fprintf(stderr, "Out of memory\\n");
+static int readInit(v4l2_dev_t *vd)
+{
+        if (bufferAlloc(vd, 1) < 0)
                 return -1;
-        }
 
-        vd->buffers[0].length = vd->buffer_size;
-        vd->buffers[0].start = malloc(vd->buffer_size);
+        vd->n_buffers = 1;
+        vd->buffers[0].planes[0].length = vd->buffer_size;
+        vd->buffers[0].planes[0].start = malloc(vd->buffer_size);
 
-        if (!vd->buffers[0].start) {
-                fprintf(stderr, "Out of memory\\n");
+        if (!vd->buffers[0].planes[0].start) {
+                log_error("Out of memory");
                 return -1;
         }
+        return 0;
+}
+
+/**
+	allocate the buffer slots, sized for the largest ring the device may grow to
+*/
+static int bufferAlloc(v4l2_dev_t *vd, unsigned int count)
+{
+	unsigned int capacity = count;
+	unsigned int i;
+
+	if (vd->ring.adaptive && vd->ring.max_count > capacity)
+		capacity = vd->ring.max_count;
+
+	vd->buffers = calloc(capacity, sizeof(*vd->buffers));
+	vd->dqbufs = calloc(capacity, sizeof(*vd->dqbufs));
+	vd->dqplanes = calloc(capacity * V4L2CORE_MAX_PLANES, sizeof(*vd->dqplanes));
+	vd->batch = calloc(capacity, sizeof(*vd->batch));
+
+	if (!vd->buffers || !vd->dqbufs || !vd->dqplanes || !vd->batch) {
+		log_error("Out of memory");
+		return -1;
+	}
+
+	for (i = 0; i < capacity * V4L2CORE_MAX_PLANES; ++i)
+		vd->buffers[i / V4L2CORE_MAX_PLANES].planes[i % V4L2CORE_MAX_PLANES].dmabuf_fd = -1;
+
+	vd->ring.capacity = capacity;
+	vd->ring.n_active = count;
+	vd->ring.cb_ns = 0;
+	vd->ring.idle_frames = 0;
+	vd->ring.hold_frames = 0;
+	return 0;
+}
+
+static int mmapBuffer(v4l2_dev_t *vd, unsigned int index)
+{
+	struct v4l2_plane planes[V4L2CORE_MAX_PLANES];
+	struct v4l2_buffer buf;
+	unsigned int p;
+
+	CLEAR(buf);
+	CLEAR(planes);
+
+	buf.type = vd->buf_type;
+	buf.memory = V4L2_MEMORY_MMAP;
+	buf.index = index;
+	if (isMplane(vd)) {
+		buf.m.planes = planes;
+		buf.length = V4L2CORE_MAX_PLANES;
+	}
+
+	if (-1 == v4l2core_ioctl(vd, VIDIOC_QUERYBUF, &buf)){
+		log_errno("VIDIOC_QUERYBUF");
+		return -1;
+	}
+
+	for (p = 0; p < vd->n_planes; ++p) {
+		buffer_plane *bp = &vd->buffers[index].planes[p];
+		uint32_t offset = isMplane(vd) ? planes[p].m.mem_offset : buf.m.offset;
+
+		bp->length = isMplane(vd) ? planes[p].length : buf.length;
+		bp->start = vd->backend->mmap(vd, bp->length, PROT_READ | PROT_WRITE /* required */, MAP_SHARED /* recommended */, offset);
+
+		if (MAP_FAILED == bp->start){
+			bp->start = NULL;
+			log_errno("mmap");
+			return -1;
+		}
+
+		if (vd->export_dmabuf) {
+			struct v4l2_exportbuffer expbuf;
+
+			CLEAR(expbuf);
+
+			expbuf.type = vd->buf_type;
+			expbuf.index = index;
+			expbuf.plane = p;
+			expbuf.flags = O_RDWR | O_CLOEXEC;
+
+			if (-1 == v4l2core_ioctl(vd, VIDIOC_EXPBUF, &expbuf)) {
+				log_errno("VIDIOC_EXPBUF");
+				return -1;
+			}
+			bp->dmabuf_fd = expbuf.fd;
+		}
+	}
+	return 0;
+}
+
+/**
+	bytes one USERPTR buffer takes in the pool, every plane starts on a page
+*/
+static size_t userptrSlotSize(v4l2_dev_t *vd)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t size = 0;
+	unsigned int p;
+
+	for (p = 0; p < vd->n_planes; ++p)
+		size += (fmtPlaneSize(vd, &vd->fmtack, p) + page - 1) & ~(page - 1);
+	return size;
+}
+
+static int userptrBuffer(v4l2_dev_t *vd, unsigned int index)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	uint8_t *slot = v4l2pool_slot(vd->userptr_pool, index);
+	unsigned int p;
+
+	for (p = 0; p < vd->n_planes; ++p) {
+		buffer_plane *bp = &vd->buffers[index].planes[p];
+
+		bp->length = fmtPlaneSize(vd, &vd->fmtack, p);
+		bp->start = slot;
+		slot += (bp->length + page - 1) & ~(page - 1);
+	}
+	return 0;
 }
 
 static int mmapInit(v4l2_dev_t *vd)
@@ -51,53 +207,31 @@ static int mmapInit(v4l2_dev_t *vd)
 
 	CLEAR(req);
 
-	req.count = VIDIOC_REQBUFS_COUNT;
-	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	req.count = vd->req_count;
+	req.type = vd->buf_type;
 	req.memory = V4L2_MEMORY_MMAP;
 
-	if (-1 == xioctl(vd->fd, VIDIOC_REQBUFS, &req)) {
+	if (-1 == v4l2core_ioctl(vd, VIDIOC_REQBUFS, &req)) {
 		if (EINVAL == errno) {
-			fprintf(stderr, "%s does not support memory mapping\n", vd->deviceName);
+			log_error("%s does not support memory mapping", vd->deviceName);
 			return -1;
 		} else {
-			errno_show("VIDIOC_REQBUFS");
+			log_errno("VIDIOC_REQBUFS");
 			return -1;
 		}
 	}
 
 	if (req.count < 2) {
-		fprintf(stderr, "Insufficient buffer memory on %s\n", vd->deviceName);
+		log_error("Insufficient buffer memory on %s", vd->deviceName);
 		return -1;
 	}
 
-	vd->buffers = calloc(req.count, sizeof(*vd->buffers));
-
-	if (!vd->buffers) {
-		fprintf(stderr, "Out of memory\n");
+	if (bufferAlloc(vd, req.count) < 0)
 		return -1;
-	}
 
 	for (vd->n_buffers = 0; vd->n_buffers < req.count; ++vd->n_buffers) {
-		struct v4l2_buffer buf;
-
-		CLEAR(buf);
-
-		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		buf.memory = V4L2_MEMORY_MMAP;
-		buf.index = vd->n_buffers;
-
-		if (-1 == xioctl(vd->fd, VIDIOC_QUERYBUF, &buf)){
-			errno_show("VIDIOC_QUERYBUF");
+		if (mmapBuffer(vd, vd->n_buffers) < 0)
 			return -1;
-        }
-
-		vd->buffers[vd->n_buffers].length = buf.length;
-		vd->buffers[vd->n_buffers].start = mmap(NULL /* start anywhere */, buf.length, PROT_READ | PROT_WRITE /* required */, MAP_SHARED /* recommended */, vd->fd, buf.m.offset);
-
-		if (MAP_FAILED == vd->buffers[vd->n_buffers].start){
-			errno_show("mmap");
-			return -1;
-        }
 	}
 	return 0;
 }
@@ -108,95 +242,567 @@ static int userptrInit(v4l2_dev_t *vd)
 
         CLEAR(req);
 
-        req.count  = VIDIOC_REQBUFS_COUNT;
-        req.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        req.count  = vd->req_count;
+        req.type   = vd->buf_type;
         req.memory = V4L2_MEMORY_USERPTR;
 
-        if (-1 == xioctl(vd->fd, VIDIOC_REQBUFS, &req)) {
+        if (-1 == v4l2core_ioctl(vd, VIDIOC_REQBUFS, &req)) {
                 if (EINVAL == errno) {
-                        fprintf(stderr, "%s does not support "
-                                 "user pointer i/on", vd->deviceName);
+                        log_error("%s does not support "
+                                 "user pointer i/o", vd->deviceName);
                         return -1;
                 } else {
-                        errno_show("VIDIOC_REQBUFS");
+                        log_errno("VIDIOC_REQBUFS");
 						return -1;
                 }
         }
 
-        vd->buffers = calloc(req.count, sizeof(*vd->buffers));
+        if (bufferAlloc(vd, req.count) < 0)
+                return -1;
 
-        if (!vd->buffers) {
-                fprintf(stderr, "Out of memory\\n");
+        /* One mapping for the whole ring, including the slots it may grow into. */
+        if (vd->thread && vd->thread->node >= 0)
+                vd->userptr_pool = v4l2pool_create(userptrSlotSize(vd), vd->ring.capacity,
+                        vd->pool_flags | POOL_NUMA_LOCAL, vd->thread->node);
+        else
+                vd->userptr_pool = v4l2pool_create(userptrSlotSize(vd), vd->ring.capacity, vd->pool_flags, -1);
+        if (!vd->userptr_pool)
                 return -1;
-        }
 
         for (vd->n_buffers = 0; vd->n_buffers < req.count; ++vd->n_buffers) {
-                vd->buffers[vd->n_buffers].length = vd->buffer_size;
-                vd->buffers[vd->n_buffers].start = malloc(vd->buffer_size);
-
-                if (!vd->buffers[vd->n_buffers].start) {
-                        fprintf(stderr, "Out of memory\\n");
+                if (userptrBuffer(vd, vd->n_buffers) < 0)
                         return -1;
-                }
         }
+        return 0;
 }
 
-v4l2_dev_t* v4l2core_dev_open(const char* deviceName)
+static int dmabufInit(v4l2_dev_t *vd)
+{
+	struct v4l2_requestbuffers req;
+	struct v4l2_format fmt;
+	unsigned int p;
+	off_t size;
+
+	if (vd->n_import_fds < vd->n_planes) {
+		log_error("%s: no dmabuf pool set for dmabuf i/o", vd->deviceName);
+		return -1;
+	}
+
+	CLEAR(fmt);
+	fmt.type = vd->buf_type;
+	if (-1 == v4l2core_ioctl(vd, VIDIOC_G_FMT, &fmt)) {
+		log_errno("VIDIOC_G_FMT");
+		return -1;
+	}
+
+	CLEAR(req);
+
+	req.count = vd->n_import_fds / vd->n_planes;
+	req.type = vd->buf_type;
+	req.memory = V4L2_MEMORY_DMABUF;
+
+	if (-1 == v4l2core_ioctl(vd, VIDIOC_REQBUFS, &req)) {
+		if (EINVAL == errno) {
+			log_error("%s does not support dmabuf i/o", vd->deviceName);
+		} else {
+			log_errno("VIDIOC_REQBUFS");
+		}
+		return -1;
+	}
+
+	if (req.count > vd->n_import_fds / vd->n_planes)
+		req.count = vd->n_import_fds / vd->n_planes;
+
+	if (bufferAlloc(vd, req.count) < 0)
+		return -1;
+
+	for (vd->n_buffers = 0; vd->n_buffers < req.count; ++vd->n_buffers) {
+		for (p = 0; p < vd->n_planes; ++p) {
+			buffer_plane *bp = &vd->buffers[vd->n_buffers].planes[p];
+			int fd = vd->import_fds[vd->n_buffers * vd->n_planes + p];
+
+			size = lseek(fd, 0, SEEK_END);
+			if (size < (off_t)fmtPlaneSize(vd, &fmt, p)) {
+				log_error("dmabuf %d too small for a %u byte plane", fd, fmtPlaneSize(vd, &fmt, p));
+				return -1;
+			}
+
+			bp->dmabuf_fd = fd;
+			bp->length = size;
+			/* CPU view for the callbacks; dmabufs that can't be mapped are still usable by fd. */
+			bp->start = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, bp->dmabuf_fd, 0);
+			if (MAP_FAILED == bp->start)
+				bp->start = NULL;
+		}
+	}
+	return 0;
+}
+
+static void dmabufSync(v4l2_dev_t *vd, unsigned int index, uint64_t flags)
+{
+	struct dma_buf_sync sync;
+	unsigned int p;
+
+	sync.flags = flags;
+	for (p = 0; p < vd->n_planes; ++p) {
+		buffer_plane *bp = &vd->buffers[index].planes[p];
+
+		if (bp->start)
+			xioctl(bp->dmabuf_fd, DMA_BUF_IOCTL_SYNC, &sync);
+	}
+}
+
+static uint32_t ioMemory(v4l2_dev_t *vd)
+{
+	switch (vd->io) {
+		case IO_METHOD_USERPTR:
+			return V4L2_MEMORY_USERPTR;
+		case IO_METHOD_DMABUF:
+			return V4L2_MEMORY_DMABUF;
+		default:
+			return V4L2_MEMORY_MMAP;
+	}
+}
+
+/**
+	hand buffer back to the driver
+*/
+static int bufferQueue(v4l2_dev_t *vd, unsigned int index)
+{
+	struct v4l2_plane planes[V4L2CORE_MAX_PLANES];
+	struct v4l2_buffer buf;
+	unsigned int p;
+
+	if (IO_METHOD_READ == vd->io)
+		return -1;
+
+	CLEAR(buf);
+	CLEAR(planes);
+
+	buf.type = vd->buf_type;
+	buf.memory = ioMemory(vd);
+	buf.index = index;
+
+	if (isMplane(vd)) {
+		buf.m.planes = planes;
+		buf.length = vd->n_planes;
+		for (p = 0; p < vd->n_planes; ++p) {
+			buffer_plane *bp = &vd->buffers[index].planes[p];
+
+			planes[p].length = bp->length;
+			if (IO_METHOD_USERPTR == vd->io)
+				planes[p].m.userptr = (unsigned long) bp->start;
+			else if (IO_METHOD_DMABUF == vd->io)
+				planes[p].m.fd = bp->dmabuf_fd;
+		}
+	} else if (IO_METHOD_USERPTR == vd->io) {
+		buf.m.userptr = (unsigned long) vd->buffers[index].planes[0].start;
+		buf.length = vd->buffers[index].planes[0].length;
+	} else if (IO_METHOD_DMABUF == vd->io) {
+		buf.m.fd = vd->buffers[index].planes[0].dmabuf_fd;
+		buf.length = vd->buffers[index].planes[0].length;
+	}
+
+	return v4l2core_ioctl(vd, VIDIOC_QBUF, &buf);
+}
+
+/**
+	add buffers to a running ring with VIDIOC_CREATE_BUFS
+*/
+static int ringGrow(v4l2_dev_t *vd, unsigned int count)
+{
+	struct v4l2_create_buffers create;
+	unsigned int i, removed = 0;
+
+	if (vd->io == IO_METHOD_DMABUF)
+		return -1;  /* the imported pool is all we have */
+	for (i = 0; i < vd->n_buffers; ++i)
+		removed += vd->buffers[i].removed;
+	if (vd->n_buffers - removed + count > vd->ring.capacity)
+		return -1;
+
+	CLEAR(create);
+
+	create.count = count;
+	create.memory = ioMemory(vd);
+	create.format.type = vd->buf_type;
+
+	if (-1 == v4l2core_ioctl(vd, VIDIOC_G_FMT, &create.format)) {
+		log_errno("VIDIOC_G_FMT");
+		return -1;
+	}
+
+	if (-1 == v4l2core_ioctl(vd, VIDIOC_CREATE_BUFS, &create)) {
+		log_errno("VIDIOC_CREATE_BUFS");
+		return -1;
+	}
+
+	if (create.index + create.count > vd->ring.capacity) {
+		log_error("%s: created buffers %u..%u exceed ring capacity %u", vd->deviceName,
+			create.index, create.index + create.count, vd->ring.capacity);
+		return -1;
+	}
+
+	for (i = create.index; i < create.index + create.count; ++i) {
+		if (vd->io == IO_METHOD_MMAP) {
+			if (mmapBuffer(vd, i) < 0)
+				return -1;
+		} else if (userptrBuffer(vd, i) < 0) {
+			return -1;
+		}
+		vd->buffers[i].parked = 0;
+		vd->buffers[i].removed = 0;
+		if (i >= vd->n_buffers)
+			vd->n_buffers = i + 1;
+
+		if (-1 == bufferQueue(vd, i)) {
+			log_errno("VIDIOC_QBUF");
+			return -1;
+		}
+		vd->ring.n_active++;
+	}
+	return 0;
+}
+
+/**
+	give a parked buffer back to the driver
+*/
+static int ringUnpark(v4l2_dev_t *vd)
+{
+	unsigned int i;
+
+	for (i = 0; i < vd->n_buffers; ++i) {
+		if (!vd->buffers[i].parked || vd->buffers[i].removed)
+			continue;
+		if (-1 == bufferQueue(vd, i)) {
+			log_errno("VIDIOC_QBUF");
+			return -1;
+		}
+		vd->buffers[i].parked = 0;
+		vd->ring.n_active++;
+		return 0;
+	}
+	return -1;
+}
+
+/**
+	hold a dequeued buffer back from the driver and release what memory we can;
+	only MMAP buffers are freed, with VIDIOC_REMOVE_BUFS, the rest are held back
+*/
+static void ringPark(v4l2_dev_t *vd, unsigned int index)
+{
+	buffer *b = &vd->buffers[index];
+
+	vd->ring.n_active--;
+
+	if (vd->io == IO_METHOD_USERPTR)
+		v4l2pool_release(vd->userptr_pool, index);
+
+#ifdef VIDIOC_REMOVE_BUFS
+	/* Only MMAP memory is the driver's to free, DMABUF planes are the caller's pool. */
+	if (vd->io == IO_METHOD_MMAP) {
+		struct v4l2_remove_buffers remove;
+		unsigned int p;
+
+		CLEAR(remove);
+		remove.index = index;
+		remove.count = 1;
+		remove.type = vd->buf_type;
+
+		/* Our mappings keep the memory until they go, so drop them only once the driver let go. */
+		if (0 == v4l2core_ioctl(vd, VIDIOC_REMOVE_BUFS, &remove)) {
+			for (p = 0; p < vd->n_planes; ++p) {
+				vd->backend->munmap(vd, b->planes[p].start, b->planes[p].length);
+				b->planes[p].start = NULL;
+				b->planes[p].length = 0;
+				if (b->planes[p].dmabuf_fd >= 0)
+					close(b->planes[p].dmabuf_fd);
+				b->planes[p].dmabuf_fd = -1;
+			}
+			/* Gone from the driver too; only ringGrow brings the index back. */
+			b->removed = 1;
+			return;
+		}
+	}
+#endif
+	b->parked = 1;
+}
+
+static uint64_t monotonicNs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t framePeriod(v4l2_dev_t *vd)
+{
+	struct v4l2_fract *tpf = &vd->frameint.parm.capture.timeperframe;
+
+	if (tpf->numerator && tpf->denominator)
+		return 1000000000ull * tpf->numerator / tpf->denominator;
+	return 0;
+}
+
+/**
+	resize the ring from the latency of the callback that just returned,
+	returns 1 if the buffer must be held back from the driver, which only
+	happens when can_park says nobody else holds it
+*/
+static int ringAdapt(v4l2_dev_t *vd, unsigned int index, uint64_t cb_ns, int can_park)
+{
+	RingCtrl *ring = &vd->ring;
+	uint64_t period = framePeriod(vd);
+
+	if (ring->cb_ns)
+		ring->cb_ns = (int64_t)ring->cb_ns + ((int64_t)cb_ns - (int64_t)ring->cb_ns) / 8;
+	else
+		ring->cb_ns = cb_ns;
+
+	if (ring->hold_frames) {
+		ring->hold_frames--;
+		return 0;
+	}
+	if (!period)
+		return 0;
+
+	if (ring->cb_ns * 4 >= period * 3) {
+		/* Callbacks eat most of the frame period, add headroom. */
+		ring->idle_frames = 0;
+		if (ring->n_active < ring->max_count) {
+			if (ringUnpark(vd) < 0 && ringGrow(vd, 1) < 0)
+				ring->max_count = ring->n_active;
+			ring->hold_frames = ring->n_active;
+		}
+	} else if (ring->cb_ns * 4 < period) {
+		if (++ring->idle_frames >= RING_IDLE_FRAMES && ring->n_active > ring->min_count && can_park) {
+			ring->idle_frames = 0;
+			ring->hold_frames = ring->n_active;
+			ringPark(vd, index);
+			return 1;
+		}
+	} else {
+		ring->idle_frames = 0;
+	}
+	return 0;
+}
+
+/**
+	ioctl through the device backend, retried on EINTR like xioctl
+*/
+int v4l2core_ioctl(v4l2_dev_t* vd,unsigned long request,void* arg)
+{
+	int r;
+
+	do r = vd->backend->ioctl(vd, request, arg);
+	while (-1 == r && EINTR == errno);
+
+	return r;
+}
+
+static int devIoctl(v4l2_dev_t* vd,unsigned long request,void* arg)
+{
+	return ioctl(vd->fd, request, arg);
+}
+
+static void* devMmap(v4l2_dev_t* vd,size_t length,int prot,int flags,off_t offset)
+{
+	return mmap(NULL /* start anywhere */, length, prot, flags, vd->fd, offset);
+}
+
+static int devMunmap(v4l2_dev_t* vd,void* start,size_t length)
+{
+	return munmap(start, length);
+}
+
+static ssize_t devRead(v4l2_dev_t* vd,void* buf,size_t count)
+{
+	return read(vd->fd, buf, count);
+}
+
+static int devWait(v4l2_dev_t* vd,int timeout_ms)
+{
+	fd_set fds;
+	struct timeval tv;
+
+	FD_ZERO(&fds);
+	FD_SET(vd->fd, &fds);
+
+	tv.tv_sec = timeout_ms / 1000;
+	tv.tv_usec = (timeout_ms % 1000) * 1000;
+
+	return select(vd->fd + 1, &fds, NULL, NULL, &tv);
+}
+
+static void devClose(v4l2_dev_t* vd)
+{
+	if (vd->fd > 0)
+		close(vd->fd);
+}
+
+static const v4l2_backend_t devBackend = {
+	.name   = "v4l2",
+	.ioctl  = devIoctl,
+	.mmap   = devMmap,
+	.munmap = devMunmap,
+	.read   = devRead,
+	.wait   = devWait,
+	.close  = devClose,
+};
+
+/**
+	create a device handle served by backend, the backend sets up vd->fd
+*/
+v4l2_dev_t* v4l2core_dev_open_backend(const char* deviceName,const v4l2_backend_t* backend,void* priv)
 {
     v4l2_dev_t* vd = calloc(1,sizeof(v4l2_dev_t));
     assert(vd != NULL);
     memset(vd,0,sizeof(v4l2_dev_t));
     vd->io = IO_METHOD_MMAP;
+    vd->req_count = VIDIOC_REQBUFS_COUNT;
     vd->fps = 15;
     vd->deviceName = strdup(deviceName);
     vd->width = 0;
     vd->height = 0;
 	vd->p_frameDesc = NULL;
+	vd->fd = -1;
+	vd->pullfd = -1;
+	vd->wakefd = -1;
+	vd->buf_type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	vd->n_planes = 1;
+	vd->backend = backend;
+	vd->backend_priv = priv;
+	pthread_mutex_init(&vd->subs_lock, NULL);
+	pthread_mutex_init(&vd->lease_lock, NULL);
+
+	return vd;
+}
+
+/**
+	multi-planar only devices get the mplane buffer type everywhere
+*/
+static void detectBufType(v4l2_dev_t* vd)
+{
+	struct v4l2_capability cap;
+	uint32_t caps;
+
+	CLEAR(cap);
+	if (-1 == v4l2core_ioctl(vd, VIDIOC_QUERYCAP, &cap))
+		return;
+	caps = (cap.capabilities & V4L2_CAP_DEVICE_CAPS) ? cap.device_caps : cap.capabilities;
+	if ((caps & V4L2_CAP_VIDEO_CAPTURE_MPLANE) && !(caps & V4L2_CAP_VIDEO_CAPTURE))
+		vd->buf_type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+}
 
+v4l2_dev_t* v4l2core_dev_open(const char* deviceName)
+{
+    v4l2_dev_t* vd;
     struct stat st;
+
 	// stat file
 	if (-1 == stat(deviceName, &st)) {
-		fprintf(stderr, "Cannot identify '%s': %d, %s\n", vd->deviceName, errno, strerror(errno));
+		log_error("Cannot identify '%s': %d, %s", deviceName, errno, strerror(errno));
 		return NULL;
 	}
 
 	// check if its device
 	if (!S_ISCHR(st.st_mode)) {
-		fprintf(stderr, "%s is no device\n", vd->deviceName);
+		log_error("%s is no device", deviceName);
 		return NULL;
 	}
 
+	vd = v4l2core_dev_open_backend(deviceName, &devBackend, NULL);
+
 	// open device
 	vd->fd = open(vd->deviceName, O_RDWR | O_NONBLOCK,0);
 
 	// check if opening was successfull
 	if (-1 == vd->fd) {
-		fprintf(stderr, "Cannot open '%s': %d, %s\n", vd->deviceName, errno, strerror(errno));
+		log_error("Cannot open '%s': %d, %s", vd->deviceName, errno, strerror(errno));
+		free(vd->deviceName);
+		free(vd);
 		return NULL;
 	}
 
+	detectBufType(vd);
 	return vd;
 }
 
 void v4l2core_dev_close(v4l2_dev_t *vd)
 {
     assert(vd!=NULL);
+    v4l2core_capture_thread_stop(vd);
+    vd->backend->close(vd);
+    vd->fd = -1;
+
     if(vd->deviceName)
         free(vd->deviceName);
     vd->deviceName = NULL;
-
-    if(vd->fd>0)
-    {
-        close(vd->fd);
-		vd = NULL;
-    }
+    free(vd->import_fds);
+    vd->import_fds = NULL;
+    free(vd->thread);
+    vd->thread = NULL;
+    pthread_mutex_destroy(&vd->subs_lock);
+    pthread_mutex_destroy(&vd->lease_lock);
 }
 
-void enum_frame_sizes(v4l2_dev_t *vd,uint32_t pixfmt,FrameDesc* pframeDesc)
-{
+/**
+	read a small sysfs attribute into buf, -1 if it can't
+*/
+static int sysfsRead(const char* path, char* buf, size_t size)
+{
+	ssize_t n;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (-1 == fd)
+		return -1;
+	n = read(fd, buf, size - 1);
+	close(fd);
+	if (n <= 0)
+		return -1;
+	buf[n] = '\0';
+	return 0;
+}
+
+/**
+	NUMA node of the bus the device sits on, -1 when unknown;
+	USB devices report the node of their host controller
+*/
+int v4l2core_dev_numa_node(v4l2_dev_t* vd)
+{
+	char path[PATH_MAX], dir[PATH_MAX], attr[32];
+	struct stat st;
+	char* slash;
+	int node;
+
+	if (vd->fd < 0 || -1 == fstat(vd->fd, &st) || !S_ISCHR(st.st_mode))
+		return -1;
+	snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/device", major(st.st_rdev), minor(st.st_rdev));
+	if (!realpath(path, dir))
+		return -1;
+
+	/* Interfaces and hubs have no numa_node of their own, walk up to one that does. */
+	while (!strncmp(dir, "/sys/devices/", 13)) {
+		if (snprintf(path, sizeof(path), "%s/numa_node", dir) >= (int)sizeof(path))
+			break;
+		if (0 == sysfsRead(path, attr, sizeof(attr))) {
+			node = atoi(attr);
+			return node >= 0 ? node : -1;
+		}
+		slash = strrchr(dir, '/');
+		if (!slash)
+			break;
+		*slash = '\0';
+	}
+	return -1;
+}
+
+void enum_frame_sizes(v4l2_dev_t *vd,uint32_t pixfmt,FrameDesc* pframeDesc)
+{
     vd->frmsozeenum.index=0;
     vd->frmsozeenum.pixel_format = pixfmt;
-    while(ioctl(vd->fd,VIDIOC_ENUM_FRAMESIZES,&vd->frmsozeenum)!=-1)
+    while(v4l2core_ioctl(vd,VIDIOC_ENUM_FRAMESIZES,&vd->frmsozeenum)!=-1)
     {
 		FrameSize* frm = (FrameSize*)malloc(sizeof(FrameSize));
 		memset(frm,0,sizeof(FrameSize));
@@ -211,43 +817,49 @@ void enum_frame_sizes(v4l2_dev_t *vd,uint32_t pixfmt,FrameDesc* pframeDesc)
 
 int v4l2core_dev_init(v4l2_dev_t *vd)
 {
-    puts("************UVC Device Information************");
-    if (-1 == xioctl(vd->fd, VIDIOC_QUERYCAP, &vd->cap)) {
+    log_info("************UVC Device Information************");
+    if (-1 == v4l2core_ioctl(vd, VIDIOC_QUERYCAP, &vd->cap)) {
 		if (EINVAL == errno) {
-			fprintf(stderr, "%s is no V4L2 device\n",vd->deviceName);
+			log_error("%s is no V4L2 device",vd->deviceName);
 		} else {
-			errno_show("query capabilities");
+			log_errno("query capabilities");
 		}
 		return 0;
 	}
 	else
 	{
-        printf("driver:\t\t%s\n",vd->cap.driver);
-        printf("card:\t\t%s\n",vd->cap.card);
-        printf("bus_info:\t%s\n",vd->cap.bus_info);
-        printf("version:\t%d\n",vd->cap.version);
-        printf("capabilities:\t%x\n",vd->cap.capabilities);
+        log_info("driver:\t\t%s",vd->cap.driver);
+        log_info("card:\t\t%s",vd->cap.card);
+        log_info("bus_info:\t%s",vd->cap.bus_info);
+        log_info("version:\t%d",vd->cap.version);
+        log_info("capabilities:\t%x",vd->cap.capabilities);
 
         if ((vd->cap.capabilities & V4L2_CAP_VIDEO_CAPTURE) == V4L2_CAP_VIDEO_CAPTURE)
         {
-            printf("Device %s: supports capture.\n",vd->deviceName);
+            log_info("Device %s: supports capture.",vd->deviceName);
         }
 
         if ((vd->cap.capabilities & V4L2_CAP_STREAMING) == V4L2_CAP_STREAMING)
         {
-            printf("Device %s: supports streaming.\n",vd->deviceName);
+            log_info("Device %s: supports streaming.",vd->deviceName);
+        }
+
+        if (isMplane(vd))
+        {
+            log_info("Device %s: supports multi-planar capture.",vd->deviceName);
         }
 
         switch (vd->io) {
 		case IO_METHOD_READ:
 			if (!(vd->cap.capabilities & V4L2_CAP_READWRITE)) {
-				fprintf(stderr, "%s does not support read i/o\n",vd->deviceName);
+				log_error("%s does not support read i/o",vd->deviceName);
 			}
 			break;
 		case IO_METHOD_MMAP:
 		case IO_METHOD_USERPTR:
+		case IO_METHOD_DMABUF:
       			if (!(vd->cap.capabilities & V4L2_CAP_STREAMING)) {
-				fprintf(stderr, "%s does not support streaming i/o\n",vd->deviceName);
+				log_error("%s does not support streaming i/o",vd->deviceName);
 			}
 			break;
         }
@@ -256,13 +868,13 @@ int v4l2core_dev_init(v4l2_dev_t *vd)
 	/* Select video input, video standard and tune here. */
 	CLEAR(vd->cropcap);
 
-	vd->cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	vd->cropcap.type = vd->buf_type;
 
-	if (0 == xioctl(vd->fd, VIDIOC_CROPCAP, &vd->cropcap)) {
-		vd->crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	if (0 == v4l2core_ioctl(vd, VIDIOC_CROPCAP, &vd->cropcap)) {
+		vd->crop.type = vd->buf_type;
 		vd->crop.c = vd->cropcap.defrect; /* reset to default */
 
-		if (-1 == xioctl(vd->fd, VIDIOC_S_CROP, &vd->crop)) {
+		if (-1 == v4l2core_ioctl(vd, VIDIOC_S_CROP, &vd->crop)) {
 			switch (errno) {
 				case EINVAL:
 					/* Cropping not supported. */
@@ -276,13 +888,13 @@ int v4l2core_dev_init(v4l2_dev_t *vd)
 		/* Errors ignored. */
 	}
 
-    puts("************Support Image Formats Information************");
+    log_info("************Support Image Formats Information************");
     //emu all support fmt
     vd->fmtdesc.index=0;
-    vd->fmtdesc.type=V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    vd->fmtdesc.type=vd->buf_type;
     
 
-    while(ioctl(vd->fd,VIDIOC_ENUM_FMT,&vd->fmtdesc)!=-1)
+    while(v4l2core_ioctl(vd,VIDIOC_ENUM_FMT,&vd->fmtdesc)!=-1)
     {
 		FrameDesc* fdesc = (FrameDesc*)malloc(sizeof(FrameDesc));
 		if(!fdesc)
@@ -301,37 +913,37 @@ int v4l2core_dev_init(v4l2_dev_t *vd)
 	FrameSize* elt2;
 	int count;
 	DL_COUNT(vd->p_frameDesc,elt,count);
-	printf("Support format (%d):\n",count);
+	log_info("Support format (%d):",count);
 	DL_FOREACH(vd->p_frameDesc,elt) {
-		printf("\t%d.%s\n",elt->index, elt->description);
+		log_info("\t%d.%s",elt->index, elt->description);
 		DL_COUNT(elt->pframeSize,elt2,count);
-		printf("\t\tSupport frame size (%d):\n",count);
+		log_info("\t\tSupport frame size (%d):",count);
 		DL_FOREACH(elt->pframeSize,elt2)
 		{
 			if (elt2->frmsizeenum.type == V4L2_FRMSIZE_TYPE_DISCRETE)
 			{
-				printf("\t\t{ discrete: width = %u, height = %u }\n",
+				log_info("\t\t{ discrete: width = %u, height = %u }",
 					   elt2->frmsizeenum.discrete.width, elt2->frmsizeenum.discrete.height);
 			}
 			else if (elt2->frmsizeenum.type == V4L2_FRMSIZE_TYPE_CONTINUOUS || elt2->frmsizeenum.type == V4L2_FRMSIZE_TYPE_STEPWISE)
 			{
 				if (elt2->frmsizeenum.type == V4L2_FRMSIZE_TYPE_CONTINUOUS)
-					printf("\t\t{ continuous: min { width = %u, height = %u } .. "
-						   "max { width = %u, height = %u } }\n",
+					log_info("\t\t{ continuous: min { width = %u, height = %u } .. "
+						   "max { width = %u, height = %u } }",
 						   elt2->frmsizeenum.stepwise.min_width, elt2->frmsizeenum.stepwise.min_height,
 						   elt2->frmsizeenum.stepwise.max_width, elt2->frmsizeenum.stepwise.max_height);
 				else
-					printf("\t\t{ stepwise: min { width = %u, height = %u } .. "
+					log_info("\t\t{ stepwise: min { width = %u, height = %u } .. "
 						   "max { width = %u, height = %u } / "
-						   "stepsize { width = %u, height = %u } }\n",
+						   "stepsize { width = %u, height = %u } }",
 						   elt2->frmsizeenum.stepwise.min_width, elt2->frmsizeenum.stepwise.min_height,
 						   elt2->frmsizeenum.stepwise.max_width, elt2->frmsizeenum.stepwise.max_height,
 						   elt2->frmsizeenum.stepwise.step_width, elt2->frmsizeenum.stepwise.step_height);
 			}
 			else
 			{
-				fprintf(stderr, "V4L2_CORE: fsize.type not supported: %d\n", elt2->frmsizeenum.type);
-				fprintf(stderr, "    (Discrete: %d   Continuous: %d  Stepwise: %d)\n",
+				log_warn("V4L2_CORE: fsize.type not supported: %d", elt2->frmsizeenum.type);
+				log_warn("    (Discrete: %d   Continuous: %d  Stepwise: %d)",
 						V4L2_FRMSIZE_TYPE_DISCRETE,
 						V4L2_FRMSIZE_TYPE_CONTINUOUS,
 						V4L2_FRMSIZE_TYPE_STEPWISE);
@@ -340,37 +952,51 @@ int v4l2core_dev_init(v4l2_dev_t *vd)
 	}
 	
 
-    puts("************Current Image Formats Information************");
+    log_info("************Current Image Formats Information************");
     //get fmt
-    vd->fmtack.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    if(xioctl(vd->fd, VIDIOC_G_FMT, &vd->fmtack) == -1)
+    vd->fmtack.type = vd->buf_type;
+    if(v4l2core_ioctl(vd, VIDIOC_G_FMT, &vd->fmtack) == -1)
     {
-        errno_show("VIDIOC_G_FMT");
-        printf("Unable to get format\n");
+        log_errno("VIDIOC_G_FMT");
+        log_error("Unable to get format");
         return;
     }
     else
     {
-         printf("fmt.type:\t\t%d\n",vd->fmtack.type);
-         printf("pix.pixelformat:\t%c%c%c%c\n",vd->fmtack.fmt.pix.pixelformat & 0xFF, (vd->fmtack.fmt.pix.pixelformat >> 8) & 0xFF,(vd->fmtack.fmt.pix.pixelformat >> 16) & 0xFF, (vd->fmtack.fmt.pix.pixelformat >> 24) & 0xFF);
-         printf("pix.width:\t\t%d\n",vd->fmtack.fmt.pix.width);
-         printf("pix.height:\t\t%d\n",vd->fmtack.fmt.pix.height);
-         printf("pix.field:\t\t%d\n",vd->fmtack.fmt.pix.field);
+         log_info("fmt.type:\t\t%d",vd->fmtack.type);
+         if (isMplane(vd))
+         {
+             struct v4l2_pix_format_mplane* mp = &vd->fmtack.fmt.pix_mp;
+
+             log_info("pix_mp.pixelformat:\t%c%c%c%c",mp->pixelformat & 0xFF, (mp->pixelformat >> 8) & 0xFF,(mp->pixelformat >> 16) & 0xFF, (mp->pixelformat >> 24) & 0xFF);
+             log_info("pix_mp.width:\t\t%d",mp->width);
+             log_info("pix_mp.height:\t\t%d",mp->height);
+             log_info("pix_mp.num_planes:\t%d",mp->num_planes);
+             vd->width = mp->width;
+             vd->height = mp->height;
+         }
+         else
+         {
+         log_info("pix.pixelformat:\t%c%c%c%c",vd->fmtack.fmt.pix.pixelformat & 0xFF, (vd->fmtack.fmt.pix.pixelformat >> 8) & 0xFF,(vd->fmtack.fmt.pix.pixelformat >> 16) & 0xFF, (vd->fmtack.fmt.pix.pixelformat >> 24) & 0xFF);
+         log_info("pix.width:\t\t%d",vd->fmtack.fmt.pix.width);
+         log_info("pix.height:\t\t%d",vd->fmtack.fmt.pix.height);
+         log_info("pix.field:\t\t%d",vd->fmtack.fmt.pix.field);
 
          vd->width = vd->fmtack.fmt.pix.width;
          vd->height = vd->fmtack.fmt.pix.height;
+         }
 
     }
 
     //get fps
     CLEAR(vd->frameint);
-    vd->frameint.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    if (-1 == xioctl(vd->fd, VIDIOC_G_PARM, &vd->frameint)){
-        fprintf(stderr,"Unable to get frame interval.\n");
+    vd->frameint.type = vd->buf_type;
+    if (-1 == v4l2core_ioctl(vd, VIDIOC_G_PARM, &vd->frameint)){
+        log_warn("Unable to get frame interval.");
     }
     else
     {
-        printf("capture fps:\t\t%d/%d\n",vd->frameint.parm.capture.timeperframe.numerator,
+        log_info("capture fps:\t\t%d/%d",vd->frameint.parm.capture.timeperframe.numerator,
                vd->frameint.parm.capture.timeperframe.denominator);
         vd->fps = vd->frameint.parm.capture.timeperframe.denominator/vd->frameint.parm.capture.timeperframe.numerator;
     }
@@ -381,129 +1007,445 @@ int v4l2core_dev_init(v4l2_dev_t *vd)
 int v4l2core_dev_set_fmt(v4l2_dev_t* vd,uint32_t pixfmt,uint32_t width,uint32_t height)
 {
 	CLEAR(vd->fmt);
-	vd->fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	vd->fmt.type = vd->buf_type;
+	if (isMplane(vd)) {
+		/* The driver fills in the planes. */
+		vd->fmt.fmt.pix_mp.pixelformat = pixfmt;
+		vd->fmt.fmt.pix_mp.width = width;
+		vd->fmt.fmt.pix_mp.height = height;
+	} else {
     vd->fmt.fmt.pix.pixelformat = pixfmt;
 	vd->fmt.fmt.pix.width = width;
     vd->fmt.fmt.pix.height = height;    
-    if(xioctl(vd->fd, VIDIOC_S_FMT, &vd->fmt) == -1)
+	}
+    if(v4l2core_ioctl(vd, VIDIOC_S_FMT, &vd->fmt) == -1)
     {
-        printf("Unable to set format\n");
+        log_error("Unable to set format");
         return -1;
     }
-    printf("Set format success.\n");
+    log_info("Set format success.");
 	return 0;
 }
 
 int v4l2core_dev_set_fps(v4l2_dev_t* vd,uint32_t numerator,uint32_t denominator)
 {
 	CLEAR(vd->frameint);
-	vd->frameint.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	vd->frameint.parm.capture.timeperframe.numerator = 1;
-	vd->frameint.parm.capture.timeperframe.denominator = vd->fps;
-	if (-1 == xioctl(vd->fd, VIDIOC_S_PARM, &vd->frameint))
+	vd->frameint.type = vd->buf_type;
+	vd->frameint.parm.capture.timeperframe.numerator = numerator;
+	vd->frameint.parm.capture.timeperframe.denominator = denominator;
+	if (-1 == v4l2core_ioctl(vd, VIDIOC_S_PARM, &vd->frameint))
 	{
-		fprintf(stderr, "Unable to set frame interval.\n");
+		log_error("Unable to set frame interval.");
+		return -1;
+	}
+	if (vd->frameint.parm.capture.timeperframe.numerator)
+		vd->fps = vd->frameint.parm.capture.timeperframe.denominator / vd->frameint.parm.capture.timeperframe.numerator;
+	return 0;
+}
+
+/**
+	set ring depth, a max_count above count lets the ring adapt between the two
+*/
+int v4l2core_capture_set_ring(v4l2_dev_t* vd,unsigned int count,unsigned int max_count)
+{
+	if (count < 2 || count > VIDIOC_REQBUFS_MAX) {
+		log_error("Ring depth %u out of range 2..%d", count, VIDIOC_REQBUFS_MAX);
+		return -1;
+	}
+	if (max_count > VIDIOC_REQBUFS_MAX)
+		max_count = VIDIOC_REQBUFS_MAX;
+
+	vd->req_count = count;
+	vd->ring.adaptive = max_count > count;
+	vd->ring.min_count = count;
+	vd->ring.max_count = vd->ring.adaptive ? max_count : count;
+	return 0;
+}
+
+/**
+	set the pool_flags of the IO_METHOD_USERPTR buffers; capture_init creates the pool,
+	so with POOL_NUMA_LOCAL call it on a thread running on the capture thread's node
+*/
+int v4l2core_capture_set_userptr_pool(v4l2_dev_t* vd,unsigned int flags)
+{
+	if (vd->userptr_pool) {
+		log_error("%s: userptr pool already allocated", vd->deviceName);
+		return -1;
+	}
+	vd->pool_flags = flags;
+	return 0;
+}
+
+/**
+	make capture_loop busy poll as poll describes, NULL goes back to blocking;
+	burns the core it runs on, opt in only where wakeup latency matters
+*/
+int v4l2core_capture_set_busy_poll(v4l2_dev_t* vd,const BusyPoll* poll)
+{
+	if (!poll) {
+		CLEAR(vd->busy);
+		return 0;
+	}
+	if (poll->cpu >= CPU_SETSIZE || (poll->priority && (poll->priority < sched_get_priority_min(SCHED_FIFO)
+	 || poll->priority > sched_get_priority_max(SCHED_FIFO)))) {
+		log_error("%s: bad busy poll cpu %d or priority %d", vd->deviceName, poll->cpu, poll->priority);
 		return -1;
 	}
+	if (vd->io == IO_METHOD_READ)
+		log_warn("%s: read i/o has no DQBUF to poll, it keeps blocking", vd->deviceName);
+	vd->busy = *poll;
+	vd->busy.enabled = 1;
 	return 0;
 }
 
+/**
+	parse a cpu list like "0,2-5" into set, -1 if it is malformed or empty
+*/
+static int cpuListParse(const char* list, cpu_set_t* set)
+{
+	const char* p = list;
+	char* end;
+	long lo, hi;
+
+	CPU_ZERO(set);
+	while (*p) {
+		lo = strtol(p, &end, 10);
+		if (end == p || lo < 0)
+			return -1;
+		hi = lo;
+		if ('-' == *end) {
+			p = end + 1;
+			hi = strtol(p, &end, 10);
+			if (end == p || hi < lo)
+				return -1;
+		}
+		if (hi >= CPU_SETSIZE)
+			return -1;
+		for (; lo <= hi; ++lo)
+			CPU_SET(lo, set);
+		p = end;
+		if (',' == *p)
+			++p;
+		else if (*p && '\n' != *p)
+			return -1;
+		else
+			break;
+	}
+	return CPU_COUNT(set) ? 0 : -1;
+}
+
+/**
+	choose where the thread capture_thread_start runs goes, NULL forgets the choice;
+	without cpus the thread floats over the cpus of node
+*/
+int v4l2core_capture_set_thread(v4l2_dev_t* vd,const CaptureThread* ct)
+{
+	struct v4l2_thread_t* th;
+	char path[64], list[1024];
+	int node;
+
+	if (vd->thread && vd->thread->running) {
+		log_error("%s: capture thread already running", vd->deviceName);
+		return -1;
+	}
+	if (!ct) {
+		free(vd->thread);
+		vd->thread = NULL;
+		return 0;
+	}
+	if ((ct->policy != SCHED_OTHER && ct->policy != SCHED_FIFO && ct->policy != SCHED_RR)
+	 || ct->priority < sched_get_priority_min(ct->policy) || ct->priority > sched_get_priority_max(ct->policy)) {
+		log_error("%s: bad capture thread policy %d priority %d", vd->deviceName, ct->policy, ct->priority);
+		return -1;
+	}
+
+	th = vd->thread ? vd->thread : calloc(1, sizeof(*th));
+	if (!th) {
+		log_error("Out of memory");
+		return -1;
+	}
+	vd->thread = th;
+	th->pinned = 0;
+	th->policy = ct->policy;
+	th->priority = ct->priority;
+
+	node = ct->node;
+	if (CAPTURE_NODE_DEVICE == node) {
+		node = v4l2core_dev_numa_node(vd);
+		if (node < 0)
+			log_info("%s: no NUMA node known for the device", vd->deviceName);
+	}
+	th->node = node < 0 ? -1 : node;
+
+	if (ct->cpus && *ct->cpus) {
+		if (cpuListParse(ct->cpus, &th->cpus) < 0) {
+			log_error("%s: bad cpu list '%s'", vd->deviceName, ct->cpus);
+			return -1;
+		}
+		th->pinned = 1;
+	} else if (th->node >= 0) {
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", th->node);
+		if (sysfsRead(path, list, sizeof(list)) < 0 || cpuListParse(list, &th->cpus) < 0)
+			log_warn("%s: no cpus found for node %d", vd->deviceName, th->node);
+		else
+			th->pinned = 1;
+	}
+	return 0;
+}
+
+/**
+	set the dmabuf fds IO_METHOD_DMABUF captures into, the caller keeps ownership
+*/
+int v4l2core_capture_set_dmabuf_pool(v4l2_dev_t* vd,const int* fds,unsigned int count)
+{
+	int* pool = NULL;
+
+	if (count) {
+		pool = malloc(count * sizeof(*pool));
+		if (!pool) {
+			log_error("Out of memory");
+			return -1;
+		}
+		memcpy(pool, fds, count * sizeof(*pool));
+	}
+
+	free(vd->import_fds);
+	vd->import_fds = pool;
+	vd->n_import_fds = count;
+	return 0;
+}
+
+/**
+	add a subscriber: ring gets a lease on every captured frame from now on.
+	Subscribers share the buffer, it goes back to the driver once all of them
+	released it; give each its own depth and a drop policy so a slow one only
+	loses its own frames.  Not for IO_METHOD_READ, and not for
+	RING_OVERFLOW_BLOCK rings: the capture thread pushes to every subscriber
+	in turn and must never wait on one.
+*/
+int v4l2core_subscribe(v4l2_dev_t* vd,struct v4l2_ring_t* ring)
+{
+	int r = 0;
+
+	if (vd->io == IO_METHOD_READ) {
+		log_error("%s: read i/o frames can't be shared", vd->deviceName);
+		return -1;
+	}
+	if (v4l2ring_overflow(ring) == RING_OVERFLOW_BLOCK) {
+		log_error("%s: a blocking ring would stall capture, subscribe with a drop policy", vd->deviceName);
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&vd->subs_lock);
+	if (vd->n_subs == V4L2CORE_SUBSCRIBERS) {
+		log_error("%s: more than %d subscribers", vd->deviceName, V4L2CORE_SUBSCRIBERS);
+		r = -1;
+	} else {
+		vd->subs[vd->n_subs++] = ring;
+	}
+	pthread_mutex_unlock(&vd->subs_lock);
+	return r;
+}
+
+/**
+	remove a subscriber; once this returns the capture thread no longer
+	pushes to ring and the caller may close and destroy it
+*/
+int v4l2core_unsubscribe(v4l2_dev_t* vd,struct v4l2_ring_t* ring)
+{
+	unsigned int i;
+	int r = -1;
+
+	pthread_mutex_lock(&vd->subs_lock);
+	for (i = 0; i < vd->n_subs; ++i) {
+		if (vd->subs[i] == ring) {
+			vd->subs[i] = vd->subs[--vd->n_subs];
+			vd->subs[vd->n_subs] = NULL;
+			r = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&vd->subs_lock);
+	return r;
+}
+
 int v4l2core_capture_init(v4l2_dev_t *vd)
 {
+	/* Buffers and frame descriptors follow the format the driver settled on. */
+	vd->fmtack.type = vd->buf_type;
+	if (-1 == v4l2core_ioctl(vd, VIDIOC_G_FMT, &vd->fmtack)) {
+		log_errno("VIDIOC_G_FMT");
+		return -1;
+	}
+	vd->read_sequence = 0;
+
+	/* The adaptive ring measures callbacks against the frame period, read the
+	   driver's rate if dev_init or dev_set_fps didn't; never guess one. */
+	if (!framePeriod(vd)) {
+		CLEAR(vd->frameint);
+		vd->frameint.type = vd->buf_type;
+		if (-1 == v4l2core_ioctl(vd, VIDIOC_G_PARM, &vd->frameint))
+			CLEAR(vd->frameint);
+	}
+	if (vd->ring.adaptive && !framePeriod(vd)) {
+		log_warn("%s: frame rate unknown, ring fixed at %u buffers", vd->deviceName, vd->ring.min_count);
+		vd->ring.adaptive = 0;
+		vd->ring.max_count = vd->ring.min_count;
+	}
+
+	vd->n_planes = isMplane(vd) ? vd->fmtack.fmt.pix_mp.num_planes : 1;
+	if (vd->n_planes < 1 || vd->n_planes > V4L2CORE_MAX_PLANES) {
+		log_error("%s: unsupported plane count %u", vd->deviceName, vd->n_planes);
+		return -1;
+	}
+	vd->buffer_size = fmtPlaneSize(vd, &vd->fmtack, 0);
+
 	switch (vd->io)
 	{
 	case IO_METHOD_READ:
-		vd->buffer_size = vd->fmt.fmt.pix.sizeimage;
+		if (isMplane(vd)) {
+			log_error("%s: read i/o is single-planar only", vd->deviceName);
+			return -1;
+		}
 		return readInit(vd);
 		break;
 	case IO_METHOD_MMAP:
 		return mmapInit(vd);
 		break;
 	case IO_METHOD_USERPTR:
-		vd->buffer_size = vd->fmt.fmt.pix.sizeimage;
 		return userptrInit(vd);
 		break;
+	case IO_METHOD_DMABUF:
+		return dmabufInit(vd);
+		break;
 	default:
 		break;
 	}
 	return -1;
 }
 
-void v4l2core_capture_uninit(v4l2_dev_t *vd)
+static void pullClose(v4l2_dev_t* vd);
+
+/**
+	free the buffers; fails with EBUSY while frames are still leased, their
+	descriptors live in the buffers and a late release would write to them
+*/
+int v4l2core_capture_uninit(v4l2_dev_t *vd)
 {
-	unsigned int i;
-	switch (vd->io) {
-		case IO_METHOD_READ:
-			free(vd->buffers[0].start);
-			break;
-		case IO_METHOD_MMAP:
-			for (i = 0; i < vd->n_buffers; ++i)
-				if (-1 == munmap(vd->buffers[i].start, vd->buffers[i].length))
-					errno_show("munmap");
-			break;
-		case IO_METHOD_USERPTR:
-			for (i = 0; i < vd->n_buffers; ++i)
-				free(vd->buffers[i].start);
-			break;
+	const v4l2_frame_t* frame;
+	unsigned int i, p;
+
+	/* Frames nobody pulled hold leases too; the ring and its fds stay for a retry. */
+	while (vd->pull && (frame = v4l2ring_pop(vd->pull, 0)) != NULL)
+		v4l2core_frame_release(frame);
+
+	if (__atomic_load_n(&vd->n_leased, __ATOMIC_ACQUIRE) > 0) {
+		log_error("%s: %d frames still leased, release them before uninit", vd->deviceName, vd->n_leased);
+		errno = EBUSY;
+		return -1;
 	}
+	pullClose(vd);
+	for (i = 0; i < vd->n_buffers; ++i) {
+		if (vd->buffers[i].removed)
+			continue;
+		for (p = 0; p < vd->n_planes; ++p) {
+			buffer_plane *bp = &vd->buffers[i].planes[p];
+
+			switch (vd->io) {
+				case IO_METHOD_READ:
+					free(bp->start);
+					break;
+				case IO_METHOD_USERPTR:
+					/* Slots of the pool, it goes below. */
+					break;
+				case IO_METHOD_MMAP:
+					if (bp->dmabuf_fd >= 0)
+						close(bp->dmabuf_fd);
+					if (bp->start && -1 == vd->backend->munmap(vd, bp->start, bp->length))
+						log_errno("munmap");
+					break;
+				case IO_METHOD_DMABUF:
+					/* The fds belong to the caller, only drop our mappings. */
+					if (bp->start)
+						munmap(bp->start, bp->length);
+					break;
+			}
+		}
+	}
+	v4l2pool_destroy(vd->userptr_pool);
+	vd->userptr_pool = NULL;
 	free(vd->buffers);
+	free(vd->dqbufs);
+	free(vd->dqplanes);
+	free(vd->batch);
+	vd->buffers = NULL;
+	vd->dqbufs = NULL;
+	vd->dqplanes = NULL;
+	vd->batch = NULL;
+	return 0;
 }
 
 int v4l2core_capture_start(v4l2_dev_t* vd)
 {
-    printf("v4l2core_capture_start:\tn_buffers:%d\n",vd->n_buffers);
+    log_debug("v4l2core_capture_start:\tn_buffers:%d",vd->n_buffers);
 	unsigned int i;
 	enum v4l2_buf_type type;
 
+	vd->stats.sequence_valid = 0;
+
 	switch (vd->io) {
 		case IO_METHOD_READ:
 			/* Nothing to do. */
 			break;
 		case IO_METHOD_MMAP:
+		case IO_METHOD_DMABUF:
+			/* Parked and removed slots wait for the adaptive ring, frames still
+			   leased from the last run go back when released. */
+			pthread_mutex_lock(&vd->lease_lock);
 			for (i = 0; i < vd->n_buffers; ++i) {
-                printf("v4l2core_capture_start:\tn_buffers:%d\n",i);
-				struct v4l2_buffer buf;
-
-				CLEAR(buf);
-
-				buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-				buf.memory = V4L2_MEMORY_MMAP;
-				buf.index = i;
-
-				if (-1 == xioctl(vd->fd, VIDIOC_QBUF, &buf)){
-                    errno_show("VIDIOC_QBUF");
+                log_debug("v4l2core_capture_start:\tn_buffers:%d",i);
+				if (vd->buffers[i].parked || vd->buffers[i].removed ||
+					__atomic_load_n(&vd->buffers[i].frame.refs, __ATOMIC_ACQUIRE))
+					continue;
+				if (-1 == bufferQueue(vd, i)){
+                    log_errno("VIDIOC_QBUF");
+					pthread_mutex_unlock(&vd->lease_lock);
 					return -1;
                 }
             }
 
-			type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+			type = vd->buf_type;
 
-			if (-1 == xioctl(vd->fd, VIDIOC_STREAMON, &type)){
-                errno_show("VIDIOC_STREAMON");
+			if (-1 == v4l2core_ioctl(vd, VIDIOC_STREAMON, &type)){
+                log_errno("VIDIOC_STREAMON");
+				pthread_mutex_unlock(&vd->lease_lock);
 				return -1;
             }
+			vd->streaming = 1;
+			pthread_mutex_unlock(&vd->lease_lock);
 
 			break;
 		case IO_METHOD_USERPTR:
+			pthread_mutex_lock(&vd->lease_lock);
 			for (i = 0; i < vd->n_buffers; ++i) {
-				struct v4l2_buffer buf;
-
-			CLEAR (buf);
-
-			buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-			buf.memory = V4L2_MEMORY_USERPTR;
-			buf.index = i;
-			buf.m.userptr = (unsigned long) vd->buffers[i].start;
-			buf.length = vd->buffers[i].length;
-
-			if (-1 == xioctl(vd->fd, VIDIOC_QBUF, &buf))
-				return -1;
+				if (vd->buffers[i].parked || vd->buffers[i].removed ||
+					__atomic_load_n(&vd->buffers[i].frame.refs, __ATOMIC_ACQUIRE))
+					continue;
+				if (-1 == bufferQueue(vd, i)) {
+					pthread_mutex_unlock(&vd->lease_lock);
+					return -1;
+				}
 			}
 
-			type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+			type = vd->buf_type;
 
-			if (-1 == ioctl(vd->fd, VIDIOC_STREAMON, &type))
+			if (-1 == v4l2core_ioctl(vd, VIDIOC_STREAMON, &type)) {
+				pthread_mutex_unlock(&vd->lease_lock);
 				return -1;
+			}
+			vd->streaming = 1;
+			pthread_mutex_unlock(&vd->lease_lock);
 			break;
 	}
 	return 0;
@@ -512,22 +1454,263 @@ int v4l2core_capture_start(v4l2_dev_t* vd)
 /**
 	process orignal raw data
 */
-static void dataProcess(v4l2_dev_t* vd,const void* p,int len ,struct timeval timestamp)
+static void dataProcess(v4l2_dev_t* vd,const v4l2_frame_t* frame)
+{
+    log_debug("video recive:\t%d",frame->bytesused);
+}
+
+/**
+	describe a filled buffer for the frame callbacks
+*/
+static v4l2_frame_t* frameFill(v4l2_dev_t* vd,unsigned int index,const struct v4l2_buffer* buf)
 {
-    printf("video recive:\t%d\n",len);
+	v4l2_frame_t* frame = &vd->buffers[index].frame;
+	const struct v4l2_pix_format* pix = &vd->fmtack.fmt.pix;
+	const struct v4l2_pix_format_mplane* mp = &vd->fmtack.fmt.pix_mp;
+	unsigned int p;
+
+	frame->n_planes = vd->n_planes;
+	for (p = 0; p < vd->n_planes; ++p) {
+		v4l2_frame_plane_t* fp = &frame->planes[p];
+		const buffer_plane* bp = &vd->buffers[index].planes[p];
+		void* payload = vd->backend->payload ? vd->backend->payload(vd, buf, p) : NULL;
+
+		/* A backend may hand out bytes that live elsewhere, read-only and not in the dmabuf. */
+		fp->start = payload ? payload : bp->start;
+		fp->length = bp->length;
+		fp->dmabuf_fd = payload ? -1 : bp->dmabuf_fd;
+		if (isMplane(vd)) {
+			fp->bytesused = buf->m.planes[p].bytesused;
+			fp->data_offset = buf->m.planes[p].data_offset;
+			fp->bytesperline = mp->plane_fmt[p].bytesperline;
+		} else {
+			fp->bytesused = buf->bytesused;
+			fp->data_offset = 0;
+			fp->bytesperline = pix->bytesperline;
+		}
+	}
+
+	frame->start = frame->planes[0].start;
+	frame->bytesused = frame->planes[0].bytesused;
+	frame->index = index;
+	frame->timestamp = buf->timestamp;
+	frame->sequence = buf->sequence;
+	frame->field = buf->field;
+	frame->flags = buf->flags;
+	if (isMplane(vd)) {
+		frame->pixelformat = mp->pixelformat;
+		frame->width = mp->width;
+		frame->height = mp->height;
+	} else {
+		frame->pixelformat = pix->pixelformat;
+		frame->width = pix->width;
+		frame->height = pix->height;
+	}
+	frame->bytesperline = frame->planes[0].bytesperline;
+	frame->dmabuf_fd = frame->planes[0].dmabuf_fd;
+	frame->vd = vd;
+	frame->refs = 1;    /* ours until the callbacks return */
+	return frame;
 }
 
 /**
-	read single frame
+	run the callbacks over the n frames in vd->batch dequeued at dq_ns,
+	returns the time spent in them
+*/
+static uint64_t frameDispatch(v4l2_dev_t* vd,unsigned int n,uint64_t dq_ns)
+{
+	LatencyStats* lat = &vd->latency;
+	uint64_t entry, done, total = 0;
+	unsigned int i, s;
+
+	/* Queue the batch first so consumer threads start on it while the callbacks run.
+	   Subscribers all drop on overflow, so no push waits under subs_lock. */
+	if (__atomic_load_n(&vd->n_subs, __ATOMIC_RELAXED) && vd->io != IO_METHOD_READ) {
+		pthread_mutex_lock(&vd->subs_lock);
+		for (s = 0; s < vd->n_subs; ++s)
+			for (i = 0; i < n; ++i)
+				v4l2ring_push(vd->subs[s], vd->batch[i]);
+		pthread_mutex_unlock(&vd->subs_lock);
+	}
+
+	for (i = 0; i < n; ++i) {
+		const v4l2_frame_t* frame = vd->batch[i];
+		int buff_cb = vd->VBuffCallback && frame->start;
+		int frame_cb = vd->VFrameCallback && !vd->VBatchCallback;
+
+		if (!buff_cb && !frame_cb)
+			continue;
+
+		entry = monotonicNs();
+		if (!vd->VBatchCallback)
+			v4l2hist_record(&lat->dequeue_to_callback, entry - dq_ns);
+
+		if(buff_cb){
+			vd->VBuffCallback((char*)frame->start,frame->bytesused);
+		}
+		if (frame_cb)
+			vd->VFrameCallback(vd, frame);
+
+		done = monotonicNs();
+		v4l2hist_record(&lat->callback, done - entry);
+		total += done - entry;
+	}
+
+	if (vd->VBatchCallback) {
+		entry = monotonicNs();
+		for (i = 0; i < n; ++i)
+			v4l2hist_record(&lat->dequeue_to_callback, entry - dq_ns);
+
+		vd->VBatchCallback(vd, (const v4l2_frame_t* const*)vd->batch, n);
+
+		done = monotonicNs();
+		v4l2hist_record(&lat->callback, done - entry);
+		total += done - entry;
+	}
+	return total;
+}
+
+/**
+	dequeue every buffer the driver has ready, returns how many
+*/
+static int frameDequeue(v4l2_dev_t* vd)
+{
+	unsigned int n;
+
+	for (n = 0; n < vd->n_buffers; ++n) {
+		struct v4l2_buffer *buf = &vd->dqbufs[n];
+
+		CLEAR(*buf);
+
+		buf->type = vd->buf_type;
+		buf->memory = ioMemory(vd);
+		if (isMplane(vd)) {
+			buf->m.planes = &vd->dqplanes[n * V4L2CORE_MAX_PLANES];
+			buf->length = V4L2CORE_MAX_PLANES;
+		}
+
+		if (-1 == v4l2core_ioctl(vd, VIDIOC_DQBUF, buf)) {
+			switch (errno) {
+				case EAGAIN:
+					return n;
+
+				case EIO:
+					// Could ignore EIO, see spec
+					// fall through
+
+				default:
+					log_errno("VIDIOC_DQBUF");
+					/* Still deliver and requeue what we already hold. */
+					return n ? (int)n : -1;
+			}
+		}
+		/* A USERPTR buffer is identified by its memory, the pool maps that straight to an index. */
+		if (IO_METHOD_USERPTR == vd->io) {
+			int index = v4l2pool_index(vd->userptr_pool,
+				(void*)(isMplane(vd) ? buf->m.planes[0].m.userptr : buf->m.userptr));
+
+			if (index < 0 || (unsigned int)index >= vd->n_buffers) {
+				log_error("%s: dequeued unknown user pointer", vd->deviceName);
+				return n ? (int)n : -1;
+			}
+			buf->index = index;
+		}
+		assert(buf->index < vd->n_buffers);
+	}
+	return n;
+}
+
+/**
+	single writer counter update, readers load without locks
+*/
+static inline void statAdd(uint64_t* counter,uint64_t n)
+{
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+/**
+	account a dequeued buffer against the device loss counters
+*/
+static void frameAccount(v4l2_dev_t* vd,const struct v4l2_buffer* buf,uint64_t dq_ns)
+{
+	CaptureStats* st = &vd->stats;
+	uint64_t ts_ns;
+	uint32_t gap;
+
+	/* Only monotonic kernel timestamps share our clock. */
+	if (dq_ns && (buf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) {
+		ts_ns = (uint64_t)buf->timestamp.tv_sec * 1000000000ull + (uint64_t)buf->timestamp.tv_usec * 1000;
+		if (dq_ns >= ts_ns)
+			v4l2hist_record(&vd->latency.capture_to_dequeue, dq_ns - ts_ns);
+	}
+
+	statAdd(&st->frames, 1);
+	if (buf->flags & V4L2_BUF_FLAG_ERROR)
+		statAdd(&st->errors, 1);
+	if (0 == (isMplane(vd) ? buf->m.planes[0].bytesused : buf->bytesused))
+		statAdd(&st->empty, 1);
+
+	if (st->sequence_valid) {
+		gap = buf->sequence - st->last_sequence - 1;
+		/* A backwards step is a driver restart, not a loss. */
+		if (gap && gap < 0x80000000u)
+			statAdd(&st->dropped, gap);
+	}
+	__atomic_store_n(&st->last_sequence, buf->sequence, __ATOMIC_RELAXED);
+	st->sequence_valid = 1;
+}
+
+/**
+	give a dequeued buffer back to the driver
+*/
+static void frameRecycle(v4l2_dev_t* vd,unsigned int index)
+{
+	if (vd->io == IO_METHOD_DMABUF)
+		dmabufSync(vd, index, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+	if (-1 == bufferQueue(vd, index))
+		log_errno("VIDIOC_QBUF");
+}
+
+/**
+	every buffer is held by a lease, apply the device policy
+*/
+static void leaseExhausted(v4l2_dev_t* vd)
+{
+	int grow = 0;
+
+	statAdd(&vd->stats.lease_stalls, 1);
+
+	switch (vd->leasePolicy) {
+		case LEASE_POLICY_GROW:
+			grow = 1;
+			break;
+		case LEASE_POLICY_CALLBACK:
+			grow = vd->LeaseCallback && vd->LeaseCallback(vd);
+			break;
+		default:
+			break;
+	}
+
+	/* The callback may have released leases itself. */
+	if (grow && __atomic_load_n(&vd->n_leased, __ATOMIC_ACQUIRE) >= (int)vd->ring.n_active)
+		ringGrow(vd, 1);
+}
+
+/**
+	read all ready frames, returns the number handled
 */
 static int frameRead(v4l2_dev_t* vd)
 {
-	struct v4l2_buffer buf;
+	struct v4l2_buffer *buf;
 	unsigned int i;
+	uint64_t dq_ns, cb_ns;
+	ssize_t len;
+	int n, leased;
 
 	switch (vd->io) {
 		case IO_METHOD_READ:
-			if (-1 == read(vd->fd, vd->buffers[0].start, vd->buffers[0].length)) {
+			len = vd->backend->read(vd, vd->buffers[0].planes[0].start, vd->buffers[0].planes[0].length);
+			if (-1 == len) {
 				switch (errno) {
 					case EAGAIN:
 						return 0;
@@ -541,111 +1724,152 @@ static int frameRead(v4l2_dev_t* vd)
 				}
 			}
 
+			/* read() carries no metadata, stamp the frame ourselves. */
 			struct timespec ts;
-			struct timeval timestamp;
+			buf = &vd->dqbufs[0];
+			CLEAR(*buf);
 			clock_gettime(CLOCK_MONOTONIC,&ts);
-			timestamp.tv_sec = ts.tv_sec;
-			timestamp.tv_usec = ts.tv_nsec/1000;
-
-			dataProcess(vd,vd->buffers[0].start,vd->buffers[0].length,timestamp);
-			if(vd->VBuffCallback){
-                vd->VBuffCallback((char*)vd->buffers[0].start,vd->buffers[0].length);
-            }
-			break;
+			buf->timestamp.tv_sec = ts.tv_sec;
+			buf->timestamp.tv_usec = ts.tv_nsec/1000;
+			buf->flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+			buf->field = V4L2_FIELD_NONE;
+			buf->sequence = vd->read_sequence++;
+			buf->bytesused = len;
+
+			frameAccount(vd, buf, 0);
+			vd->batch[0] = frameFill(vd, 0, buf);
+			dataProcess(vd,vd->batch[0]);
+			frameDispatch(vd, 1, monotonicNs());
+			__atomic_sub_fetch(&vd->buffers[0].frame.refs, 1, __ATOMIC_RELEASE);
+			return 1;
 		case IO_METHOD_MMAP:
-			CLEAR(buf);
-
-			buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-			buf.memory = V4L2_MEMORY_MMAP;
-            //puts("VIDIOC_DQBUF");
-			if (-1 == xioctl(vd->fd, VIDIOC_DQBUF, &buf)) {
-				switch (errno) {
-					case EAGAIN:
-						return 0;
-
-					case EIO:
-						// Could ignore EIO, see spec
-						// fall through
-
-					default:
-                        errno_show("VIDIOC_DQBUF");
-						return -1;
-				}
+		case IO_METHOD_USERPTR:
+		case IO_METHOD_DMABUF:
+			n = frameDequeue(vd);
+			if (n <= 0)
+				return n;
+
+			dq_ns = monotonicNs();
+			for (i = 0; i < (unsigned int)n; ++i) {
+				buf = &vd->dqbufs[i];
+				if (vd->io == IO_METHOD_DMABUF)
+					dmabufSync(vd, buf->index, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+				frameAccount(vd, buf, dq_ns);
+				vd->batch[i] = frameFill(vd, buf->index, buf);
+				dataProcess(vd,vd->batch[i]);
 			}
 
-			assert(buf.index < vd->n_buffers);
-			dataProcess(vd,vd->buffers[buf.index].start,buf.bytesused,buf.timestamp);
-			if(vd->VBuffCallback){
-                vd->VBuffCallback((char*)vd->buffers[buf.index].start,buf.bytesused);
-            }
-			if (-1 == xioctl(vd->fd, VIDIOC_QBUF, &buf))
-                errno_show("VIDIOC_QBUF");
-
-			break;
-        case IO_METHOD_USERPTR:
-				CLEAR (buf);
-
-				buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-				buf.memory = V4L2_MEMORY_USERPTR;
-
-				if (-1 == ioctl(vd->fd, VIDIOC_DQBUF, &buf)) {
-					switch (errno) {
-						case EAGAIN:
-							return 0;
-
-						case EIO:
-							// Could ignore EIO, see spec.
-							// fall through
+			cb_ns = frameDispatch(vd, n, dq_ns) / n;
+
+			/* Drop our reference and hand back the whole batch before the next wakeup,
+			   leased buffers go back when their last holder releases them. */
+			for (i = 0; i < (unsigned int)n; ++i) {
+				buf = &vd->dqbufs[i];
+				leased = __atomic_sub_fetch(&vd->buffers[buf->index].frame.refs, 1, __ATOMIC_ACQ_REL) > 0;
+				if (leased)
+					__atomic_add_fetch(&vd->n_leased, 1, __ATOMIC_RELAXED);
+				if (vd->ring.adaptive && ringAdapt(vd, buf->index, cb_ns, !leased))
+					continue;
+				if (!leased)
+					frameRecycle(vd, buf->index);
+			}
 
-						default:
-							errno_show("VIDIOC_DQBUF");
-							return -1;
-					}
-				}
+			if (__atomic_load_n(&vd->n_leased, __ATOMIC_ACQUIRE) >= (int)vd->ring.n_active)
+				leaseExhausted(vd);
+			return n;
+	}
+	return -1;
+}
 
-				for (i = 0; i < vd->n_buffers; ++i)
-					if (buf.m.userptr == (unsigned long)vd->buffers[i].start 
-					&& buf.length == vd->buffers[i].length)
-						break;
+static void cpuRelax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
 
-				assert (i < vd->n_buffers);
+/**
+	poll VIDIOC_DQBUF on the calling thread until bcapture drops,
+	under the affinity and policy vd->busy asks for
+*/
+static void busyLoop(v4l2_dev_t* vd)
+{
+	const BusyPoll* bp = &vd->busy;
+	pthread_t self = pthread_self();
+	cpu_set_t cpus, saved_cpus;
+	struct sched_param param, saved_param;
+	int saved_policy, pinned = 0, fifo = 0;
+	unsigned int idle = 0, i;
+	uint64_t sleep_ns;
+	struct timespec ts;
+
+	if (bp->cpu >= 0 && 0 == pthread_getaffinity_np(self, sizeof(saved_cpus), &saved_cpus)) {
+		CPU_ZERO(&cpus);
+		CPU_SET(bp->cpu, &cpus);
+		if (pthread_setaffinity_np(self, sizeof(cpus), &cpus))
+			log_warn("%s: can't pin the capture thread to cpu %d", vd->deviceName, bp->cpu);
+		else
+			pinned = 1;
+	}
+	if (bp->priority > 0 && 0 == pthread_getschedparam(self, &saved_policy, &saved_param)) {
+		CLEAR(param);
+		param.sched_priority = bp->priority;
+		if (pthread_setschedparam(self, SCHED_FIFO, &param))
+			log_warn("%s: no SCHED_FIFO priority %d, polling at normal priority", vd->deviceName, bp->priority);
+		else
+			fifo = 1;
+	}
+	log_info("%s: busy polling%s%s", vd->deviceName, pinned ? " pinned" : "", fifo ? " under SCHED_FIFO" : "");
 
-				//imageProcess((void *)buf.m.userptr,buf.timestamp);
-				dataProcess(vd,vd->buffers[buf.index].start,buf.bytesused,buf.timestamp);
+	while (vd->bcapture) {
+		if (frameRead(vd) > 0) {
+			idle = 0;
+			continue;
+		}
 
-				if (-1 == ioctl(vd->fd, VIDIOC_QBUF, &buf))
-				{
-					errno_show("VIDIOC_QBUF");
-					return -1;
-				}
-				break;
+		for (i = 0; i < bp->spins; ++i)
+			cpuRelax();
+
+		/* Back off exponentially once the device has gone quiet, a stalled
+		   or stopped stream shouldn't hold the core at full tilt. */
+		if (bp->backoff_us && ++idle > BUSY_IDLE_POLLS) {
+			sleep_ns = 1000ull << ((idle - BUSY_IDLE_POLLS) < 16 ? (idle - BUSY_IDLE_POLLS) : 16);
+			if (sleep_ns > bp->backoff_us * 1000ull)
+				sleep_ns = bp->backoff_us * 1000ull;
+			ts.tv_sec = sleep_ns / 1000000000ull;
+			ts.tv_nsec = sleep_ns % 1000000000ull;
+			nanosleep(&ts, NULL);
+		}
 	}
-	return 1;
+
+	if (fifo)
+		pthread_setschedparam(self, saved_policy, &saved_param);
+	if (pinned)
+		pthread_setaffinity_np(self, sizeof(saved_cpus), &saved_cpus);
 }
 
 void v4l2core_capture_loop(v4l2_dev_t* vd)
 {
-    fd_set fds;
-    struct timeval tv;
     int r;
 
-    while (vd->bcapture) {
-
-        FD_ZERO(&fds);
-        FD_SET(vd->fd, &fds);
+    if (vd->busy.enabled && vd->io != IO_METHOD_READ) {
+        busyLoop(vd);
+        return;
+    }
 
-        /* Timeout. */
-        tv.tv_sec = 1;
-        tv.tv_usec = 0;
+    while (vd->bcapture) {
 
-        r = select(vd->fd + 1, &fds, NULL, NULL, &tv);
+        /* Timeout 1s. */
+        r = vd->backend->wait(vd, 1000);
         if(r<0)
         {
-            fprintf(stderr, "Could not grab image (select error): %s\n", strerror(errno));
+            log_error("Could not grab image (select error): %s", strerror(errno));
         }
         else if(r==0)
         {
-            fprintf(stderr, "Could not grab image (select timeout): %s\n", strerror(errno));
+            log_warn("Could not grab image (select timeout)");
         }
         else if(r>0)
         {
@@ -654,20 +1878,424 @@ void v4l2core_capture_loop(v4l2_dev_t* vd)
 	}
 }
 
+static void* captureThread(void* arg)
+{
+	v4l2_dev_t* vd = arg;
+	struct v4l2_thread_t* th = vd->thread;
+	struct sched_param param;
+	struct timespec ts;
+
+	pthread_setname_np(pthread_self(), "v4l2capture");
+	if (th->pinned && pthread_setaffinity_np(pthread_self(), sizeof(th->cpus), &th->cpus))
+		log_warn("%s: can't set the capture thread's affinity", vd->deviceName);
+	if (th->policy != SCHED_OTHER) {
+		CLEAR(param);
+		param.sched_priority = th->priority;
+		if (pthread_setschedparam(pthread_self(), th->policy, &param))
+			log_warn("%s: no realtime priority %d for the capture thread", vd->deviceName, th->priority);
+	}
+
+	v4l2core_capture_loop(vd);
+
+	if (0 == clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts))
+		__atomic_store_n(&th->cpu_ns, (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec, __ATOMIC_RELAXED);
+	__atomic_store_n(&th->exited, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/**
+	run capture_loop on a thread of the library's own, placed as capture_set_thread
+	asked; the capture must be started, stop it with capture_thread_stop
+*/
+int v4l2core_capture_thread_start(v4l2_dev_t* vd)
+{
+	struct v4l2_thread_t* th = vd->thread;
+	int r;
+
+	if (!th) {
+		th = calloc(1, sizeof(*th));
+		if (!th) {
+			log_error("Out of memory");
+			return -1;
+		}
+		th->policy = SCHED_OTHER;
+		th->node = -1;
+		vd->thread = th;
+	}
+	if (th->running) {
+		log_error("%s: capture thread already running", vd->deviceName);
+		return -1;
+	}
+
+	th->exited = 0;
+	th->cpu_ns = 0;
+	vd->bcapture = 1;
+	r = pthread_create(&th->tid, NULL, captureThread, vd);
+	if (r) {
+		log_error("%s: can't create the capture thread: %s", vd->deviceName, strerror(r));
+		vd->bcapture = 0;
+		return -1;
+	}
+	if (pthread_getcpuclockid(th->tid, &th->clock))
+		th->clock = CLOCK_THREAD_CPUTIME_ID;    //never valid from another thread, get_stats falls back
+	th->running = 1;
+	return 0;
+}
+
+/**
+	end the capture thread and wait for it, up to capture_loop's select timeout
+*/
+void v4l2core_capture_thread_stop(v4l2_dev_t* vd)
+{
+	struct v4l2_thread_t* th = vd->thread;
+
+	if (!th || !th->running || pthread_equal(th->tid, pthread_self()))
+		return;
+	__atomic_store_n(&vd->bcapture, 0, __ATOMIC_RELAXED);
+	pthread_join(th->tid, NULL);
+	th->running = 0;
+}
+
+/**
+	service a ready device from an external event loop,
+	returns the number of frames handled, 0 if none was ready, -1 on error
+*/
+int v4l2core_frame_read(v4l2_dev_t* vd)
+{
+	return frameRead(vd);
+}
+
+/**
+	set up pulling on first use: a drop-oldest ring subscribed to the device,
+	one frame shallower than the ring of buffers, so frames the application
+	is slow to take are evicted and requeued before the driver runs dry
+*/
+static int pullInit(v4l2_dev_t* vd)
+{
+	struct epoll_event ev;
+	v4l2_ring_t* ring;
+	int fds[3], i;
+
+	if (vd->pull)
+		return 0;
+	if (vd->io == IO_METHOD_READ || !vd->ring.capacity) {
+		log_error("%s: pulling frames needs streaming i/o set up by capture_init", vd->deviceName);
+		errno = EINVAL;
+		return -1;
+	}
+
+	ring = v4l2ring_create(vd->ring.n_active > 1 ? vd->ring.n_active - 1 : 1,
+		RING_MODE_MPMC, RING_OVERFLOW_DROP_OLDEST, RING_WAIT_EVENTFD);
+	if (!ring)
+		return -1;
+	vd->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	vd->pullfd = epoll_create1(EPOLL_CLOEXEC);
+	if (vd->wakefd < 0 || vd->pullfd < 0) {
+		log_errno("pull fds");
+		goto fail;
+	}
+
+	fds[0] = vd->wakefd;
+	fds[1] = v4l2ring_fd(ring);
+	fds[2] = vd->fd;
+	for (i = 0; i < 3; ++i) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.fd = fds[i];
+		if (-1 == epoll_ctl(vd->pullfd, EPOLL_CTL_ADD, fds[i], &ev)) {
+			log_errno("EPOLL_CTL_ADD");
+			goto fail;
+		}
+	}
+
+	if (v4l2core_subscribe(vd, ring) < 0)
+		goto fail;
+	vd->pull = ring;
+	return 0;
+
+fail:
+	v4l2ring_destroy(ring);
+	if (vd->pullfd >= 0)
+		close(vd->pullfd);
+	if (vd->wakefd >= 0)
+		close(vd->wakefd);
+	vd->pullfd = vd->wakefd = -1;
+	return -1;
+}
+
+/**
+	drop the frames nobody pulled and the pull fds
+*/
+static void pullClose(v4l2_dev_t* vd)
+{
+	if (!vd->pull)
+		return;
+	v4l2core_unsubscribe(vd, vd->pull);
+	v4l2ring_destroy(vd->pull);
+	close(vd->pullfd);
+	close(vd->wakefd);
+	vd->pull = NULL;
+	vd->pullfd = vd->wakefd = -1;
+}
+
+/**
+	a frame older than the whole ring of buffers sat in the driver while
+	nobody pulled, and the driver dropped what came after it
+*/
+static int pullStale(v4l2_dev_t* vd,const v4l2_frame_t* frame)
+{
+	uint64_t period = framePeriod(vd), ts_ns;
+
+	if (!period || (frame->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) != V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+		return 0;
+	ts_ns = (uint64_t)frame->timestamp.tv_sec * 1000000000ull + (uint64_t)frame->timestamp.tv_usec * 1000;
+	return monotonicNs() > ts_ns + period * vd->ring.n_active;
+}
+
+/**
+	take the next frame, dequeuing from the driver as needed; waits up to
+	timeout_ms, -1 for ever.  The caller holds a lease on the frame and hands
+	it back with v4l2core_frame_release.  Returns NULL with errno ETIMEDOUT,
+	EINTR after v4l2core_frame_wakeup, or EIO on a capture error.
+	Frames that waited out an idle spell longer than the ring of buffers
+	covers are skipped for current ones.
+	Callbacks and subscribers still see every frame.  This drives the device
+	itself, so don't run capture_loop or an engine on it as well.  Not for
+	IO_METHOD_READ.
+*/
+const v4l2_frame_t* v4l2core_frame_dequeue(v4l2_dev_t* vd,int timeout_ms)
+{
+	const v4l2_frame_t* frame;
+	struct epoll_event ev[3];
+	uint64_t deadline = 0, now, v;
+	unsigned int stale = 0;
+	int i, n, wait = timeout_ms;
+
+	if (pullInit(vd) < 0)
+		return NULL;
+	if (timeout_ms > 0)
+		deadline = monotonicNs() + (uint64_t)timeout_ms * 1000000;
+
+	for (;;) {
+		frame = v4l2ring_pop(vd->pull, 0);
+		if (frame && stale < vd->ring.n_active && pullStale(vd, frame)) {
+			/* Requeued at once, the driver fills it with a current frame. */
+			v4l2core_frame_release(frame);
+			++stale;
+			continue;
+		}
+		if (frame)
+			return frame;
+
+		if (timeout_ms > 0) {
+			now = monotonicNs();
+			wait = now >= deadline ? 0 : (int)((deadline - now + 999999) / 1000000);
+		}
+		n = epoll_wait(vd->pullfd, ev, 3, wait);
+		if (n < 0) {
+			if (EINTR == errno)
+				continue;
+			log_errno("epoll_wait");
+			return NULL;
+		}
+		if (0 == n) {
+			errno = ETIMEDOUT;
+			return NULL;
+		}
+
+		for (i = 0; i < n; ++i) {
+			if (ev[i].data.fd == vd->wakefd) {
+				if (read(vd->wakefd, &v, sizeof(v)) < 0 && EAGAIN != errno)
+					log_errno("wakeup eventfd");
+				errno = EINTR;
+				return NULL;
+			}
+		}
+		for (i = 0; i < n; ++i) {
+			if (ev[i].data.fd == vd->fd && frameRead(vd) < 0) {
+				errno = EIO;
+				return NULL;
+			}
+		}
+	}
+}
+
+/**
+	fd for an external epoll or poll loop, readable while v4l2core_frame_dequeue
+	has a frame to return or a wakeup pending; dequeue with timeout 0 from there
+*/
+int v4l2core_frame_pull_fd(v4l2_dev_t* vd)
+{
+	if (pullInit(vd) < 0)
+		return -1;
+	return vd->pullfd;
+}
+
+/**
+	make a blocked v4l2core_frame_dequeue return NULL with EINTR, from any thread
+*/
+void v4l2core_frame_wakeup(v4l2_dev_t* vd)
+{
+	uint64_t v = 1;
+
+	if (vd->wakefd >= 0 && write(vd->wakefd, &v, sizeof(v)) != sizeof(v))
+		log_errno("wakeup eventfd");
+}
+
 void v4l2core_capture_stop(v4l2_dev_t* vd)
 {
     enum v4l2_buf_type type;
 
+	/* Never pull the buffers out from under a library thread still dequeuing. */
+	v4l2core_capture_thread_stop(vd);
+
 	switch (vd->io) {
 		case IO_METHOD_READ:
 			/* Nothing to do. */
 			break;
 		case IO_METHOD_MMAP:
 		case IO_METHOD_USERPTR:
-			type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-
-			if (-1 == ioctl(vd->fd, VIDIOC_STREAMOFF, &type))
-			puts("VIDIOC_STREAMOFF error.");
+		case IO_METHOD_DMABUF:
+			type = vd->buf_type;
+			/* A release racing us either requeues before STREAMOFF or sees streaming clear. */
+			pthread_mutex_lock(&vd->lease_lock);
+			vd->streaming = 0;
+
+			if (-1 == v4l2core_ioctl(vd, VIDIOC_STREAMOFF, &type))
+			log_errno("VIDIOC_STREAMOFF");
+			pthread_mutex_unlock(&vd->lease_lock);
 			break;
 	}
 }
+
+static uint64_t threadCpu(struct v4l2_thread_t* th)
+{
+	struct timespec ts;
+
+	if (!th || !th->running || __atomic_load_n(&th->exited, __ATOMIC_ACQUIRE))
+		return th ? __atomic_load_n(&th->cpu_ns, __ATOMIC_RELAXED) : 0;
+	if (th->clock == CLOCK_THREAD_CPUTIME_ID || clock_gettime(th->clock, &ts))
+		return __atomic_load_n(&th->cpu_ns, __ATOMIC_RELAXED);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+	snapshot the loss counters, safe from any thread while capturing
+*/
+void v4l2core_get_stats(v4l2_dev_t* vd,CaptureStats* stats)
+{
+	CaptureStats* st = &vd->stats;
+
+	stats->frames = __atomic_load_n(&st->frames, __ATOMIC_RELAXED);
+	stats->dropped = __atomic_load_n(&st->dropped, __ATOMIC_RELAXED);
+	stats->errors = __atomic_load_n(&st->errors, __ATOMIC_RELAXED);
+	stats->empty = __atomic_load_n(&st->empty, __ATOMIC_RELAXED);
+	stats->lease_stalls = __atomic_load_n(&st->lease_stalls, __ATOMIC_RELAXED);
+	stats->last_sequence = __atomic_load_n(&st->last_sequence, __ATOMIC_RELAXED);
+	stats->sequence_valid = __atomic_load_n(&st->sequence_valid, __ATOMIC_RELAXED);
+	stats->thread_cpu_ns = threadCpu(vd->thread);
+}
+
+/**
+	snapshot the latency histograms, safe from any thread while capturing
+*/
+void v4l2core_get_latency(v4l2_dev_t* vd,LatencyStats* latency)
+{
+	v4l2hist_snapshot(&vd->latency.capture_to_dequeue, &latency->capture_to_dequeue);
+	v4l2hist_snapshot(&vd->latency.dequeue_to_callback, &latency->dequeue_to_callback);
+	v4l2hist_snapshot(&vd->latency.callback, &latency->callback);
+}
+
+/**
+	keep a frame past the callback that delivered it
+*/
+void v4l2core_frame_retain(const v4l2_frame_t* frame)
+{
+	v4l2_frame_t* f = (v4l2_frame_t*)frame;
+
+	__atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+}
+
+/**
+	drop a lease, from any thread; the last one requeues the buffer
+*/
+void v4l2core_frame_release(const v4l2_frame_t* frame)
+{
+	v4l2_frame_t* f = (v4l2_frame_t*)frame;
+	v4l2_dev_t* vd = f->vd;
+
+	/* READ frames are overwritten in place by the next read. */
+	if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) || vd->io == IO_METHOD_READ)
+		return;
+
+	/* Stopped, the buffer waits for capture_start; its slot must outlive
+	   this, so uninit refuses while n_leased is up. */
+	pthread_mutex_lock(&vd->lease_lock);
+	if (vd->streaming)
+		frameRecycle(vd, f->index);
+	pthread_mutex_unlock(&vd->lease_lock);
+	__atomic_sub_fetch(&vd->n_leased, 1, __ATOMIC_RELEASE);
+}
+
+/**
+	duplicate the dmabuf of a frame for another consumer, caller closes the fd
+*/
+int v4l2core_frame_export(const v4l2_frame_t* frame)
+{
+	return v4l2core_frame_export_plane(frame, 0);
+}
+
+/**
+	same for one plane of a multi-planar frame
+*/
+int v4l2core_frame_export_plane(const v4l2_frame_t* frame,unsigned int plane)
+{
+	if (plane >= frame->n_planes || frame->planes[plane].dmabuf_fd < 0) {
+		errno = EBADF;
+		return -1;
+	}
+	return fcntl(frame->planes[plane].dmabuf_fd, F_DUPFD_CLOEXEC, 0);
+}
+
+/**
+	create a dmabuf backed by a sealed memfd through /dev/udmabuf
+*/
+int v4l2core_dmabuf_alloc(unsigned int length)
+{
+	struct udmabuf_create create;
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t size = (length + page - 1) & ~(page - 1);
+	int memfd, devfd, fd;
+
+	memfd = memfd_create("v4l2helper", MFD_ALLOW_SEALING | MFD_CLOEXEC);
+	if (memfd < 0) {
+		log_errno("memfd_create");
+		return -1;
+	}
+	if (-1 == ftruncate(memfd, size) || -1 == fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK)) {
+		log_errno("memfd size");
+		close(memfd);
+		return -1;
+	}
+
+	devfd = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+	if (devfd < 0) {
+		log_errno("/dev/udmabuf");
+		close(memfd);
+		return -1;
+	}
+
+	CLEAR(create);
+	create.memfd = memfd;
+	create.flags = UDMABUF_FLAGS_CLOEXEC;
+	create.offset = 0;
+	create.size = size;
+
+	fd = xioctl(devfd, UDMABUF_CREATE, &create);
+	if (fd < 0)
+		log_errno("UDMABUF_CREATE");
+
+	close(devfd);
+	close(memfd);
+	return fd;
+}
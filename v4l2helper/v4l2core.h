@@ -1,9 +1,12 @@
 #ifndef V4L2CORE_H_INCLUDED
 #define V4L2CORE_H_INCLUDED
 
+#include <sys/types.h>
+#include <pthread.h>
 #include <linux/videodev2.h>
 #include "utlist.h"
 #include "stdint.h"
+#include "v4l2hist.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -11,26 +14,163 @@ extern "C" {
 
 #define CLEAR(x) memset (&(x), 0, sizeof (x))
 #define VIDIOC_REQBUFS_COUNT 2
+#define VIDIOC_REQBUFS_MAX   32
+#define V4L2CORE_SUBSCRIBERS 8
+#define V4L2CORE_MAX_PLANES  VIDEO_MAX_PLANES
 
 typedef void (*ProcessVBuff)(char* buff,int size);
 
+struct v4l2_dev_t;
+
+typedef struct v4l2_frame_plane_t {
+    void*        start;         //plane memory, payload begins data_offset bytes in
+    unsigned int bytesused;     //including data_offset
+    unsigned int data_offset;
+    unsigned int length;
+    uint32_t     bytesperline;
+    int          dmabuf_fd;     //-1 if not exported
+} v4l2_frame_plane_t;
+
+typedef struct v4l2_frame_t {
+    //plane 0, all a single-planar consumer needs
+    void*        start;
+    unsigned int bytesused;
+    unsigned int index;         //driver buffer index
+    int          dmabuf_fd;     //exported dmabuf of the buffer, -1 if not exported
+
+    //every plane, 1 for single-planar formats
+    unsigned int n_planes;
+    v4l2_frame_plane_t planes[V4L2CORE_MAX_PLANES];
+
+    //from the dequeued v4l2_buffer
+    struct timeval timestamp;   //clock given by flags & V4L2_BUF_FLAG_TIMESTAMP_MASK
+    uint32_t     sequence;
+    uint32_t     field;
+    uint32_t     flags;         //V4L2_BUF_FLAG_*
+
+    //format the buffer was captured in
+    uint32_t     pixelformat;
+    uint32_t     width;
+    uint32_t     height;
+    uint32_t     bytesperline;
+
+    struct v4l2_dev_t* vd;
+    int          refs;          //leases, the buffer goes back to the driver at zero
+} v4l2_frame_t;
+
+typedef void (*ProcessVFrame)(struct v4l2_dev_t* vd,const v4l2_frame_t* frame);
+typedef void (*ProcessVBatch)(struct v4l2_dev_t* vd,const v4l2_frame_t* const* frames,unsigned int count);
+
 typedef enum {
         IO_METHOD_READ,
         IO_METHOD_MMAP,
         IO_METHOD_USERPTR,
+        IO_METHOD_DMABUF,
 } io_method;
 
+typedef enum {
+        LEASE_POLICY_STALL,     //let the driver run dry until a lease is released
+        LEASE_POLICY_GROW,      //add buffers up to the ring max_count
+        LEASE_POLICY_CALLBACK,  //ask LeaseCallback, nonzero return grows the ring
+} lease_policy;
+
+typedef int (*LeaseExhausted)(struct v4l2_dev_t* vd);
+
 typedef enum {
         FMT_H264,
         FMT_YUV,
         FMT_MJPEG,
 } fmt_type;
 
-typedef struct buffer {
+typedef struct buffer_plane {
         void *                  start;
         unsigned int            length;
+        int                     dmabuf_fd;
+} buffer_plane;
+
+typedef struct buffer {
+        buffer_plane            planes[V4L2CORE_MAX_PLANES];
+        uint8_t                 parked;     //held back from the driver by the adaptive ring
+        uint8_t                 removed;    //freed with VIDIOC_REMOVE_BUFS, ringGrow creates it again
+        v4l2_frame_t            frame;
 } buffer;
 
+/*
+    Adaptive ring: buffers go back to the driver while callbacks run long
+    and are parked while they are quick.  Parked MMAP buffers are freed
+    with VIDIOC_REMOVE_BUFS where the kernel headers have it; built
+    without, shrinking only holds them back and frees no memory.
+*/
+typedef struct RingCtrl{
+    uint8_t      adaptive;      //grow/shrink the ring from measured callback latency
+    unsigned int min_count;
+    unsigned int max_count;
+    unsigned int capacity;      //slots allocated in buffers
+    unsigned int n_active;      //buffers cycling through the driver
+    uint64_t     cb_ns;         //callback latency, EWMA
+    unsigned int idle_frames;
+    unsigned int hold_frames;   //frames to wait before the next resize
+}RingCtrl;
+
+/*
+    Busy polling: capture_loop spins on non-blocking VIDIOC_DQBUF instead of
+    sleeping in select(), trading a whole core for the wakeup latency.
+*/
+typedef struct BusyPoll{
+    uint8_t      enabled;
+    int          cpu;           //pin the capture thread here, -1 leaves its affinity alone
+    int          priority;      //SCHED_FIFO priority while polling, 0 keeps the thread's policy
+    unsigned int spins;         //pause instructions between two DQBUF attempts
+    unsigned int backoff_us;    //idle polls back off to sleeps of up to this long, 0 never sleeps
+}BusyPoll;
+
+#define CAPTURE_NODE_ANY     -1     //leave placement to the scheduler
+#define CAPTURE_NODE_DEVICE  -2     //the node the device's bus hangs off, see v4l2core_dev_numa_node
+
+/*
+    Where the capture thread the library runs for a device goes.  The node
+    also decides where the USERPTR pool is allocated, so set this before
+    capture_init.
+*/
+typedef struct CaptureThread{
+    const char*  cpus;          //cpu list like "2,4-7", NULL uses every cpu of node
+    int          policy;        //SCHED_OTHER, SCHED_FIFO or SCHED_RR
+    int          priority;      //sched_priority, 0 for SCHED_OTHER
+    int          node;          //NUMA node, CAPTURE_NODE_ANY or CAPTURE_NODE_DEVICE
+}CaptureThread;
+
+typedef struct CaptureStats{
+    uint64_t frames;        //frames delivered
+    uint64_t dropped;       //frames missing from the sequence numbers
+    uint64_t errors;        //buffers flagged V4L2_BUF_FLAG_ERROR
+    uint64_t empty;         //buffers with bytesused == 0
+    uint64_t lease_stalls;  //wakeups that ended with every buffer leased
+    uint64_t thread_cpu_ns; //CPU time of the library capture thread, 0 without one
+    uint32_t last_sequence;
+    uint8_t  sequence_valid;
+}CaptureStats;
+
+typedef struct LatencyStats{
+    v4l2_hist_t capture_to_dequeue;     //kernel timestamp to VIDIOC_DQBUF return, monotonic timestamps only
+    v4l2_hist_t dequeue_to_callback;    //VIDIOC_DQBUF return to callback entry
+    v4l2_hist_t callback;               //time spent in the callbacks, per frame or per batch
+}LatencyStats;
+
+/*
+    Everything the capture code does to a device goes through one of these,
+    so it can run against a real node or a simulated one.
+*/
+typedef struct v4l2_backend_t{
+    const char* name;
+    int     (*ioctl)(struct v4l2_dev_t* vd,unsigned long request,void* arg);
+    void*   (*mmap)(struct v4l2_dev_t* vd,size_t length,int prot,int flags,off_t offset);
+    int     (*munmap)(struct v4l2_dev_t* vd,void* start,size_t length);
+    ssize_t (*read)(struct v4l2_dev_t* vd,void* buf,size_t count);
+    int     (*wait)(struct v4l2_dev_t* vd,int timeout_ms);    //select() semantics on vd->fd
+    void    (*close)(struct v4l2_dev_t* vd);
+    void*   (*payload)(struct v4l2_dev_t* vd,const struct v4l2_buffer* buf,unsigned int plane);  //optional, where a dequeued plane's bytes are if not in the buffer
+}v4l2_backend_t;
+
 typedef struct DeviceCap{
     uint8_t isSupportCapture;
     uint8_t isSupportStreaming;
@@ -54,6 +194,8 @@ typedef struct v4l2_dev_t{
     //device
     int fd;
     char *deviceName;
+    const v4l2_backend_t* backend;
+    void* backend_priv;
 
     //UVC
     struct v4l2_capability cap;
@@ -71,13 +213,46 @@ typedef struct v4l2_dev_t{
     unsigned int fps;
 
     //capture
+    uint32_t     buf_type;      //V4L2_BUF_TYPE_VIDEO_CAPTURE or V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE
+    unsigned int n_planes;      //memory planes of the active format
     io_method    io;
     buffer*      buffers;
+    struct v4l2_buffer* dqbufs;     //buffers dequeued in the current batch
+    struct v4l2_plane*  dqplanes;   //V4L2CORE_MAX_PLANES per entry of dqbufs
+    v4l2_frame_t**      batch;
     unsigned int n_buffers;
     unsigned int buffer_size;
+    unsigned int req_count;
+    RingCtrl     ring;
+    BusyPoll     busy;
+    uint8_t      export_dmabuf; //export MMAP buffers with VIDIOC_EXPBUF
+    int*         import_fds;    //caller owned dmabuf pool for IO_METHOD_DMABUF, n_planes fds per buffer
+    unsigned int n_import_fds;
+    struct v4l2_pool_t* userptr_pool;   //backs the IO_METHOD_USERPTR buffers, one slot per buffer
+    unsigned int pool_flags;    //pool_flags the USERPTR pool gets created with
+    struct v4l2_thread_t* thread;   //library owned capture thread, see v4l2core_capture_set_thread
 
     ProcessVBuff VBuffCallback;
+    ProcessVFrame VFrameCallback;
+    ProcessVBatch VBatchCallback;   //takes over from VFrameCallback when set
+    struct v4l2_ring_t* subs[V4L2CORE_SUBSCRIBERS];    //each gets a lease on every frame before the callbacks run
+    unsigned int n_subs;
+    pthread_mutex_t subs_lock;
     unsigned int bcapture;
+    uint8_t      streaming;
+    struct v4l2_ring_t* pull;   //frames waiting for v4l2core_frame_dequeue, created on first use
+    int          pullfd;        //epoll set over fd, the pull ring and wakefd
+    int          wakefd;        //eventfd behind v4l2core_frame_wakeup
+    uint32_t     read_sequence;     //frame counter for IO_METHOD_READ
+
+    //frame leases
+    lease_policy   leasePolicy;
+    LeaseExhausted LeaseCallback;
+    int          n_leased;
+    pthread_mutex_t lease_lock; //orders a last release against capture_start/stop
+
+    CaptureStats stats;     //written by the capture thread only, read with v4l2core_get_stats
+    LatencyStats latency;   //same, read with v4l2core_get_latency
 
     FrameDesc*  p_frameDesc;
     DeviceCap   deviceCap;
@@ -86,26 +261,72 @@ typedef struct v4l2_dev_t{
 
 int xioctl(int fd, int request, void* argp);
 
+int v4l2core_ioctl(v4l2_dev_t* vd,unsigned long request,void* arg);
+
 v4l2_dev_t* v4l2core_dev_open(const char* name);
 
+v4l2_dev_t* v4l2core_dev_open_backend(const char* name,const v4l2_backend_t* backend,void* priv);
+
 void v4l2core_dev_close(v4l2_dev_t *vd);
 
+int v4l2core_dev_numa_node(v4l2_dev_t* vd);
+
 int v4l2core_dev_init(v4l2_dev_t* vd);
 
 int v4l2core_dev_set_fmt(v4l2_dev_t* vd,uint32_t pixfmt,uint32_t width,uint32_t height);
 
 int v4l2core_dev_set_fps(v4l2_dev_t* vd,uint32_t numerator,uint32_t denominator);
 
+int v4l2core_capture_set_ring(v4l2_dev_t* vd,unsigned int count,unsigned int max_count);
+
+int v4l2core_capture_set_dmabuf_pool(v4l2_dev_t* vd,const int* fds,unsigned int count);
+
+int v4l2core_capture_set_userptr_pool(v4l2_dev_t* vd,unsigned int flags);
+
+int v4l2core_capture_set_busy_poll(v4l2_dev_t* vd,const BusyPoll* poll);
+
+int v4l2core_capture_set_thread(v4l2_dev_t* vd,const CaptureThread* ct);
+
+int v4l2core_subscribe(v4l2_dev_t* vd,struct v4l2_ring_t* ring);
+
+int v4l2core_unsubscribe(v4l2_dev_t* vd,struct v4l2_ring_t* ring);
+
 int v4l2core_capture_init(v4l2_dev_t *vd);
 
-void v4l2core_capture_uninit(v4l2_dev_t *vd);
+int v4l2core_capture_uninit(v4l2_dev_t *vd);
 
 int v4l2core_capture_start(v4l2_dev_t* vd);
 
 void v4l2core_capture_loop(v4l2_dev_t* vd);
 
+int v4l2core_capture_thread_start(v4l2_dev_t* vd);
+
+void v4l2core_capture_thread_stop(v4l2_dev_t* vd);
+
+int v4l2core_frame_read(v4l2_dev_t* vd);
+
+const v4l2_frame_t* v4l2core_frame_dequeue(v4l2_dev_t* vd,int timeout_ms);
+
+int v4l2core_frame_pull_fd(v4l2_dev_t* vd);
+
+void v4l2core_frame_wakeup(v4l2_dev_t* vd);
+
 void v4l2core_capture_stop(v4l2_dev_t* vd);
 
+void v4l2core_get_stats(v4l2_dev_t* vd,CaptureStats* stats);
+
+void v4l2core_get_latency(v4l2_dev_t* vd,LatencyStats* latency);
+
+void v4l2core_frame_retain(const v4l2_frame_t* frame);
+
+void v4l2core_frame_release(const v4l2_frame_t* frame);
+
+int v4l2core_frame_export(const v4l2_frame_t* frame);
+
+int v4l2core_frame_export_plane(const v4l2_frame_t* frame,unsigned int plane);
+
+int v4l2core_dmabuf_alloc(unsigned int size);
+
 #ifdef __cplusplus
 }
 #endif
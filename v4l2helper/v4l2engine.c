@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "v4l2engine.h"
+#include "v4l2log.h"
+
+#define ENGINE_EVENTS 16
+
+typedef struct EngineDev{
+    struct EngineDev *prev, *next;
+    v4l2_dev_t*      vd;
+    pthread_mutex_t  lock;      //held while a worker services the device
+    uint8_t          removed;
+}EngineDev;
+
+struct v4l2_engine_t{
+    int             epfd;
+    int             stopfd;     //eventfd, readable once stop is requested
+    unsigned int    n_threads;
+    pthread_t*      threads;
+    unsigned int    n_started;
+    pthread_mutex_t lock;       //protects devs
+    EngineDev*      devs;
+};
+
+static int engineArm(v4l2_engine_t* engine, EngineDev* dev, int op)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	/* One-shot so a device is only ever serviced by one worker at a time. */
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.ptr = dev;
+	return epoll_ctl(engine->epfd, op, dev->vd->fd, &ev);
+}
+
+static void engineService(v4l2_engine_t* engine, EngineDev* dev, uint32_t events)
+{
+	pthread_mutex_lock(&dev->lock);
+	if (dev->removed) {
+		pthread_mutex_unlock(&dev->lock);
+		return;
+	}
+
+	if (events & (EPOLLERR | EPOLLHUP)) {
+		log_error("%s: device error, dropped from engine", dev->vd->deviceName);
+		dev->removed = 1;
+	} else if (v4l2core_frame_read(dev->vd) < 0) {
+		log_error("%s: capture error, dropped from engine", dev->vd->deviceName);
+		dev->removed = 1;
+	} else if (-1 == engineArm(engine, dev, EPOLL_CTL_MOD)) {
+		log_errno("EPOLL_CTL_MOD");
+		dev->removed = 1;
+	}
+
+	if (dev->removed)
+		epoll_ctl(engine->epfd, EPOLL_CTL_DEL, dev->vd->fd, NULL);
+	pthread_mutex_unlock(&dev->lock);
+}
+
+static void* engineWorker(void* arg)
+{
+	v4l2_engine_t* engine = arg;
+	struct epoll_event ev[ENGINE_EVENTS];
+	int i, n;
+
+	for (;;) {
+		n = epoll_wait(engine->epfd, ev, ENGINE_EVENTS, -1);
+		if (n < 0) {
+			if (EINTR == errno)
+				continue;
+			log_errno("epoll_wait");
+			break;
+		}
+		for (i = 0; i < n; ++i) {
+			/* The stop eventfd is level-triggered, every worker sees it. */
+			if (NULL == ev[i].data.ptr)
+				return NULL;
+			engineService(engine, ev[i].data.ptr, ev[i].events);
+		}
+	}
+	return NULL;
+}
+
+v4l2_engine_t* v4l2engine_create(unsigned int n_threads)
+{
+	struct epoll_event ev;
+	v4l2_engine_t* engine = calloc(1, sizeof(v4l2_engine_t));
+
+	if (!engine) {
+		log_error("Out of memory");
+		return NULL;
+	}
+
+	engine->n_threads = n_threads ? n_threads : V4L2ENGINE_THREADS;
+	engine->threads = calloc(engine->n_threads, sizeof(pthread_t));
+	engine->epfd = epoll_create1(EPOLL_CLOEXEC);
+	engine->stopfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	pthread_mutex_init(&engine->lock, NULL);
+
+	if (!engine->threads || engine->epfd < 0 || engine->stopfd < 0) {
+		log_errno("v4l2engine_create");
+		v4l2engine_destroy(engine);
+		return NULL;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (-1 == epoll_ctl(engine->epfd, EPOLL_CTL_ADD, engine->stopfd, &ev)) {
+		log_errno("EPOLL_CTL_ADD");
+		v4l2engine_destroy(engine);
+		return NULL;
+	}
+	return engine;
+}
+
+void v4l2engine_destroy(v4l2_engine_t* engine)
+{
+	EngineDev *dev, *tmp;
+
+	assert(engine != NULL);
+	v4l2engine_stop(engine);
+
+	DL_FOREACH_SAFE(engine->devs, dev, tmp) {
+		DL_DELETE(engine->devs, dev);
+		pthread_mutex_destroy(&dev->lock);
+		free(dev);
+	}
+
+	if (engine->epfd >= 0)
+		close(engine->epfd);
+	if (engine->stopfd >= 0)
+		close(engine->stopfd);
+	pthread_mutex_destroy(&engine->lock);
+	free(engine->threads);
+	free(engine);
+}
+
+int v4l2engine_add(v4l2_engine_t* engine, v4l2_dev_t* vd)
+{
+	EngineDev* dev = calloc(1, sizeof(EngineDev));
+
+	if (!dev) {
+		log_error("Out of memory");
+		return -1;
+	}
+	dev->vd = vd;
+	pthread_mutex_init(&dev->lock, NULL);
+
+	pthread_mutex_lock(&engine->lock);
+	DL_APPEND(engine->devs, dev);
+	pthread_mutex_unlock(&engine->lock);
+
+	if (-1 == engineArm(engine, dev, EPOLL_CTL_ADD)) {
+		log_errno("EPOLL_CTL_ADD");
+		dev->removed = 1;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+	stop servicing a device, no worker touches it once this returns
+*/
+int v4l2engine_remove(v4l2_engine_t* engine, v4l2_dev_t* vd)
+{
+	EngineDev* dev;
+	int found = -1;
+
+	pthread_mutex_lock(&engine->lock);
+	DL_FOREACH(engine->devs, dev) {
+		if (dev->vd != vd || dev->removed)
+			continue;
+		/* Stale events may still carry dev, so it lives until destroy. */
+		pthread_mutex_lock(&dev->lock);
+		epoll_ctl(engine->epfd, EPOLL_CTL_DEL, vd->fd, NULL);
+		dev->removed = 1;
+		pthread_mutex_unlock(&dev->lock);
+		found = 0;
+	}
+	pthread_mutex_unlock(&engine->lock);
+	return found;
+}
+
+int v4l2engine_start(v4l2_engine_t* engine)
+{
+	unsigned int i;
+	uint64_t count;
+
+	if (engine->n_started)
+		return 0;
+
+	/* Drain a stop left over from a previous run. */
+	while (read(engine->stopfd, &count, sizeof(count)) > 0)
+		;
+
+	for (i = 0; i < engine->n_threads; ++i) {
+		if (pthread_create(&engine->threads[i], NULL, engineWorker, engine)) {
+			log_error("create engine thread error!");
+			v4l2engine_stop(engine);
+			return -1;
+		}
+		engine->n_started++;
+	}
+	return 0;
+}
+
+/**
+	wake every worker through the eventfd and wait for them to exit
+*/
+void v4l2engine_stop(v4l2_engine_t* engine)
+{
+	uint64_t one = 1;
+	unsigned int i;
+
+	if (!engine->n_started)
+		return;
+
+	if (write(engine->stopfd, &one, sizeof(one)) != sizeof(one))
+		log_errno("eventfd write");
+
+	for (i = 0; i < engine->n_started; ++i)
+		pthread_join(engine->threads[i], NULL);
+	engine->n_started = 0;
+}
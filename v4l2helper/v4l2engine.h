@@ -0,0 +1,33 @@
+#ifndef V4L2ENGINE_H_INCLUDED
+#define V4L2ENGINE_H_INCLUDED
+#include "v4l2core.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define V4L2ENGINE_THREADS 2
+
+/*
+    One epoll set and a small thread pool servicing many capture devices.
+    Devices must be initialised and started before they are added.
+*/
+typedef struct v4l2_engine_t v4l2_engine_t;
+
+v4l2_engine_t* v4l2engine_create(unsigned int n_threads);
+
+void v4l2engine_destroy(v4l2_engine_t* engine);
+
+int v4l2engine_add(v4l2_engine_t* engine, v4l2_dev_t* vd);
+
+int v4l2engine_remove(v4l2_engine_t* engine, v4l2_dev_t* vd);
+
+int v4l2engine_start(v4l2_engine_t* engine);
+
+void v4l2engine_stop(v4l2_engine_t* engine);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // V4L2ENGINE_H_INCLUDED
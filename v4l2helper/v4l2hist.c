@@ -0,0 +1,94 @@
+#include <string.h>
+#include "v4l2hist.h"
+
+static unsigned int histBucket(uint64_t value)
+{
+	unsigned int msb;
+
+	if (value < V4L2HIST_SUB)
+		return value;
+
+	msb = 63 - __builtin_clzll(value);
+	return ((msb - V4L2HIST_SUB_BITS + 1) << V4L2HIST_SUB_BITS)
+		+ ((value >> (msb - V4L2HIST_SUB_BITS)) & (V4L2HIST_SUB - 1));
+}
+
+/**
+	highest value that lands in a bucket
+*/
+static uint64_t histBucketTop(unsigned int bucket)
+{
+	unsigned int shift;
+	uint64_t base;
+
+	if (bucket < V4L2HIST_SUB)
+		return bucket;
+
+	shift = (bucket >> V4L2HIST_SUB_BITS) - 1;
+	base = (uint64_t)(V4L2HIST_SUB + (bucket & (V4L2HIST_SUB - 1))) << shift;
+	return base + ((1ull << shift) - 1);
+}
+
+/**
+	add a value, only one thread may record into a histogram
+*/
+void v4l2hist_record(v4l2_hist_t* hist, uint64_t value)
+{
+	uint64_t* bucket = &hist->buckets[histBucket(value)];
+
+	__atomic_store_n(bucket, *bucket + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&hist->sum, hist->sum + value, __ATOMIC_RELAXED);
+	if (value > hist->max)
+		__atomic_store_n(&hist->max, value, __ATOMIC_RELAXED);
+	__atomic_store_n(&hist->count, hist->count + 1, __ATOMIC_RELEASE);
+}
+
+/**
+	copy a histogram that may be recorded into concurrently
+*/
+void v4l2hist_snapshot(const v4l2_hist_t* hist, v4l2_hist_t* snap)
+{
+	unsigned int i;
+	uint64_t count = 0;
+
+	snap->sum = __atomic_load_n(&hist->sum, __ATOMIC_RELAXED);
+	snap->max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+	for (i = 0; i < V4L2HIST_BUCKETS; ++i) {
+		snap->buckets[i] = __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+		count += snap->buckets[i];
+	}
+	/* Keep the snapshot self consistent rather than trusting count. */
+	snap->count = count;
+}
+
+/**
+	value below which the given percentile (0..100) of samples fall
+*/
+uint64_t v4l2hist_percentile(const v4l2_hist_t* hist, double percentile)
+{
+	uint64_t rank, seen = 0;
+	unsigned int i;
+
+	if (!hist->count)
+		return 0;
+
+	rank = (uint64_t)(percentile / 100.0 * hist->count + 0.5);
+	if (rank < 1)
+		rank = 1;
+	if (rank > hist->count)
+		rank = hist->count;
+
+	for (i = 0; i < V4L2HIST_BUCKETS; ++i) {
+		seen += hist->buckets[i];
+		if (seen >= rank) {
+			uint64_t top = histBucketTop(i);
+			return top < hist->max ? top : hist->max;
+		}
+	}
+	return hist->max;
+}
+
+uint64_t v4l2hist_mean(const v4l2_hist_t* hist)
+{
+	return hist->count ? hist->sum / hist->count : 0;
+}
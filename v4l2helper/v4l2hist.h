@@ -0,0 +1,37 @@
+#ifndef V4L2HIST_H_INCLUDED
+#define V4L2HIST_H_INCLUDED
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+    Log-linear histogram of nanosecond values: every power of two is split
+    into 2^V4L2HIST_SUB_BITS buckets, so a bucket is within ~6% of its value.
+    One thread records, any thread may take a snapshot without locking.
+*/
+#define V4L2HIST_SUB_BITS 4
+#define V4L2HIST_SUB      (1 << V4L2HIST_SUB_BITS)
+#define V4L2HIST_BUCKETS  ((64 - V4L2HIST_SUB_BITS + 1) * V4L2HIST_SUB)
+
+typedef struct v4l2_hist_t{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[V4L2HIST_BUCKETS];
+}v4l2_hist_t;
+
+void v4l2hist_record(v4l2_hist_t* hist, uint64_t value);
+
+void v4l2hist_snapshot(const v4l2_hist_t* hist, v4l2_hist_t* snap);
+
+uint64_t v4l2hist_percentile(const v4l2_hist_t* hist, double percentile);
+
+uint64_t v4l2hist_mean(const v4l2_hist_t* hist);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // V4L2HIST_H_INCLUDED
@@ -0,0 +1,483 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "v4l2idx.h"
+#include "v4l2ring.h"
+#include "v4l2log.h"
+
+#define IDX_VERSION     1
+#define IDX_BATCH       64      //entries the writer collects before one pwrite
+#define IDX_PATH_MAX    4096
+
+_Static_assert(sizeof(v4l2_idx_header_t) == 64, "index header layout");
+_Static_assert(sizeof(v4l2_idx_entry_t) == 32, "index entry layout");
+
+struct v4l2_idx_writer_t{
+    v4l2_dev_t*  vd;
+    v4l2_ring_t* ring;
+    pthread_t    writer;
+    int          data_fd;
+    int          idx_fd;
+    uint64_t     data_offset;
+    v4l2_idx_header_t* header;  //shared mapping of the index header, count is published through it
+    v4l2_idx_entry_t batch[IDX_BATCH];
+    unsigned int n_batch;
+    uint64_t     frames, bytes, errors;
+};
+
+struct v4l2_idx_t{
+    int          data_fd;
+    int          idx_fd;
+    const uint8_t* data;
+    size_t       data_len;
+    const uint8_t* map;         //the whole index file
+    size_t       map_len;
+    const v4l2_idx_header_t* header;
+    size_t       count;         //entries known complete
+};
+
+static char* idxPath(const char* path)
+{
+	char* s = malloc(strlen(path) + 5);
+
+	if (s)
+		sprintf(s, "%s.idx", path);
+	return s;
+}
+
+/**
+	pwrite all of it or fail
+*/
+static int idxPwrite(int fd, const void* buf, size_t n, uint64_t at)
+{
+	const uint8_t* p = buf;
+	ssize_t r;
+
+	while (n) {
+		r = pwrite(fd, p, n, at);
+		if (r < 0) {
+			if (EINTR == errno)
+				continue;
+			log_errno("index pwrite");
+			return -1;
+		}
+		p += r;
+		n -= r;
+		at += r;
+	}
+	return 0;
+}
+
+/**
+	append the collected entries, then publish them; a reader that sees
+	the new count finds the entries and their payloads already in place
+*/
+static int batchFlush(v4l2_idx_writer_t* w)
+{
+	uint64_t count = w->header->count;
+
+	if (!w->n_batch)
+		return 0;
+	if (idxPwrite(w->idx_fd, w->batch, w->n_batch * sizeof(v4l2_idx_entry_t),
+		sizeof(v4l2_idx_header_t) + count * sizeof(v4l2_idx_entry_t)) < 0)
+		return -1;
+	__atomic_store_n(&w->header->count, count + w->n_batch, __ATOMIC_RELEASE);
+	w->n_batch = 0;
+	return 0;
+}
+
+static int entryWrite(v4l2_idx_writer_t* w, const v4l2_frame_t* frame)
+{
+	struct iovec iov[V4L2CORE_MAX_PLANES], *v = iov;
+	v4l2_idx_entry_t* e = &w->batch[w->n_batch];
+	const v4l2_frame_plane_t* pl;
+	uint64_t at = w->data_offset;
+	size_t size = 0, done = 0;
+	unsigned int p;
+	int n = 0;
+	ssize_t r;
+
+	for (p = 0; p < frame->n_planes; ++p) {
+		pl = &frame->planes[p];
+		if (pl->bytesused <= pl->data_offset)
+			continue;
+		iov[n].iov_base = (uint8_t*)pl->start + pl->data_offset;
+		iov[n].iov_len = pl->bytesused - pl->data_offset;
+		size += iov[n++].iov_len;
+	}
+
+	/* Straight from the capture buffer, no staging copy. */
+	while (done < size) {
+		r = pwritev(w->data_fd, v, n, at + done);
+		if (r < 0) {
+			if (EINTR == errno)
+				continue;
+			log_errno("payload pwritev");
+			return -1;
+		}
+		done += r;
+		while (n && (size_t)r >= v->iov_len) {
+			r -= v->iov_len;
+			++v;
+			--n;
+		}
+		if (n) {
+			v->iov_base = (uint8_t*)v->iov_base + r;
+			v->iov_len -= r;
+		}
+	}
+	w->data_offset += size;
+
+	e->offset = at;
+	e->timestamp_ns = (uint64_t)frame->timestamp.tv_sec * 1000000000ull + frame->timestamp.tv_usec * 1000ull;
+	e->size = size;
+	e->sequence = frame->sequence;
+	e->pixelformat = frame->pixelformat;
+	e->flags = (frame->flags & (V4L2_BUF_FLAG_PFRAME | V4L2_BUF_FLAG_BFRAME)) ? 0 : V4L2IDX_KEYFRAME;
+	__atomic_add_fetch(&w->bytes, size, __ATOMIC_RELAXED);
+	if (++w->n_batch == IDX_BATCH)
+		return batchFlush(w);
+	return 0;
+}
+
+static void* idxWriter(void* arg)
+{
+	v4l2_idx_writer_t* w = arg;
+	const v4l2_frame_t* frame;
+
+	for (;;) {
+		/* Publish what we have whenever the ring runs dry, so tailing readers keep up. */
+		frame = v4l2ring_pop(w->ring, 0);
+		if (!frame) {
+			if (batchFlush(w) < 0)
+				__atomic_add_fetch(&w->errors, 1, __ATOMIC_RELAXED);
+			frame = v4l2ring_pop(w->ring, -1);
+			if (!frame)
+				break;
+		}
+		if (!w->header->pixelformat) {
+			w->header->pixelformat = frame->pixelformat;
+			w->header->width = frame->width;
+			w->header->height = frame->height;
+			w->header->bytesperline = frame->bytesperline;
+			w->header->clock = frame->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK;
+		}
+		if (entryWrite(w, frame) < 0)
+			__atomic_add_fetch(&w->errors, 1, __ATOMIC_RELAXED);
+		else
+			__atomic_add_fetch(&w->frames, 1, __ATOMIC_RELAXED);
+		v4l2core_frame_release(frame);
+	}
+	if (batchFlush(w) < 0)
+		__atomic_add_fetch(&w->errors, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+/**
+	start writing vd's frames to path and path.idx, call it once streaming i/o is set up
+*/
+v4l2_idx_writer_t* v4l2idx_create(v4l2_dev_t* vd, const char* path, unsigned int depth)
+{
+	v4l2_idx_header_t header;
+	v4l2_idx_writer_t* w;
+	char* ipath;
+
+	w = calloc(1, sizeof(v4l2_idx_writer_t));
+	ipath = idxPath(path);
+	if (!w || !ipath) {
+		log_error("Out of memory");
+		goto fail_alloc;
+	}
+	w->vd = vd;
+	w->idx_fd = -1;
+	w->header = MAP_FAILED;
+
+	w->data_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (-1 == w->data_fd) {
+		log_error("Cannot open '%s': %d, %s", path, errno, strerror(errno));
+		goto fail_alloc;
+	}
+	/* The index is read back through a shared mapping, so it needs O_RDWR. */
+	w->idx_fd = open(ipath, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (-1 == w->idx_fd) {
+		log_error("Cannot open '%s': %d, %s", ipath, errno, strerror(errno));
+		goto fail;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, V4L2IDX_MAGIC, sizeof(header.magic));
+	header.version = IDX_VERSION;
+	header.header_size = sizeof(v4l2_idx_header_t);
+	header.entry_size = sizeof(v4l2_idx_entry_t);
+	if (idxPwrite(w->idx_fd, &header, sizeof(header), 0) < 0)
+		goto fail;
+	w->header = mmap(NULL, sizeof(header), PROT_READ | PROT_WRITE, MAP_SHARED, w->idx_fd, 0);
+	if (MAP_FAILED == w->header) {
+		log_errno("mmap");
+		goto fail;
+	}
+
+	w->ring = v4l2ring_create(depth, RING_MODE_SPSC, RING_OVERFLOW_DROP_NEWEST, RING_WAIT_FUTEX);
+	if (!w->ring)
+		goto fail;
+	if (pthread_create(&w->writer, NULL, idxWriter, w)) {
+		log_error("%s: can't create the index writer thread", vd->deviceName);
+		goto fail;
+	}
+	if (v4l2core_subscribe(vd, w->ring) < 0) {
+		v4l2ring_close(w->ring);
+		pthread_join(w->writer, NULL);
+		goto fail;
+	}
+	free(ipath);
+	return w;
+
+fail:
+	if (w->ring)
+		v4l2ring_destroy(w->ring);
+	if (MAP_FAILED != w->header)
+		munmap(w->header, sizeof(v4l2_idx_header_t));
+	if (w->idx_fd >= 0)
+		close(w->idx_fd);
+	close(w->data_fd);
+	unlink(path);
+	unlink(ipath);
+fail_alloc:
+	free(ipath);
+	free(w);
+	return NULL;
+}
+
+/**
+	stop writing, flush the last entries and close; call before capture_uninit
+*/
+int v4l2idx_finish(v4l2_idx_writer_t* w)
+{
+	int r = 0;
+
+	if (!w)
+		return 0;
+	v4l2core_unsubscribe(w->vd, w->ring);
+	v4l2ring_close(w->ring);
+	pthread_join(w->writer, NULL);
+	v4l2ring_destroy(w->ring);
+
+	log_info("%s: indexed %" PRIu64 " frames, %" PRIu64 " bytes", w->vd->deviceName, w->frames, w->bytes);
+	if (w->errors)
+		r = -1;
+	munmap(w->header, sizeof(v4l2_idx_header_t));
+	if (-1 == close(w->idx_fd) || -1 == close(w->data_fd)) {
+		log_errno("close");
+		r = -1;
+	}
+	free(w);
+	return r;
+}
+
+void v4l2idx_stats(v4l2_idx_writer_t* w, IdxStats* stats)
+{
+	FrameRingStats rs;
+
+	v4l2ring_stats(w->ring, &rs);
+	stats->frames = __atomic_load_n(&w->frames, __ATOMIC_RELAXED);
+	stats->bytes = __atomic_load_n(&w->bytes, __ATOMIC_RELAXED);
+	stats->dropped = rs.dropped;
+	stats->errors = __atomic_load_n(&w->errors, __ATOMIC_RELAXED);
+}
+
+/**
+	map len bytes of fd read-only, replacing an older mapping of it
+*/
+static const uint8_t* remap(int fd, const uint8_t* old, size_t old_len, size_t len)
+{
+	void* p;
+
+	if (old)
+		munmap((void*)old, old_len);
+	if (!len)
+		return NULL;
+	p = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+	if (MAP_FAILED == p) {
+		log_errno("mmap");
+		return NULL;
+	}
+	return p;
+}
+
+/**
+	pick up entries written since the last look, returns the entry count;
+	pointers from entry and payload are stale once this maps anew
+*/
+size_t v4l2idx_refresh(v4l2_idx_t* idx)
+{
+	struct stat ist, dst;
+	uint64_t count;
+	size_t whole;
+
+	if (-1 == fstat(idx->idx_fd, &ist) || -1 == fstat(idx->data_fd, &dst)) {
+		log_errno("fstat");
+		return idx->count;
+	}
+	if ((size_t)ist.st_size > idx->map_len) {
+		idx->map = remap(idx->idx_fd, idx->map, idx->map_len, ist.st_size);
+		idx->map_len = idx->map ? (size_t)ist.st_size : 0;
+		idx->header = (const v4l2_idx_header_t*)idx->map;
+	}
+	if ((size_t)dst.st_size > idx->data_len) {
+		idx->data = remap(idx->data_fd, idx->data, idx->data_len, dst.st_size);
+		idx->data_len = idx->data ? (size_t)dst.st_size : 0;
+	}
+	if (!idx->header) {
+		idx->count = 0;
+		return 0;
+	}
+
+	/* Only entries that are both published and inside the mappings. */
+	count = __atomic_load_n(&idx->header->count, __ATOMIC_ACQUIRE);
+	whole = (idx->map_len - idx->header->header_size) / idx->header->entry_size;
+	if (count > whole)
+		count = whole;
+	while (count && v4l2idx_entry(idx, count - 1)->offset + v4l2idx_entry(idx, count - 1)->size > idx->data_len)
+		--count;
+	idx->count = count;
+	return count;
+}
+
+/**
+	map an indexed capture for reading, it may still be being written
+*/
+v4l2_idx_t* v4l2idx_open(const char* path)
+{
+	v4l2_idx_header_t header;
+	v4l2_idx_t* idx;
+	char* ipath = idxPath(path);
+
+	idx = calloc(1, sizeof(v4l2_idx_t));
+	if (!idx || !ipath) {
+		log_error("Out of memory");
+		free(ipath);
+		free(idx);
+		return NULL;
+	}
+	idx->idx_fd = open(ipath, O_RDONLY | O_CLOEXEC);
+	idx->data_fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (-1 == idx->idx_fd || -1 == idx->data_fd) {
+		log_error("Cannot open '%s': %d, %s", path, errno, strerror(errno));
+		goto fail;
+	}
+	if (pread(idx->idx_fd, &header, sizeof(header), 0) != sizeof(header)
+	 || memcmp(header.magic, V4L2IDX_MAGIC, sizeof(header.magic))
+	 || header.entry_size < sizeof(v4l2_idx_entry_t) || header.header_size < sizeof(v4l2_idx_header_t)) {
+		log_error("%s is no capture index", ipath);
+		goto fail;
+	}
+	free(ipath);
+	v4l2idx_refresh(idx);
+	if (!idx->header) {
+		v4l2idx_close(idx);
+		return NULL;
+	}
+	return idx;
+
+fail:
+	if (idx->idx_fd >= 0)
+		close(idx->idx_fd);
+	if (idx->data_fd >= 0)
+		close(idx->data_fd);
+	free(ipath);
+	free(idx);
+	return NULL;
+}
+
+void v4l2idx_close(v4l2_idx_t* idx)
+{
+	if (!idx)
+		return;
+	if (idx->map)
+		munmap((void*)idx->map, idx->map_len);
+	if (idx->data)
+		munmap((void*)idx->data, idx->data_len);
+	close(idx->idx_fd);
+	close(idx->data_fd);
+	free(idx);
+}
+
+size_t v4l2idx_count(const v4l2_idx_t* idx)
+{
+	return idx->count;
+}
+
+const v4l2_idx_header_t* v4l2idx_header(const v4l2_idx_t* idx)
+{
+	return idx->header;
+}
+
+const v4l2_idx_entry_t* v4l2idx_entry(const v4l2_idx_t* idx, size_t i)
+{
+	return (const v4l2_idx_entry_t*)(idx->map + idx->header->header_size + i * idx->header->entry_size);
+}
+
+const void* v4l2idx_payload(const v4l2_idx_t* idx, const v4l2_idx_entry_t* entry)
+{
+	return idx->data + entry->offset;
+}
+
+/**
+	first entry with a sequence of at least sequence, -1 past the end;
+	sequences must not wrap within one file
+*/
+long v4l2idx_find_sequence(const v4l2_idx_t* idx, uint32_t sequence)
+{
+	size_t lo = 0, hi = idx->count, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (v4l2idx_entry(idx, mid)->sequence < sequence)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < idx->count ? (long)lo : -1;
+}
+
+/**
+	first entry stamped at or after timestamp_ns, -1 past the end
+*/
+long v4l2idx_find_time(const v4l2_idx_t* idx, uint64_t timestamp_ns)
+{
+	size_t lo = 0, hi = idx->count, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (v4l2idx_entry(idx, mid)->timestamp_ns < timestamp_ns)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < idx->count ? (long)lo : -1;
+}
+
+/**
+	the keyframe decoding entry i has to start from, -1 if there is none before it
+*/
+long v4l2idx_find_keyframe(const v4l2_idx_t* idx, size_t i)
+{
+	long k;
+
+	if (i >= idx->count)
+		return -1;
+	for (k = i; k >= 0; --k)
+		if (v4l2idx_entry(idx, k)->flags & V4L2IDX_KEYFRAME)
+			return k;
+	return -1;
+}
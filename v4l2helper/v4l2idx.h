@@ -0,0 +1,83 @@
+#ifndef V4L2IDX_H_INCLUDED
+#define V4L2IDX_H_INCLUDED
+#include "v4l2core.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+    Indexed capture files: frame payloads back to back in path, and a
+    fixed-width entry per frame in path.idx.  Both are plain files meant
+    to be mmapped; entries are sorted by sequence and timestamp, so a seek
+    is a binary search with nothing to parse.  The writer appends the
+    payload before the entry and publishes the entry by bumping count in
+    the index header, so readers can follow a file still being written.
+*/
+#define V4L2IDX_MAGIC       "V4L2IDX1"
+#define V4L2IDX_KEYFRAME    (1u << 0)
+
+typedef struct v4l2_idx_header_t{
+    char         magic[8];
+    uint32_t     version;
+    uint32_t     header_size;   //entries start here
+    uint32_t     entry_size;
+    uint32_t     pixelformat;
+    uint32_t     width;
+    uint32_t     height;
+    uint32_t     bytesperline;
+    uint32_t     clock;         //V4L2_BUF_FLAG_TIMESTAMP_* of the timestamps
+    uint64_t     count;         //entries written, updated last
+    uint8_t      reserved[16];
+}v4l2_idx_header_t;
+
+typedef struct v4l2_idx_entry_t{
+    uint64_t     offset;        //of the payload in the data file
+    uint64_t     timestamp_ns;  //v4l2_buffer timestamp
+    uint32_t     size;          //payload bytes, every plane back to back
+    uint32_t     sequence;      //v4l2_buffer sequence
+    uint32_t     pixelformat;
+    uint32_t     flags;         //V4L2IDX_KEYFRAME
+}v4l2_idx_entry_t;
+
+typedef struct IdxStats{
+    uint64_t     frames;
+    uint64_t     bytes;
+    uint64_t     dropped;       //frames the writer fell too far behind for
+    uint64_t     errors;
+}IdxStats;
+
+typedef struct v4l2_idx_writer_t v4l2_idx_writer_t;
+typedef struct v4l2_idx_t v4l2_idx_t;
+
+v4l2_idx_writer_t* v4l2idx_create(v4l2_dev_t* vd, const char* path, unsigned int depth);
+
+int v4l2idx_finish(v4l2_idx_writer_t* w);
+
+void v4l2idx_stats(v4l2_idx_writer_t* w, IdxStats* stats);
+
+v4l2_idx_t* v4l2idx_open(const char* path);
+
+void v4l2idx_close(v4l2_idx_t* idx);
+
+size_t v4l2idx_refresh(v4l2_idx_t* idx);
+
+size_t v4l2idx_count(const v4l2_idx_t* idx);
+
+const v4l2_idx_header_t* v4l2idx_header(const v4l2_idx_t* idx);
+
+const v4l2_idx_entry_t* v4l2idx_entry(const v4l2_idx_t* idx, size_t i);
+
+const void* v4l2idx_payload(const v4l2_idx_t* idx, const v4l2_idx_entry_t* entry);
+
+long v4l2idx_find_sequence(const v4l2_idx_t* idx, uint32_t sequence);
+
+long v4l2idx_find_time(const v4l2_idx_t* idx, uint64_t timestamp_ns);
+
+long v4l2idx_find_keyframe(const v4l2_idx_t* idx, size_t i);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // V4L2IDX_H_INCLUDED
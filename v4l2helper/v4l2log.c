@@ -0,0 +1,262 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "utlist.h"
+#include "v4l2log.h"
+
+#define LOG_RING_SLOTS  256         //per thread, power of two
+#define LOG_LINE        240
+#define LOG_OUT         8192        //drain write batch
+#define LOG_POLL_NS     5000000
+
+typedef struct LogRecord{
+    uint64_t    ns;
+    uint8_t     level;
+    uint16_t    len;
+    char        text[LOG_LINE];
+}LogRecord;
+
+typedef struct LogRing{
+    struct LogRing *prev, *next;
+    uint64_t    head __attribute__((aligned(64)));  //owner thread writes
+    uint64_t    tail __attribute__((aligned(64)));  //drain thread writes
+    uint8_t     dead;                               //owner thread exited
+    LogRecord   slots[LOG_RING_SLOTS];
+}LogRing;
+
+int v4l2log_threshold = LOG_LEVEL_INFO;
+
+static int logFd = STDERR_FILENO;
+static uint64_t logDropped;
+static int logRunning;
+static pthread_t logThread;
+
+static LogRing* logRings;
+static pthread_mutex_t logLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t logOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t logKey;
+static __thread LogRing* logThreadRing;
+
+static const char logLevelChar[] = { 'E', 'W', 'I', 'D' };
+
+static uint64_t logNow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void logRingExit(void* arg)
+{
+	LogRing* ring = arg;
+
+	__atomic_store_n(&ring->dead, 1, __ATOMIC_RELEASE);
+}
+
+static void logKeyInit(void)
+{
+	pthread_key_create(&logKey, logRingExit);
+}
+
+/**
+	ring of the calling thread, registered with the drain thread on first use
+*/
+static LogRing* logRing(void)
+{
+	LogRing* ring = logThreadRing;
+
+	if (ring)
+		return ring;
+
+	ring = aligned_alloc(64, sizeof(LogRing));
+	if (!ring)
+		return NULL;
+	memset(ring, 0, sizeof(LogRing));
+
+	pthread_once(&logOnce, logKeyInit);
+	pthread_setspecific(logKey, ring);
+
+	pthread_mutex_lock(&logLock);
+	DL_APPEND(logRings, ring);
+	pthread_mutex_unlock(&logLock);
+
+	logThreadRing = ring;
+	return ring;
+}
+
+static int logFormat(char* out, size_t size, uint64_t ns, int level, const char* text, int len)
+{
+	int n = snprintf(out, size, "%5llu.%06llu %c %.*s\n",
+		(unsigned long long)(ns / 1000000000ull), (unsigned long long)(ns % 1000000000ull) / 1000,
+		logLevelChar[level], len, text);
+
+	return n < (int)size ? n : (int)size - 1;
+}
+
+static void logOut(const char* out, size_t len)
+{
+	while (len) {
+		ssize_t n = write(logFd, out, len);
+		if (n < 0) {
+			if (EINTR == errno)
+				continue;
+			return;
+		}
+		out += n;
+		len -= n;
+	}
+}
+
+/**
+	move every pending record to the log fd
+*/
+static void logFlush(void)
+{
+	char out[LOG_OUT];
+	size_t used = 0;
+	LogRing *ring, *tmp;
+
+	pthread_mutex_lock(&logLock);
+	DL_FOREACH_SAFE(logRings, ring, tmp) {
+		uint64_t tail = ring->tail;
+		uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+		for (; tail != head; ++tail) {
+			LogRecord* rec = &ring->slots[tail & (LOG_RING_SLOTS - 1)];
+
+			if (used + LOG_LINE + 32 > sizeof(out)) {
+				logOut(out, used);
+				used = 0;
+			}
+			used += logFormat(out + used, sizeof(out) - used, rec->ns, rec->level, rec->text, rec->len);
+		}
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+		if (__atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE) && tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+			DL_DELETE(logRings, ring);
+			free(ring);
+		}
+	}
+	pthread_mutex_unlock(&logLock);
+
+	if (used)
+		logOut(out, used);
+}
+
+static void* logDrain(void* arg)
+{
+	struct timespec ts = { 0, LOG_POLL_NS };
+
+	(void)arg;
+	while (__atomic_load_n(&logRunning, __ATOMIC_ACQUIRE)) {
+		logFlush();
+		nanosleep(&ts, NULL);
+	}
+	logFlush();
+	return NULL;
+}
+
+void v4l2log_write(log_level level, const char* fmt, ...)
+{
+	LogRing* ring;
+	LogRecord* rec;
+	uint64_t head;
+	va_list ap;
+	int len;
+
+	if (!__atomic_load_n(&logRunning, __ATOMIC_ACQUIRE)) {
+		/* No drain thread, format and write in one syscall. */
+		char text[LOG_LINE], out[LOG_LINE + 32];
+
+		va_start(ap, fmt);
+		len = vsnprintf(text, sizeof(text), fmt, ap);
+		va_end(ap);
+		if (len >= (int)sizeof(text))
+			len = sizeof(text) - 1;
+		while (len > 0 && text[len - 1] == '\n')
+			len--;
+		logOut(out, logFormat(out, sizeof(out), logNow(), level, text, len));
+		return;
+	}
+
+	ring = logRing();
+	if (!ring) {
+		__atomic_add_fetch(&logDropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	head = ring->head;
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SLOTS) {
+		__atomic_add_fetch(&logDropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	rec = &ring->slots[head & (LOG_RING_SLOTS - 1)];
+	rec->ns = logNow();
+	rec->level = level;
+
+	va_start(ap, fmt);
+	len = vsnprintf(rec->text, sizeof(rec->text), fmt, ap);
+	va_end(ap);
+	if (len >= (int)sizeof(rec->text))
+		len = sizeof(rec->text) - 1;
+	while (len > 0 && rec->text[len - 1] == '\n')
+		len--;
+	rec->len = len;
+
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void v4l2log_set_level(log_level level)
+{
+	v4l2log_threshold = level;
+}
+
+void v4l2log_set_fd(int fd)
+{
+	logFd = fd;
+}
+
+/**
+	start the background drain thread
+*/
+int v4l2log_start(void)
+{
+	if (__atomic_load_n(&logRunning, __ATOMIC_ACQUIRE))
+		return 0;
+
+	__atomic_store_n(&logRunning, 1, __ATOMIC_RELEASE);
+	if (pthread_create(&logThread, NULL, logDrain, NULL)) {
+		__atomic_store_n(&logRunning, 0, __ATOMIC_RELEASE);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+	flush everything queued and go back to direct writes
+*/
+void v4l2log_stop(void)
+{
+	if (!__atomic_load_n(&logRunning, __ATOMIC_ACQUIRE))
+		return;
+
+	__atomic_store_n(&logRunning, 0, __ATOMIC_RELEASE);
+	pthread_join(logThread, NULL);
+	logFlush();
+}
+
+/**
+	records lost to full rings
+*/
+uint64_t v4l2log_dropped(void)
+{
+	return __atomic_load_n(&logDropped, __ATOMIC_RELAXED);
+}
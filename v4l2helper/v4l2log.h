@@ -0,0 +1,48 @@
+#ifndef V4L2LOG_H_INCLUDED
+#define V4L2LOG_H_INCLUDED
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+        LOG_LEVEL_ERROR,
+        LOG_LEVEL_WARN,
+        LOG_LEVEL_INFO,
+        LOG_LEVEL_DEBUG,
+} log_level;
+
+extern int v4l2log_threshold;
+
+/*
+    Filtered before the arguments are evaluated, so disabled levels cost a
+    compare. Once v4l2log_start() runs, records go to a per-thread lock-free
+    ring drained by a background thread; until then they are written directly.
+*/
+#define v4l2log(level, ...) \
+    do { if ((int)(level) <= v4l2log_threshold) v4l2log_write(level, __VA_ARGS__); } while (0)
+
+#define log_error(...)  v4l2log(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warn(...)   v4l2log(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_info(...)   v4l2log(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...)  v4l2log(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_errno(s)    log_error("%s error %d, %s", s, errno, strerror(errno))
+
+void v4l2log_write(log_level level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+void v4l2log_set_level(log_level level);
+
+void v4l2log_set_fd(int fd);
+
+int v4l2log_start(void);
+
+void v4l2log_stop(void);
+
+uint64_t v4l2log_dropped(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // V4L2LOG_H_INCLUDED
@@ -0,0 +1,209 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "v4l2pool.h"
+#include "v4l2log.h"
+
+#define POOL_HUGE_SIZE  (2u << 20)
+#define POOL_MPOL_BIND  2           //from linux/mempolicy.h, without pulling in libnuma
+#define POOL_MAX_NODES  1024
+
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB    (21 << 26)
+#endif
+
+struct v4l2_pool_t{
+    uint8_t*        base;
+    size_t          length;     //of the mapping
+    size_t          stride;     //slot size rounded up to whole pages
+    unsigned int    count;
+    unsigned int    flags;      //what the pool actually got
+    uint8_t         hugetlb;    //mapped from the hugetlbfs reserve
+};
+
+static size_t roundUp(size_t n, size_t align)
+{
+	return (n + align - 1) / align * align;
+}
+
+/**
+	anonymous mapping aligned to a hugepage, so transparent hugepages can back all of it
+*/
+static void* mapAligned(size_t length)
+{
+	uint8_t* raw;
+	uint8_t* start;
+	size_t head;
+
+	raw = mmap(NULL, length + POOL_HUGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == raw)
+		return MAP_FAILED;
+
+	start = (uint8_t*)roundUp((uintptr_t)raw, POOL_HUGE_SIZE);
+	head = start - raw;
+	if (head)
+		munmap(raw, head);
+	if (POOL_HUGE_SIZE - head)
+		munmap(start + length, POOL_HUGE_SIZE - head);
+	return start;
+}
+
+static int poolMap(v4l2_pool_t* pool, unsigned int flags)
+{
+	if (flags & POOL_HUGEPAGE) {
+		pool->base = mmap(NULL, pool->length, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+		if (MAP_FAILED != pool->base) {
+			pool->hugetlb = 1;
+			pool->flags |= POOL_HUGEPAGE;
+			return 0;
+		}
+
+		/* No reserved hugepages, ask for transparent ones instead. */
+		pool->base = mapAligned(pool->length);
+		if (MAP_FAILED == pool->base)
+			return -1;
+		if (0 == madvise(pool->base, pool->length, MADV_HUGEPAGE))
+			pool->flags |= POOL_HUGEPAGE;
+		else
+			log_warn("%zu byte pool: no hugepages available, using small pages", pool->length);
+		return 0;
+	}
+
+	pool->base = mmap(NULL, pool->length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return MAP_FAILED == pool->base ? -1 : 0;
+}
+
+/**
+	bind the pool to node, or to the one the calling thread runs on when node < 0,
+	before any page is touched
+*/
+static void poolBind(v4l2_pool_t* pool, int want)
+{
+#ifdef SYS_mbind
+	unsigned long mask[POOL_MAX_NODES / (8 * sizeof(unsigned long))];
+	unsigned int cpu, node = want;
+
+	if (want < 0 && -1 == getcpu(&cpu, &node)) {
+		log_warn("getcpu: %s", strerror(errno));
+		return;
+	}
+	if (node >= POOL_MAX_NODES) {
+		log_warn("pool: no NUMA node %u", node);
+		return;
+	}
+	memset(mask, 0, sizeof(mask));
+	mask[node / (8 * sizeof(unsigned long))] = 1ul << (node % (8 * sizeof(unsigned long)));
+
+	if (-1 == syscall(SYS_mbind, pool->base, pool->length, POOL_MPOL_BIND, mask, POOL_MAX_NODES + 1, 0)) {
+		log_warn("mbind node %u: %s", node, strerror(errno));
+		return;
+	}
+	pool->flags |= POOL_NUMA_LOCAL;
+	log_debug("pool %p bound to node %u", pool->base, node);
+#endif
+}
+
+/**
+	map count slots of at least slot_size bytes each, every slot starts on a page boundary;
+	POOL_NUMA_LOCAL binds to node, or the calling thread's node when node < 0
+*/
+v4l2_pool_t* v4l2pool_create(size_t slot_size, unsigned int count, unsigned int flags, int node)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	v4l2_pool_t* pool;
+	size_t off;
+
+	assert(slot_size > 0 && count > 0);
+
+	pool = calloc(1, sizeof(v4l2_pool_t));
+	if (!pool) {
+		log_error("Out of memory");
+		return NULL;
+	}
+	pool->stride = roundUp(slot_size, page);
+	pool->count = count;
+	pool->length = pool->stride * count;
+	if (flags & POOL_HUGEPAGE)
+		pool->length = roundUp(pool->length, POOL_HUGE_SIZE);
+
+	if (poolMap(pool, flags) < 0) {
+		log_errno("mmap");
+		free(pool);
+		return NULL;
+	}
+
+	if (flags & POOL_NUMA_LOCAL)
+		poolBind(pool, node);
+
+	/* First touch after mbind, so every page lands where it was bound. */
+	if (flags & POOL_PREFAULT) {
+		for (off = 0; off < pool->length; off += pool->hugetlb ? POOL_HUGE_SIZE : page)
+			pool->base[off] = 0;
+		pool->flags |= POOL_PREFAULT;
+	}
+
+	log_info("pool: %u slots of %zu bytes at %p%s%s", count, pool->stride, pool->base,
+		pool->hugetlb ? ", hugetlb" : (pool->flags & POOL_HUGEPAGE) ? ", thp" : "",
+		(pool->flags & POOL_NUMA_LOCAL) ? ", node local" : "");
+	return pool;
+}
+
+void v4l2pool_destroy(v4l2_pool_t* pool)
+{
+	if (!pool)
+		return;
+	if (-1 == munmap(pool->base, pool->length))
+		log_errno("munmap");
+	free(pool);
+}
+
+void* v4l2pool_slot(const v4l2_pool_t* pool, unsigned int index)
+{
+	assert(index < pool->count);
+	return pool->base + (size_t)index * pool->stride;
+}
+
+/**
+	slot ptr points into, -1 when it isn't ours
+*/
+int v4l2pool_index(const v4l2_pool_t* pool, const void* ptr)
+{
+	const uint8_t* p = ptr;
+
+	if (p < pool->base || p >= pool->base + (size_t)pool->count * pool->stride)
+		return -1;
+	return (p - pool->base) / pool->stride;
+}
+
+size_t v4l2pool_slot_size(const v4l2_pool_t* pool)
+{
+	return pool->stride;
+}
+
+/**
+	hand a slot's pages back to the kernel, the slot stays usable and refaults zeroed
+*/
+void v4l2pool_release(v4l2_pool_t* pool, unsigned int index)
+{
+	assert(index < pool->count);
+
+	/* Splitting a hugepage costs more than the memory is worth. */
+	if (pool->flags & POOL_HUGEPAGE)
+		return;
+	if (-1 == madvise(v4l2pool_slot(pool, index), pool->stride, MADV_DONTNEED))
+		log_errno("madvise");
+}
+
+unsigned int v4l2pool_flags(const v4l2_pool_t* pool)
+{
+	return pool->flags;
+}
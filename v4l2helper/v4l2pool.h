@@ -0,0 +1,41 @@
+#ifndef V4L2POOL_H_INCLUDED
+#define V4L2POOL_H_INCLUDED
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+    Fixed-size slots carved out of one page aligned mapping, used as
+    USERPTR capture buffers.  A slot's index follows from its address,
+    so looking up the buffer a pointer belongs to costs a subtraction
+    and a division.
+*/
+typedef enum pool_flags{
+    POOL_HUGEPAGE   = 1 << 0,   //back the pool with 2 MB pages, hugetlbfs first then transparent hugepages
+    POOL_NUMA_LOCAL = 1 << 1,   //bind the pool to a NUMA node, the creating thread's unless one is given
+    POOL_PREFAULT   = 1 << 2,   //touch every page at create so capture never faults
+}pool_flags;
+
+typedef struct v4l2_pool_t v4l2_pool_t;
+
+v4l2_pool_t* v4l2pool_create(size_t slot_size, unsigned int count, unsigned int flags, int node);
+
+void v4l2pool_destroy(v4l2_pool_t* pool);
+
+void* v4l2pool_slot(const v4l2_pool_t* pool, unsigned int index);
+
+int v4l2pool_index(const v4l2_pool_t* pool, const void* ptr);
+
+size_t v4l2pool_slot_size(const v4l2_pool_t* pool);
+
+void v4l2pool_release(v4l2_pool_t* pool, unsigned int index);
+
+unsigned int v4l2pool_flags(const v4l2_pool_t* pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // V4L2POOL_H_INCLUDED
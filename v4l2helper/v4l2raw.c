@@ -0,0 +1,420 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "v4l2raw.h"
+#include "v4l2pool.h"
+#include "v4l2log.h"
+
+#define RAW_ALIGN           4096            //O_DIRECT offset, length and address alignment
+#define RAW_STAGING_BYTES   (8u << 20)
+#define RAW_STAGING_COUNT   4
+#define RAW_PATH_MAX        4096
+
+typedef struct RawBuf{
+    uint8_t*     data;
+    size_t       fill;
+    unsigned int file;          //file number the data belongs to
+    uint8_t      last;          //close the file after writing this buffer
+}RawBuf;
+
+struct v4l2_raw_t{
+    RawConfig    cfg;
+    char*        path;
+    v4l2_pool_t* pool;
+    RawBuf*      bufs;
+
+    pthread_t    writer;
+    pthread_mutex_t lock;
+    pthread_cond_t  work;       //a buffer was queued for the writer
+    pthread_cond_t  space;      //the writer freed a buffer
+    unsigned int* queue;        //buffers waiting for the writer, in order
+    unsigned int n_queued, head;
+    unsigned int* free_list;
+    unsigned int n_free;
+    uint8_t      stop;
+
+    //capture side
+    RawBuf*      cur;           //being filled, NULL while none is free
+    unsigned int file;
+    uint64_t     file_fill;     //bytes handed to the current file
+    uint64_t     file_start_ns;
+
+    //writer side
+    int          fd;
+    unsigned int fd_file;
+    uint64_t     fd_offset;     //bytes of real data in the open file
+    uint8_t      direct;
+
+    RawStats     stats;
+};
+
+static uint64_t rawNow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void statAdd(uint64_t* counter, uint64_t n)
+{
+	__atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
+
+/**
+	trim the preallocation back to the data and close
+*/
+static void fileClose(v4l2_raw_t* raw)
+{
+	if (raw->fd < 0)
+		return;
+	if (-1 == ftruncate(raw->fd, raw->fd_offset))
+		log_errno("ftruncate");
+	if (-1 == close(raw->fd))
+		log_errno("close");
+	raw->fd = -1;
+}
+
+static int fileOpen(v4l2_raw_t* raw, unsigned int file)
+{
+	char name[RAW_PATH_MAX];
+	uint64_t prealloc = raw->cfg.prealloc ? raw->cfg.prealloc : raw->cfg.file_bytes;
+	int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+
+	snprintf(name, sizeof(name), raw->path, file);
+	raw->fd = raw->cfg.buffered ? -1 : open(name, flags | O_DIRECT, 0644);
+	raw->direct = raw->fd >= 0;
+	if (raw->fd < 0) {
+		if (!raw->cfg.buffered)
+			log_warn("%s: no O_DIRECT (%s), writing through the page cache", name, strerror(errno));
+		raw->fd = open(name, flags, 0644);
+	}
+	if (raw->fd < 0) {
+		log_error("Cannot open '%s': %d, %s", name, errno, strerror(errno));
+		return -1;
+	}
+	raw->fd_file = file;
+	raw->fd_offset = 0;
+	__atomic_store_n(&raw->stats.direct, raw->direct, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&raw->stats.files, 1, __ATOMIC_RELAXED);
+
+	/* Reserve the extents up front, KEEP_SIZE so a short file needs no trimming by readers. */
+	if (prealloc && -1 == fallocate(raw->fd, FALLOC_FL_KEEP_SIZE, 0, prealloc) && EOPNOTSUPP != errno)
+		log_warn("%s: fallocate: %s", name, strerror(errno));
+	return 0;
+}
+
+/**
+	write one staging buffer; only the last of a file may be partial,
+	O_DIRECT pads it to a block and fileClose trims the padding
+*/
+static int bufWrite(v4l2_raw_t* raw, RawBuf* buf)
+{
+	size_t len = buf->fill, done = 0;
+	ssize_t r;
+
+	if (raw->fd < 0 || raw->fd_file != buf->file) {
+		fileClose(raw);
+		if (fileOpen(raw, buf->file) < 0)
+			return -1;
+	}
+	if (raw->direct && (len & (RAW_ALIGN - 1))) {
+		memset(buf->data + len, 0, RAW_ALIGN - (len & (RAW_ALIGN - 1)));
+		len += RAW_ALIGN - (len & (RAW_ALIGN - 1));
+	}
+
+	while (done < len) {
+		r = pwrite(raw->fd, buf->data + done, len - done, raw->fd_offset + done);
+		if (r < 0) {
+			if (EINTR == errno)
+				continue;
+			/* Some filesystems take O_DIRECT at open and refuse it on write. */
+			if (EINVAL == errno && raw->direct) {
+				log_warn("raw recorder: O_DIRECT write refused, writing through the page cache");
+				fcntl(raw->fd, F_SETFL, fcntl(raw->fd, F_GETFL) & ~O_DIRECT);
+				raw->direct = 0;
+				__atomic_store_n(&raw->stats.direct, 0, __ATOMIC_RELAXED);
+				len = buf->fill;
+				continue;
+			}
+			log_errno("raw recorder pwrite");
+			return -1;
+		}
+		done += r;
+	}
+	raw->fd_offset += buf->fill;
+	statAdd(&raw->stats.bytes, buf->fill);
+	if (buf->last)
+		fileClose(raw);
+	return 0;
+}
+
+static void* rawWriter(void* arg)
+{
+	v4l2_raw_t* raw = arg;
+	unsigned int i;
+
+	pthread_mutex_lock(&raw->lock);
+	for (;;) {
+		while (!raw->n_queued && !raw->stop)
+			pthread_cond_wait(&raw->work, &raw->lock);
+		if (!raw->n_queued)
+			break;
+		i = raw->queue[raw->head];
+		pthread_mutex_unlock(&raw->lock);
+
+		if (bufWrite(raw, &raw->bufs[i]) < 0)
+			statAdd(&raw->stats.errors, 1);
+
+		pthread_mutex_lock(&raw->lock);
+		raw->head = (raw->head + 1) % raw->cfg.n_staging;
+		raw->n_queued--;
+		raw->bufs[i].fill = 0;
+		raw->bufs[i].last = 0;
+		raw->free_list[raw->n_free++] = i;
+		pthread_cond_signal(&raw->space);
+	}
+	pthread_mutex_unlock(&raw->lock);
+	fileClose(raw);
+	return NULL;
+}
+
+/**
+	queue the current buffer for the writer and take a free one,
+	waiting for it with cfg.block; returns -1 when none is free
+*/
+static int bufNext(v4l2_raw_t* raw)
+{
+	RawBuf* buf = raw->cur;
+	uint64_t t0;
+	unsigned int i;
+	int r = 0;
+
+	pthread_mutex_lock(&raw->lock);
+	if (buf && buf->fill) {
+		raw->queue[(raw->head + raw->n_queued++) % raw->cfg.n_staging] = buf - raw->bufs;
+		if (raw->n_queued > raw->stats.queued_max)
+			__atomic_store_n(&raw->stats.queued_max, raw->n_queued, __ATOMIC_RELAXED);
+		pthread_cond_signal(&raw->work);
+		buf = NULL;
+	}
+	if (!buf) {
+		if (!raw->n_free && raw->cfg.block) {
+			t0 = rawNow();
+			statAdd(&raw->stats.stalls, 1);
+			while (!raw->n_free)
+				pthread_cond_wait(&raw->space, &raw->lock);
+			statAdd(&raw->stats.stall_ns, rawNow() - t0);
+		}
+		if (raw->n_free) {
+			i = raw->free_list[--raw->n_free];
+			buf = &raw->bufs[i];
+			buf->file = raw->file;
+		} else {
+			r = -1;
+		}
+	}
+	raw->cur = buf;
+	pthread_mutex_unlock(&raw->lock);
+	return r;
+}
+
+/**
+	end the current file at a frame boundary, the next frame starts a new one
+*/
+static void fileRotate(v4l2_raw_t* raw)
+{
+	raw->file++;
+	if (raw->cur && raw->cur->fill) {
+		raw->cur->last = 1;
+		bufNext(raw);
+	} else if (raw->cur) {
+		/* Nothing staged for the old file, the writer closes it when this buffer arrives. */
+		raw->cur->file = raw->file;
+	}
+	raw->file_fill = 0;
+	raw->file_start_ns = rawNow();
+}
+
+static void stageCopy(v4l2_raw_t* raw, void* dst, const void* src, size_t n)
+{
+	if (raw->cfg.copier)
+		v4l2copy(raw->cfg.copier, dst, src, n);
+	else
+		memcpy(dst, src, n);
+}
+
+/**
+	stage a frame for writing, from the capture callback or a consumer thread,
+	one caller at a time; returns -1 if it had to be dropped
+*/
+int v4l2raw_frame(v4l2_raw_t* raw, const v4l2_frame_t* frame)
+{
+	const RawConfig* cfg = &raw->cfg;
+	const v4l2_frame_plane_t* pl;
+	const uint8_t* src;
+	size_t size = 0, left, n;
+	unsigned int p;
+
+	for (p = 0; p < frame->n_planes; ++p)
+		size += frame->planes[p].bytesused;
+
+	if ((cfg->file_bytes && raw->file_fill && raw->file_fill + size > cfg->file_bytes)
+	 || (cfg->file_seconds && rawNow() - raw->file_start_ns >= cfg->file_seconds * 1000000000ull))
+		fileRotate(raw);
+
+	/* Drop whole frames only, never leave half of one in the stream. */
+	if (!raw->cur && bufNext(raw) < 0) {
+		statAdd(&raw->stats.dropped, 1);
+		return -1;
+	}
+	if (!raw->cfg.block && cfg->staging_bytes - raw->cur->fill < size
+	 && (size - (cfg->staging_bytes - raw->cur->fill) + cfg->staging_bytes - 1) / cfg->staging_bytes
+	    > __atomic_load_n(&raw->n_free, __ATOMIC_RELAXED)) {
+		statAdd(&raw->stats.dropped, 1);
+		return -1;
+	}
+
+	for (p = 0; p < frame->n_planes; ++p) {
+		pl = &frame->planes[p];
+		src = pl->start;
+		left = pl->bytesused;
+		while (left) {
+			if (raw->cur->fill == cfg->staging_bytes && bufNext(raw) < 0) {
+				/* The check above counted enough free buffers, and only the writer frees them. */
+				statAdd(&raw->stats.dropped, 1);
+				return -1;
+			}
+			n = cfg->staging_bytes - raw->cur->fill;
+			if (n > left)
+				n = left;
+			stageCopy(raw, raw->cur->data + raw->cur->fill, src, n);
+			raw->cur->fill += n;
+			src += n;
+			left -= n;
+		}
+	}
+	raw->file_fill += size;
+	statAdd(&raw->stats.frames, 1);
+	return 0;
+}
+
+v4l2_raw_t* v4l2raw_open(const RawConfig* cfg)
+{
+	v4l2_raw_t* raw;
+	unsigned int i;
+
+	if (!cfg->path || ((cfg->file_bytes || cfg->file_seconds) && !strchr(cfg->path, '%'))) {
+		log_error("raw recorder: rotating needs a %%u in the path");
+		return NULL;
+	}
+
+	raw = calloc(1, sizeof(v4l2_raw_t));
+	if (!raw) {
+		log_error("Out of memory");
+		return NULL;
+	}
+	raw->cfg = *cfg;
+	raw->fd = -1;
+	if (!raw->cfg.staging_bytes)
+		raw->cfg.staging_bytes = RAW_STAGING_BYTES;
+	raw->cfg.staging_bytes = (raw->cfg.staging_bytes + RAW_ALIGN - 1) & ~(size_t)(RAW_ALIGN - 1);
+	if (raw->cfg.n_staging < 2)
+		raw->cfg.n_staging = cfg->n_staging ? 2 : RAW_STAGING_COUNT;
+	raw->path = strdup(cfg->path);
+	raw->cfg.path = raw->path;
+
+	/* Page aligned for O_DIRECT, and prefaulted so staging never faults on the capture thread. */
+	raw->pool = v4l2pool_create(raw->cfg.staging_bytes, raw->cfg.n_staging, POOL_PREFAULT, -1);
+	raw->bufs = calloc(raw->cfg.n_staging, sizeof(RawBuf));
+	raw->queue = calloc(raw->cfg.n_staging, sizeof(unsigned int));
+	raw->free_list = calloc(raw->cfg.n_staging, sizeof(unsigned int));
+	if (!raw->path || !raw->pool || !raw->bufs || !raw->queue || !raw->free_list) {
+		log_error("Out of memory");
+		goto fail;
+	}
+	for (i = 0; i < raw->cfg.n_staging; ++i) {
+		raw->bufs[i].data = v4l2pool_slot(raw->pool, i);
+		raw->free_list[raw->n_free++] = raw->cfg.n_staging - 1 - i;
+	}
+
+	pthread_mutex_init(&raw->lock, NULL);
+	pthread_cond_init(&raw->work, NULL);
+	pthread_cond_init(&raw->space, NULL);
+	raw->file_start_ns = rawNow();
+	if (pthread_create(&raw->writer, NULL, rawWriter, raw)) {
+		log_error("raw recorder: can't create the writer thread");
+		pthread_cond_destroy(&raw->space);
+		pthread_cond_destroy(&raw->work);
+		pthread_mutex_destroy(&raw->lock);
+		goto fail;
+	}
+	return raw;
+
+fail:
+	free(raw->free_list);
+	free(raw->queue);
+	free(raw->bufs);
+	v4l2pool_destroy(raw->pool);
+	free(raw->path);
+	free(raw);
+	return NULL;
+}
+
+/**
+	write out what is staged, trim the last file and stop the writer
+*/
+int v4l2raw_close(v4l2_raw_t* raw)
+{
+	int errors;
+
+	if (!raw)
+		return 0;
+	if (raw->cur && raw->cur->fill)
+		raw->cur->last = 1;
+	bufNext(raw);
+
+	pthread_mutex_lock(&raw->lock);
+	raw->stop = 1;
+	pthread_cond_signal(&raw->work);
+	pthread_mutex_unlock(&raw->lock);
+	pthread_join(raw->writer, NULL);
+
+	log_info("raw recorder: %" PRIu64 " frames, %" PRIu64 " bytes in %u files, %" PRIu64 " dropped, %" PRIu64 " stalls",
+		raw->stats.frames, raw->stats.bytes, raw->stats.files, raw->stats.dropped, raw->stats.stalls);
+	errors = raw->stats.errors ? -1 : 0;
+
+	pthread_cond_destroy(&raw->space);
+	pthread_cond_destroy(&raw->work);
+	pthread_mutex_destroy(&raw->lock);
+	free(raw->free_list);
+	free(raw->queue);
+	free(raw->bufs);
+	v4l2pool_destroy(raw->pool);
+	free(raw->path);
+	free(raw);
+	return errors;
+}
+
+void v4l2raw_stats(v4l2_raw_t* raw, RawStats* stats)
+{
+	RawStats* st = &raw->stats;
+
+	stats->frames = __atomic_load_n(&st->frames, __ATOMIC_RELAXED);
+	stats->bytes = __atomic_load_n(&st->bytes, __ATOMIC_RELAXED);
+	stats->dropped = __atomic_load_n(&st->dropped, __ATOMIC_RELAXED);
+	stats->stalls = __atomic_load_n(&st->stalls, __ATOMIC_RELAXED);
+	stats->stall_ns = __atomic_load_n(&st->stall_ns, __ATOMIC_RELAXED);
+	stats->queued_max = __atomic_load_n(&st->queued_max, __ATOMIC_RELAXED);
+	stats->files = __atomic_load_n(&st->files, __ATOMIC_RELAXED);
+	stats->errors = __atomic_load_n(&st->errors, __ATOMIC_RELAXED);
+	stats->direct = __atomic_load_n(&st->direct, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,56 @@
+#ifndef V4L2RAW_H_INCLUDED
+#define V4L2RAW_H_INCLUDED
+#include "v4l2core.h"
+#include "v4l2copy.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+    Archives raw frames, every plane back to back, at disk speed.  Frames
+    are copied into a fixed set of aligned staging buffers and a writer
+    thread writes full buffers with O_DIRECT, so the page cache never
+    fills up and writeback never lands on the capture thread.  Files are
+    preallocated and rotate by size or age; memory stays at
+    n_staging * staging_bytes however far the disk falls behind.
+*/
+typedef struct RawConfig{
+    const char*  path;          //file name, a printf format with one %u for the file number when rotating
+    uint64_t     file_bytes;    //start a new file past this size, 0 never
+    unsigned int file_seconds;  //start a new file after this long, 0 never
+    uint64_t     prealloc;      //fallocate this much of each new file, 0 takes file_bytes
+    size_t       staging_bytes; //one staging buffer, 0 for the default
+    unsigned int n_staging;     //staging buffers, 0 for the default
+    uint8_t      block;         //wait for a free staging buffer instead of dropping the frame
+    uint8_t      buffered;      //skip O_DIRECT, for filesystems without it
+    v4l2_copy_t* copier;        //copies frames into staging, NULL uses memcpy
+}RawConfig;
+
+typedef struct RawStats{
+    uint64_t     frames;        //frames taken into staging
+    uint64_t     bytes;         //bytes written to disk
+    uint64_t     dropped;       //frames lost for want of a free staging buffer
+    uint64_t     stalls;        //times v4l2raw_frame waited for a staging buffer
+    uint64_t     stall_ns;      //total time it waited
+    unsigned int queued_max;    //most staging buffers waiting for the writer at once
+    unsigned int files;         //files opened so far
+    uint64_t     errors;        //failed opens and writes
+    uint8_t      direct;        //O_DIRECT is in use
+}RawStats;
+
+typedef struct v4l2_raw_t v4l2_raw_t;
+
+v4l2_raw_t* v4l2raw_open(const RawConfig* cfg);
+
+int v4l2raw_frame(v4l2_raw_t* raw, const v4l2_frame_t* frame);
+
+int v4l2raw_close(v4l2_raw_t* raw);
+
+void v4l2raw_stats(v4l2_raw_t* raw, RawStats* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // V4L2RAW_H_INCLUDED
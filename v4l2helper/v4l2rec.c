@@ -0,0 +1,721 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "v4l2rec.h"
+#include "v4l2ring.h"
+#include "v4l2log.h"
+
+#define REC_IOV          (2 + V4L2CORE_MAX_PLANES)  //header, planes, pad
+#define REC_AVI_HEADER   224        //RIFF, hdrl and the movi list header
+#define REC_AVI_MOVI     220        //offset of the 'movi' fourcc, idx1 offsets count from it
+#define REC_AVI_LIMIT    0xFFFFFFF0ull
+#define REC_MKV_CLUSTER  1000       //ms of frames per cluster
+#define REC_MKV_HEADER   512
+#define REC_DEFAULT_FPS  30
+
+/* Matroska element ids */
+#define MKV_EBML         0x1A45DFA3
+#define MKV_SEGMENT      0x18538067
+#define MKV_SEEKHEAD     0x114D9B74
+#define MKV_SEEK         0x4DBB
+#define MKV_SEEKID       0x53AB
+#define MKV_SEEKPOS      0x53AC
+#define MKV_INFO         0x1549A966
+#define MKV_TIMESCALE    0x2AD7B1
+#define MKV_DURATION     0x4489
+#define MKV_MUXINGAPP    0x4D80
+#define MKV_WRITINGAPP   0x5741
+#define MKV_TRACKS       0x1654AE6B
+#define MKV_TRACKENTRY   0xAE
+#define MKV_CLUSTER      0x1F43B675
+#define MKV_TIMESTAMP    0xE7
+#define MKV_SIMPLEBLOCK  0xA3
+#define MKV_CUES         0x1C53BB6B
+#define MKV_CUEPOINT     0xBB
+#define MKV_CUETIME      0xB3
+#define MKV_CUEPOSITIONS 0xB7
+#define MKV_CUETRACK     0xF7
+#define MKV_CUECLUSTER   0xF1
+
+typedef struct RecIndex{
+    uint64_t     offset;    //AVI: chunk from 'movi', MKV: cluster from the segment data
+    uint32_t     size;      //AVI chunk payload
+    uint32_t     time_ms;   //MKV cluster timestamp
+}RecIndex;
+
+typedef struct RecBuf{
+    uint8_t*     p;
+    size_t       len;
+}RecBuf;
+
+struct v4l2_rec_t{
+    v4l2_dev_t*  vd;
+    v4l2_ring_t* ring;
+    pthread_t    writer;
+    int          fd;
+    uint64_t     offset;        //where the next write lands
+    rec_container container;
+    uint32_t     fourcc;
+    uint32_t     width, height;
+    uint32_t     period_us;     //nominal, replaced by the measured one on close
+
+    uint64_t     first_us, last_us;
+    uint8_t      started;
+    uint32_t     max_chunk;
+    uint8_t      full;
+
+    uint64_t     segment;       //MKV: segment data start
+    uint64_t     cluster;       //MKV: open cluster, 0 for none
+    uint64_t     cluster_ms;
+    uint64_t     duration_at;   //MKV: file offset of the Duration float
+    uint64_t     cues_at;       //MKV: file offset of the SeekPosition for the cues
+
+    RecIndex*    index;
+    size_t       n_index, cap_index;
+
+    uint64_t     frames, bytes, errors;
+};
+
+static void put16(uint8_t* p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32(uint8_t* p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static void putFourcc(uint8_t* p, const char* s)
+{
+	memcpy(p, s, 4);
+}
+
+/**
+	writev all of iov, resuming short writes
+*/
+static int recWritev(v4l2_rec_t* rec, struct iovec* iov, int n)
+{
+	ssize_t r;
+
+	while (n > 0) {
+		r = writev(rec->fd, iov, n);
+		if (r < 0) {
+			if (EINTR == errno)
+				continue;
+			log_errno("recorder writev");
+			return -1;
+		}
+		rec->offset += r;
+		while (n > 0 && (size_t)r >= iov->iov_len) {
+			r -= iov->iov_len;
+			++iov;
+			--n;
+		}
+		if (n > 0) {
+			iov->iov_base = (uint8_t*)iov->iov_base + r;
+			iov->iov_len -= r;
+		}
+	}
+	return 0;
+}
+
+static int recWrite(v4l2_rec_t* rec, const void* buf, size_t n)
+{
+	struct iovec iov = { (void*)buf, n };
+
+	return recWritev(rec, &iov, 1);
+}
+
+static int recPatch(v4l2_rec_t* rec, uint64_t at, const void* buf, size_t n)
+{
+	if (pwrite(rec->fd, buf, n, at) != (ssize_t)n) {
+		log_errno("recorder pwrite");
+		return -1;
+	}
+	return 0;
+}
+
+static int indexAdd(v4l2_rec_t* rec, uint64_t offset, uint32_t size, uint32_t time_ms)
+{
+	RecIndex* index;
+	size_t cap;
+
+	if (rec->n_index == rec->cap_index) {
+		cap = rec->cap_index ? rec->cap_index * 2 : 1024;
+		index = realloc(rec->index, cap * sizeof(*index));
+		if (!index) {
+			log_error("Out of memory");
+			return -1;
+		}
+		rec->index = index;
+		rec->cap_index = cap;
+	}
+	rec->index[rec->n_index].offset = offset;
+	rec->index[rec->n_index].size = size;
+	rec->index[rec->n_index].time_ms = time_ms;
+	rec->n_index++;
+	return 0;
+}
+
+static uint64_t frameUs(const v4l2_frame_t* frame)
+{
+	return (uint64_t)frame->timestamp.tv_sec * 1000000ull + frame->timestamp.tv_usec;
+}
+
+/**
+	gather the payload of every plane into iov, returns its total size
+*/
+static size_t framePayload(const v4l2_frame_t* frame, struct iovec* iov, int* n)
+{
+	const v4l2_frame_plane_t* pl;
+	size_t size = 0;
+	unsigned int p;
+
+	for (p = 0; p < frame->n_planes; ++p) {
+		pl = &frame->planes[p];
+		if (pl->bytesused <= pl->data_offset)
+			continue;
+		iov[*n].iov_base = (uint8_t*)pl->start + pl->data_offset;
+		iov[*n].iov_len = pl->bytesused - pl->data_offset;
+		size += iov[*n].iov_len;
+		(*n)++;
+	}
+	return size;
+}
+
+/**
+	the whole AVI header from what is known so far, rewritten on close
+*/
+static void aviHeader(v4l2_rec_t* rec, uint8_t* h)
+{
+	int mjpeg = V4L2_PIX_FMT_MJPEG == rec->fourcc;
+	uint64_t movi_end = rec->offset > REC_AVI_HEADER ? rec->offset : REC_AVI_HEADER;
+	uint32_t frames = rec->frames;
+
+	memset(h, 0, REC_AVI_HEADER);
+	putFourcc(h, "RIFF");
+	put32(h + 4, movi_end + (rec->n_index ? 8 + rec->n_index * 16 : 0) - 8);
+	putFourcc(h + 8, "AVI ");
+
+	putFourcc(h + 12, "LIST");
+	put32(h + 16, 192);
+	putFourcc(h + 20, "hdrl");
+
+	putFourcc(h + 24, "avih");
+	put32(h + 28, 56);
+	put32(h + 32, rec->period_us);
+	put32(h + 36, rec->period_us ? (uint64_t)rec->max_chunk * 1000000 / rec->period_us : 0);
+	put32(h + 44, 0x10);                //AVIF_HASINDEX
+	put32(h + 48, frames);
+	put32(h + 56, 1);                   //streams
+	put32(h + 60, rec->max_chunk);
+	put32(h + 64, rec->width);
+	put32(h + 68, rec->height);
+
+	putFourcc(h + 88, "LIST");
+	put32(h + 92, 116);
+	putFourcc(h + 96, "strl");
+
+	putFourcc(h + 100, "strh");
+	put32(h + 104, 56);
+	putFourcc(h + 108, "vids");
+	putFourcc(h + 112, mjpeg ? "MJPG" : "YUY2");
+	put32(h + 128, rec->period_us);     //scale
+	put32(h + 132, 1000000);            //rate, frames per second is rate / scale
+	put32(h + 140, frames);
+	put32(h + 144, rec->max_chunk);
+	put32(h + 148, 0xFFFFFFFF);         //quality
+	put16(h + 160, rec->width);
+	put16(h + 162, rec->height);
+
+	putFourcc(h + 164, "strf");
+	put32(h + 168, 40);
+	put32(h + 172, 40);                 //BITMAPINFOHEADER
+	put32(h + 176, rec->width);
+	put32(h + 180, rec->height);
+	put16(h + 184, 1);
+	put16(h + 186, mjpeg ? 24 : 16);
+	putFourcc(h + 188, mjpeg ? "MJPG" : "YUY2");
+	put32(h + 192, rec->width * rec->height * (mjpeg ? 3 : 2));
+
+	putFourcc(h + 212, "LIST");
+	put32(h + 216, movi_end - REC_AVI_MOVI);
+	putFourcc(h + 220, "movi");
+}
+
+static int aviFrame(v4l2_rec_t* rec, const v4l2_frame_t* frame)
+{
+	static const uint8_t pad = 0;
+	struct iovec iov[REC_IOV];
+	uint8_t h[8];
+	uint64_t at = rec->offset;
+	size_t size;
+	int n = 1;
+
+	size = framePayload(frame, iov, &n);
+	if (at + 8 + size + 1 + (rec->n_index + 1) * 16 + 8 > REC_AVI_LIMIT) {
+		if (!rec->full)
+			log_warn("AVI recording reached 4 GB, dropping further frames");
+		rec->full = 1;
+		return -1;
+	}
+
+	putFourcc(h, "00dc");
+	put32(h + 4, size);
+	iov[0].iov_base = h;
+	iov[0].iov_len = sizeof(h);
+	if (size & 1) {
+		iov[n].iov_base = (void*)&pad;
+		iov[n++].iov_len = 1;
+	}
+	if (indexAdd(rec, at - REC_AVI_MOVI, size, 0) < 0)
+		return -1;
+	if (recWritev(rec, iov, n) < 0) {
+		rec->n_index--;
+		return -1;
+	}
+	if (size > rec->max_chunk)
+		rec->max_chunk = size;
+	__atomic_add_fetch(&rec->bytes, size, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static int aviClose(v4l2_rec_t* rec)
+{
+	uint8_t h[REC_AVI_HEADER];
+	uint8_t* idx;
+	size_t i;
+	int r = 0;
+
+	if (rec->n_index) {
+		idx = malloc(8 + rec->n_index * 16);
+		if (!idx) {
+			log_error("Out of memory");
+			return -1;
+		}
+		putFourcc(idx, "idx1");
+		put32(idx + 4, rec->n_index * 16);
+		for (i = 0; i < rec->n_index; ++i) {
+			uint8_t* e = idx + 8 + i * 16;
+
+			putFourcc(e, "00dc");
+			put32(e + 4, 0x10);         //AVIIF_KEYFRAME
+			put32(e + 8, rec->index[i].offset);
+			put32(e + 12, rec->index[i].size);
+		}
+		/* aviHeader counts the index in the RIFF size, so size it before writing it. */
+		aviHeader(rec, h);
+		r = recWrite(rec, idx, 8 + rec->n_index * 16);
+		free(idx);
+	} else {
+		aviHeader(rec, h);
+	}
+	return r < 0 ? -1 : recPatch(rec, 0, h, sizeof(h));
+}
+
+static void mkvPut(RecBuf* b, uint64_t v, int len)
+{
+	while (len--)
+		b->p[b->len++] = v >> (8 * len);
+}
+
+static int mkvLen(uint64_t v)
+{
+	int len = 1;
+
+	while (len < 8 && v >> (8 * len))
+		++len;
+	return len;
+}
+
+static void mkvId(RecBuf* b, uint32_t id)
+{
+	mkvPut(b, id, mkvLen(id));
+}
+
+/**
+	EBML variable size integer in len bytes
+*/
+static void mkvSize(RecBuf* b, uint64_t size, int len)
+{
+	mkvPut(b, size | (1ull << (7 * len)), len);
+}
+
+static void mkvUint(RecBuf* b, uint32_t id, uint64_t v)
+{
+	int len = mkvLen(v);
+
+	mkvId(b, id);
+	mkvSize(b, len, 1);
+	mkvPut(b, v, len);
+}
+
+static void mkvStr(RecBuf* b, uint32_t id, const char* s)
+{
+	size_t len = strlen(s);
+
+	mkvId(b, id);
+	mkvSize(b, len, 1);
+	memcpy(b->p + b->len, s, len);
+	b->len += len;
+}
+
+static void mkvFloat(RecBuf* b, uint32_t id, double v)
+{
+	uint64_t bits;
+
+	memcpy(&bits, &v, sizeof(bits));
+	mkvId(b, id);
+	mkvSize(b, 8, 1);
+	mkvPut(b, bits, 8);
+}
+
+/**
+	open a master element with a size to fill in by mkvEnd
+*/
+static size_t mkvBegin(RecBuf* b, uint32_t id)
+{
+	mkvId(b, id);
+	b->len += 8;
+	return b->len;
+}
+
+static void mkvEnd(RecBuf* b, size_t start)
+{
+	size_t end = b->len;
+
+	b->len = start - 8;
+	mkvSize(b, end - start, 8);
+	b->len = end;
+}
+
+static int mkvHeader(v4l2_rec_t* rec)
+{
+	uint8_t h[REC_MKV_HEADER];
+	RecBuf b = { h, 0 };
+	size_t m, seek, track, video;
+	uint64_t cues_at;
+
+	m = mkvBegin(&b, MKV_EBML);
+	mkvUint(&b, 0x4286, 1);             //EBMLVersion
+	mkvUint(&b, 0x42F7, 1);             //EBMLReadVersion
+	mkvUint(&b, 0x42F2, 4);             //EBMLMaxIDLength
+	mkvUint(&b, 0x42F3, 8);             //EBMLMaxSizeLength
+	mkvStr(&b, 0x4282, "matroska");     //DocType
+	mkvUint(&b, 0x4287, 4);             //DocTypeVersion
+	mkvUint(&b, 0x4285, 2);             //DocTypeReadVersion
+	mkvEnd(&b, m);
+
+	/* Unknown size until close, in case close never comes. */
+	mkvId(&b, MKV_SEGMENT);
+	mkvPut(&b, 0x01FFFFFFFFFFFFFFull, 8);
+	rec->segment = b.len;
+
+	m = mkvBegin(&b, MKV_SEEKHEAD);
+	seek = mkvBegin(&b, MKV_SEEK);
+	mkvId(&b, MKV_SEEKID);
+	mkvSize(&b, 4, 1);
+	mkvPut(&b, MKV_CUES, 4);
+	mkvId(&b, MKV_SEEKPOS);
+	mkvSize(&b, 8, 1);
+	cues_at = b.len;
+	mkvPut(&b, 0, 8);
+	mkvEnd(&b, seek);
+	mkvEnd(&b, m);
+
+	m = mkvBegin(&b, MKV_INFO);
+	mkvUint(&b, MKV_TIMESCALE, 1000000);    //timestamps in ms
+	mkvStr(&b, MKV_MUXINGAPP, "v4l2helper");
+	mkvStr(&b, MKV_WRITINGAPP, "v4l2helper");
+	rec->duration_at = b.len + 3;
+	mkvFloat(&b, MKV_DURATION, 0);
+	mkvEnd(&b, m);
+
+	m = mkvBegin(&b, MKV_TRACKS);
+	track = mkvBegin(&b, MKV_TRACKENTRY);
+	mkvUint(&b, 0xD7, 1);               //TrackNumber
+	mkvUint(&b, 0x73C5, 1);             //TrackUID
+	mkvUint(&b, 0x83, 1);               //TrackType video
+	mkvUint(&b, 0x9C, 0);               //FlagLacing
+	mkvUint(&b, 0x23E383, rec->period_us * 1000ull);   //DefaultDuration, ns
+	mkvStr(&b, 0x86, V4L2_PIX_FMT_MJPEG == rec->fourcc ? "V_MJPEG" : "V_UNCOMPRESSED");
+	video = mkvBegin(&b, 0xE0);
+	mkvUint(&b, 0xB0, rec->width);      //PixelWidth
+	mkvUint(&b, 0xBA, rec->height);     //PixelHeight
+	if (V4L2_PIX_FMT_YUYV == rec->fourcc) {
+		mkvId(&b, 0x2EB524);            //ColourSpace
+		mkvSize(&b, 4, 1);
+		memcpy(b.p + b.len, "YUY2", 4);
+		b.len += 4;
+	}
+	mkvEnd(&b, video);
+	mkvEnd(&b, track);
+	mkvEnd(&b, m);
+
+	rec->cues_at = cues_at;
+	return recWrite(rec, h, b.len);
+}
+
+static int mkvClusterEnd(v4l2_rec_t* rec)
+{
+	uint8_t s[8];
+	RecBuf b = { s, 0 };
+
+	if (!rec->cluster)
+		return 0;
+	/* The size field follows the 4 byte cluster id. */
+	mkvSize(&b, rec->offset - (rec->cluster + 4 + 8), 8);
+	if (recPatch(rec, rec->cluster + 4, s, 8) < 0)
+		return -1;
+	rec->cluster = 0;
+	return 0;
+}
+
+static int mkvFrame(v4l2_rec_t* rec, const v4l2_frame_t* frame)
+{
+	struct iovec iov[REC_IOV];
+	uint8_t h[64];
+	RecBuf b = { h, 0 };
+	uint64_t ms = (frameUs(frame) - rec->first_us) / 1000;
+	size_t size;
+	int n = 1;
+
+	size = framePayload(frame, iov, &n);
+
+	if (!rec->cluster || ms - rec->cluster_ms >= REC_MKV_CLUSTER) {
+		if (mkvClusterEnd(rec) < 0)
+			return -1;
+		if (indexAdd(rec, rec->offset - rec->segment, 0, ms) < 0)
+			return -1;
+		rec->cluster = rec->offset;
+		rec->cluster_ms = ms;
+		mkvBegin(&b, MKV_CLUSTER);
+		mkvUint(&b, MKV_TIMESTAMP, ms);
+	}
+
+	mkvId(&b, MKV_SIMPLEBLOCK);
+	mkvSize(&b, 4 + size, 4);
+	mkvSize(&b, 1, 1);                  //track
+	mkvPut(&b, ms - rec->cluster_ms, 2);
+	mkvPut(&b, 0x80, 1);                //keyframe
+	iov[0].iov_base = h;
+	iov[0].iov_len = b.len;
+	if (recWritev(rec, iov, n) < 0)
+		return -1;
+	__atomic_add_fetch(&rec->bytes, size, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static int mkvClose(v4l2_rec_t* rec)
+{
+	uint8_t s[8];
+	RecBuf b = { s, 0 };
+	RecBuf cues;
+	uint64_t cues_pos, bits;
+	double duration;
+	size_t i, m, point, pos;
+	int r;
+
+	if (mkvClusterEnd(rec) < 0)
+		return -1;
+
+	cues.p = malloc(16 + rec->n_index * 48);
+	if (!cues.p) {
+		log_error("Out of memory");
+		return -1;
+	}
+	cues.len = 0;
+	m = mkvBegin(&cues, MKV_CUES);
+	for (i = 0; i < rec->n_index; ++i) {
+		point = mkvBegin(&cues, MKV_CUEPOINT);
+		mkvUint(&cues, MKV_CUETIME, rec->index[i].time_ms);
+		pos = mkvBegin(&cues, MKV_CUEPOSITIONS);
+		mkvUint(&cues, MKV_CUETRACK, 1);
+		mkvUint(&cues, MKV_CUECLUSTER, rec->index[i].offset);
+		mkvEnd(&cues, pos);
+		mkvEnd(&cues, point);
+	}
+	mkvEnd(&cues, m);
+	cues_pos = rec->offset - rec->segment;
+	r = recWrite(rec, cues.p, cues.len);
+	free(cues.p);
+	if (r < 0)
+		return -1;
+
+	mkvPut(&b, cues_pos, 8);
+	if (recPatch(rec, rec->cues_at, s, 8) < 0)
+		return -1;
+
+	duration = rec->frames ? (rec->last_us - rec->first_us + rec->period_us) / 1000.0 : 0;
+	memcpy(&bits, &duration, sizeof(bits));
+	b.len = 0;
+	mkvPut(&b, bits, 8);
+	if (recPatch(rec, rec->duration_at, s, 8) < 0)
+		return -1;
+
+	b.len = 0;
+	mkvSize(&b, rec->offset - rec->segment, 8);
+	return recPatch(rec, rec->segment - 8, s, 8);
+}
+
+static void* recWriter(void* arg)
+{
+	v4l2_rec_t* rec = arg;
+	const v4l2_frame_t* frame;
+	int r;
+
+	while ((frame = v4l2ring_pop(rec->ring, -1))) {
+		if (!rec->started) {
+			rec->first_us = frameUs(frame);
+			rec->started = 1;
+		}
+		r = rec->full ? -1 : REC_AVI == rec->container ? aviFrame(rec, frame) : mkvFrame(rec, frame);
+		if (r < 0) {
+			__atomic_add_fetch(&rec->errors, 1, __ATOMIC_RELAXED);
+		} else {
+			rec->last_us = frameUs(frame);
+			__atomic_add_fetch(&rec->frames, 1, __ATOMIC_RELAXED);
+		}
+		v4l2core_frame_release(frame);
+	}
+	return NULL;
+}
+
+/**
+	nominal frame period from the device, the measured one replaces it on close
+*/
+static uint32_t devPeriod(v4l2_dev_t* vd)
+{
+	struct v4l2_streamparm parm;
+	const struct v4l2_fract* tpf = &parm.parm.capture.timeperframe;
+
+	CLEAR(parm);
+	parm.type = vd->buf_type;
+	if (-1 == v4l2core_ioctl(vd, VIDIOC_G_PARM, &parm) || !tpf->numerator || !tpf->denominator)
+		return 1000000 / REC_DEFAULT_FPS;
+	return (uint64_t)tpf->numerator * 1000000 / tpf->denominator;
+}
+
+/**
+	start recording vd's frames to path; call after capture_init, the format
+	is taken from the buffers the driver settled on
+*/
+v4l2_rec_t* v4l2rec_open(v4l2_dev_t* vd, const char* path, rec_container container, unsigned int depth)
+{
+	uint8_t h[REC_AVI_HEADER];
+	v4l2_rec_t* rec;
+	uint32_t fourcc = vd->fmtack.fmt.pix.pixelformat;
+	int r;
+
+	if (vd->io == IO_METHOD_READ || vd->n_planes != 1
+	 || (fourcc != V4L2_PIX_FMT_MJPEG && fourcc != V4L2_PIX_FMT_YUYV)) {
+		log_error("%s: recording needs MJPEG or YUYV over streaming i/o", vd->deviceName);
+		return NULL;
+	}
+
+	rec = calloc(1, sizeof(v4l2_rec_t));
+	if (!rec) {
+		log_error("Out of memory");
+		return NULL;
+	}
+	rec->vd = vd;
+	rec->container = container;
+	rec->fourcc = fourcc;
+	rec->width = vd->fmtack.fmt.pix.width;
+	rec->height = vd->fmtack.fmt.pix.height;
+	rec->period_us = devPeriod(vd);
+
+	rec->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (-1 == rec->fd) {
+		log_error("Cannot open '%s': %d, %s", path, errno, strerror(errno));
+		free(rec);
+		return NULL;
+	}
+
+	if (REC_AVI == container) {
+		aviHeader(rec, h);
+		r = recWrite(rec, h, sizeof(h));
+	} else {
+		r = mkvHeader(rec);
+	}
+	if (r < 0)
+		goto fail;
+
+	/* Drop what the writer can't keep up with instead of holding up capture. */
+	rec->ring = v4l2ring_create(depth, RING_MODE_SPSC, RING_OVERFLOW_DROP_NEWEST, RING_WAIT_FUTEX);
+	if (!rec->ring)
+		goto fail;
+	if (pthread_create(&rec->writer, NULL, recWriter, rec)) {
+		log_error("%s: can't create the recorder thread", vd->deviceName);
+		goto fail;
+	}
+	if (v4l2core_subscribe(vd, rec->ring) < 0) {
+		v4l2ring_close(rec->ring);
+		pthread_join(rec->writer, NULL);
+		goto fail;
+	}
+	log_info("%s: recording %ux%u to %s", vd->deviceName, rec->width, rec->height, path);
+	return rec;
+
+fail:
+	if (rec->ring)
+		v4l2ring_destroy(rec->ring);
+	close(rec->fd);
+	unlink(path);
+	free(rec);
+	return NULL;
+}
+
+/**
+	stop recording, write the pending frames and the index, and close the file;
+	call before capture_uninit, the queued frames hold leases on its buffers
+*/
+int v4l2rec_close(v4l2_rec_t* rec)
+{
+	int r;
+
+	if (!rec)
+		return 0;
+
+	v4l2core_unsubscribe(rec->vd, rec->ring);
+	v4l2ring_close(rec->ring);
+	pthread_join(rec->writer, NULL);
+
+	if (rec->frames > 1)
+		rec->period_us = (rec->last_us - rec->first_us) / (rec->frames - 1);
+	r = REC_AVI == rec->container ? aviClose(rec) : mkvClose(rec);
+	if (-1 == close(rec->fd)) {
+		log_errno("close");
+		r = -1;
+	}
+	log_info("recorded %" PRIu64 " frames, %" PRIu64 " bytes", rec->frames, rec->bytes);
+
+	v4l2ring_destroy(rec->ring);
+	free(rec->index);
+	free(rec);
+	return r;
+}
+
+void v4l2rec_stats(v4l2_rec_t* rec, RecStats* stats)
+{
+	FrameRingStats rs;
+
+	v4l2ring_stats(rec->ring, &rs);
+	stats->frames = __atomic_load_n(&rec->frames, __ATOMIC_RELAXED);
+	stats->bytes = __atomic_load_n(&rec->bytes, __ATOMIC_RELAXED);
+	stats->dropped = rs.dropped;
+	stats->errors = __atomic_load_n(&rec->errors, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,41 @@
+#ifndef V4L2REC_H_INCLUDED
+#define V4L2REC_H_INCLUDED
+#include "v4l2core.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+    Records a device's frames to a file on a writer thread of its own.
+    The recorder subscribes to the device and takes a lease on every frame;
+    the writer gathers the container headers and the capture buffers into
+    one writev, so the capture thread never copies or touches the disk.
+    A writer that falls more than depth frames behind drops frames rather
+    than stall capture.  MJPEG and YUYV, streaming i/o only.
+*/
+typedef enum rec_container{
+    REC_AVI,    //RIFF AVI with an idx1 index, stops at 4 GB
+    REC_MKV,    //Matroska, a cluster per second and cues to seek by
+}rec_container;
+
+typedef struct RecStats{
+    uint64_t frames;    //frames written
+    uint64_t bytes;     //payload bytes written
+    uint64_t dropped;   //frames the writer fell too far behind for
+    uint64_t errors;    //failed writes and frames past the container's limit
+}RecStats;
+
+typedef struct v4l2_rec_t v4l2_rec_t;
+
+v4l2_rec_t* v4l2rec_open(v4l2_dev_t* vd, const char* path, rec_container container, unsigned int depth);
+
+int v4l2rec_close(v4l2_rec_t* rec);
+
+void v4l2rec_stats(v4l2_rec_t* rec, RecStats* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // V4L2REC_H_INCLUDED
@@ -0,0 +1,454 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <string.h>
+#include <assert.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/futex.h>
+#include "v4l2ring.h"
+#include "v4l2log.h"
+
+#define RING_CACHELINE  64
+#define RING_SPINS      1024    //spins between clock checks and yields
+
+/*
+    Bounded MPMC queue after Vyukov: every slot carries a sequence number
+    telling producers and consumers whose turn it is, so head and tail
+    never have to be read together.  Producer, consumer and wakeup state
+    each sit on their own cache line.
+*/
+typedef struct RingSlot{
+    uint64_t            seq;
+    const v4l2_frame_t* frame;
+}RingSlot;
+
+struct v4l2_ring_t{
+    RingSlot*       slots;
+    uint64_t        mask;
+    uint64_t        depth;      //frames held at most, below mask + 1 when depth isn't a power of two
+    ring_mode       mode;
+    ring_overflow   overflow;
+    ring_wait       wait;
+    int             efd;
+
+    uint64_t tail       __attribute__((aligned(RING_CACHELINE)));
+    uint64_t pushed;
+    uint64_t dropped;
+
+    uint64_t head       __attribute__((aligned(RING_CACHELINE)));
+    uint64_t popped;
+
+    uint32_t items      __attribute__((aligned(RING_CACHELINE)));   //futex word, bumped on push
+    uint32_t item_waiters;
+    uint32_t space;                                                 //futex word, bumped on pop
+    uint32_t space_waiters;
+    uint8_t  closed;
+};
+
+static void cpuRelax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+static uint64_t ringNow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+	nanoseconds left until deadline, 0 when it has passed, UINT64_MAX for no deadline
+*/
+static uint64_t ringRemaining(uint64_t deadline)
+{
+	uint64_t now;
+
+	if (UINT64_MAX == deadline)
+		return UINT64_MAX;
+	now = ringNow();
+	return now < deadline ? deadline - now : 0;
+}
+
+static uint64_t ringDeadline(int timeout_ms)
+{
+	if (timeout_ms < 0)
+		return UINT64_MAX;
+	return ringNow() + (uint64_t)timeout_ms * 1000000ull;
+}
+
+static void futexWait(uint32_t* word, uint32_t val, uint64_t ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ns / 1000000000ull;
+	ts.tv_nsec = ns % 1000000000ull;
+	syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, val, UINT64_MAX == ns ? NULL : &ts, NULL, 0);
+}
+
+static void futexWake(uint32_t* word, int n)
+{
+	syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+static void eventSignal(v4l2_ring_t* ring)
+{
+	uint64_t v = 1;
+
+	if (write(ring->efd, &v, sizeof(v)) != sizeof(v) && EAGAIN != errno)
+		log_errno("ring eventfd");
+}
+
+static int ringEnqueue(v4l2_ring_t* ring, const v4l2_frame_t* frame)
+{
+	uint64_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	RingSlot* slot;
+	int64_t diff;
+
+	for (;;) {
+		slot = &ring->slots[pos & ring->mask];
+		diff = (int64_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+		if (0 == diff) {
+			if (RING_MODE_SPSC == ring->mode) {
+				__atomic_store_n(&ring->tail, pos + 1, __ATOMIC_RELAXED);
+				break;
+			}
+			if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return -1;
+		} else {
+			pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->frame = frame;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/**
+	enqueue unless depth frames are queued already; only rings whose depth
+	isn't a power of two read the consumer's head here
+*/
+static int ringPut(v4l2_ring_t* ring, const v4l2_frame_t* frame)
+{
+	if (ring->depth <= ring->mask &&
+		__atomic_load_n(&ring->tail, __ATOMIC_RELAXED) - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) >= ring->depth)
+		return -1;
+	return ringEnqueue(ring, frame);
+}
+
+/* Consumers always claim with compare-and-swap: a drop-oldest producer
+   evicts from the head too. */
+static const v4l2_frame_t* ringDequeue(v4l2_ring_t* ring)
+{
+	uint64_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	const v4l2_frame_t* frame;
+	RingSlot* slot;
+	int64_t diff;
+
+	for (;;) {
+		slot = &ring->slots[pos & ring->mask];
+		diff = (int64_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+		if (0 == diff) {
+			if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return NULL;
+		} else {
+			pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+		}
+	}
+
+	frame = slot->frame;
+	__atomic_store_n(&slot->seq, pos + ring->mask + 1, __ATOMIC_RELEASE);
+
+	/* Let a producer blocked on a full ring retry. */
+	if (RING_OVERFLOW_BLOCK == ring->overflow && RING_WAIT_SPIN != ring->wait) {
+		__atomic_add_fetch(&ring->space, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&ring->space_waiters, __ATOMIC_SEQ_CST))
+			futexWake(&ring->space, 1);
+	}
+	return frame;
+}
+
+static int ringEmpty(v4l2_ring_t* ring)
+{
+	return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+}
+
+/**
+	keep the eventfd readable exactly while frames are queued or the ring is closed:
+	clear it once the ring ran empty and look again, a push racing with the clear
+	is seen or signals anew
+*/
+static void eventSettle(v4l2_ring_t* ring)
+{
+	uint64_t v;
+
+	if (ringEmpty(ring) && !__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE)) {
+		if (read(ring->efd, &v, sizeof(v)) < 0 && EAGAIN != errno)
+			log_errno("ring eventfd");
+		if (ringEmpty(ring))
+			return;
+	}
+	eventSignal(ring);
+}
+
+/**
+	create a ring of depth frames, the slots rounded up to a power of two
+*/
+v4l2_ring_t* v4l2ring_create(unsigned int depth, ring_mode mode, ring_overflow overflow, ring_wait wait)
+{
+	v4l2_ring_t* ring;
+	uint64_t size = 2, i;
+	void* mem;
+
+	while (size < depth)
+		size <<= 1;
+
+	if (posix_memalign(&mem, RING_CACHELINE, sizeof(v4l2_ring_t))) {
+		log_error("Out of memory");
+		return NULL;
+	}
+	ring = mem;
+	memset(ring, 0, sizeof(v4l2_ring_t));
+	ring->mask = size - 1;
+	ring->depth = depth ? depth : 1;
+	ring->mode = mode;
+	ring->overflow = overflow;
+	ring->wait = wait;
+	ring->efd = -1;
+
+	if (posix_memalign(&mem, RING_CACHELINE, size * sizeof(RingSlot))) {
+		log_error("Out of memory");
+		free(ring);
+		return NULL;
+	}
+	ring->slots = mem;
+	for (i = 0; i < size; ++i) {
+		ring->slots[i].seq = i;
+		ring->slots[i].frame = NULL;
+	}
+
+	if (RING_WAIT_EVENTFD == wait) {
+		ring->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (ring->efd < 0) {
+			log_errno("eventfd");
+			v4l2ring_destroy(ring);
+			return NULL;
+		}
+	}
+	return ring;
+}
+
+/**
+	free the ring and release the leases still queued in it; nobody may use it anymore
+*/
+void v4l2ring_destroy(v4l2_ring_t* ring)
+{
+	const v4l2_frame_t* frame;
+
+	assert(ring != NULL);
+	while ((frame = ringDequeue(ring)) != NULL)
+		v4l2core_frame_release(frame);
+
+	if (ring->efd >= 0)
+		close(ring->efd);
+	free(ring->slots);
+	free(ring);
+}
+
+/**
+	queue a lease on frame, returns 0 if queued and -1 if the frame was dropped
+*/
+int v4l2ring_push(v4l2_ring_t* ring, const v4l2_frame_t* frame)
+{
+	const v4l2_frame_t* old;
+	unsigned int spins = 0;
+	uint32_t space;
+
+	if (__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE))
+		return -1;
+
+	v4l2core_frame_retain(frame);
+	while (ringPut(ring, frame) < 0) {
+		switch (ring->overflow) {
+			case RING_OVERFLOW_DROP_OLDEST:
+				old = ringDequeue(ring);
+				if (old) {
+					v4l2core_frame_release(old);
+					__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+				}
+				break;
+			case RING_OVERFLOW_DROP_NEWEST:
+				v4l2core_frame_release(frame);
+				__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+				return -1;
+			case RING_OVERFLOW_BLOCK:
+				if (__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE)) {
+					v4l2core_frame_release(frame);
+					__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+					return -1;
+				}
+				if (RING_WAIT_SPIN == ring->wait) {
+					cpuRelax();
+					if (++spins % RING_SPINS == 0)
+						sched_yield();
+					break;
+				}
+				space = __atomic_load_n(&ring->space, __ATOMIC_SEQ_CST);
+				__atomic_add_fetch(&ring->space_waiters, 1, __ATOMIC_SEQ_CST);
+				if (ringPut(ring, frame) == 0) {
+					__atomic_sub_fetch(&ring->space_waiters, 1, __ATOMIC_SEQ_CST);
+					goto queued;
+				}
+				futexWait(&ring->space, space, UINT64_MAX);
+				__atomic_sub_fetch(&ring->space_waiters, 1, __ATOMIC_SEQ_CST);
+				break;
+		}
+	}
+
+queued:
+	__atomic_add_fetch(&ring->pushed, 1, __ATOMIC_RELAXED);
+	switch (ring->wait) {
+		case RING_WAIT_SPIN:
+			break;
+		case RING_WAIT_FUTEX:
+			__atomic_add_fetch(&ring->items, 1, __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&ring->item_waiters, __ATOMIC_SEQ_CST))
+				futexWake(&ring->items, 1);
+			break;
+		case RING_WAIT_EVENTFD:
+			eventSignal(ring);
+			break;
+	}
+	return 0;
+}
+
+/**
+	take the oldest frame, waiting up to timeout_ms (-1 forever, 0 not at all);
+	returns NULL on timeout or once the ring is closed and empty
+*/
+const v4l2_frame_t* v4l2ring_pop(v4l2_ring_t* ring, int timeout_ms)
+{
+	const v4l2_frame_t* frame;
+	uint64_t deadline = ringDeadline(timeout_ms);
+	uint64_t left, v;
+	unsigned int spins = 0;
+	uint32_t items;
+	struct pollfd pfd;
+
+	for (;;) {
+		frame = ringDequeue(ring);
+		if (frame) {
+			__atomic_add_fetch(&ring->popped, 1, __ATOMIC_RELAXED);
+			/* Pass the wakeup on while frames are left, another consumer may be asleep. */
+			if (RING_WAIT_EVENTFD == ring->wait)
+				eventSettle(ring);
+			return frame;
+		}
+		if (__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE))
+			return NULL;
+
+		switch (ring->wait) {
+			case RING_WAIT_SPIN:
+				cpuRelax();
+				if (++spins % RING_SPINS)
+					continue;
+				if (!ringRemaining(deadline))
+					return NULL;
+				sched_yield();
+				break;
+			case RING_WAIT_FUTEX:
+				items = __atomic_load_n(&ring->items, __ATOMIC_SEQ_CST);
+				__atomic_add_fetch(&ring->item_waiters, 1, __ATOMIC_SEQ_CST);
+				frame = ringDequeue(ring);
+				if (!frame && !__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE)) {
+					left = ringRemaining(deadline);
+					if (left)
+						futexWait(&ring->items, items, left);
+				}
+				__atomic_sub_fetch(&ring->item_waiters, 1, __ATOMIC_SEQ_CST);
+				if (frame) {
+					__atomic_add_fetch(&ring->popped, 1, __ATOMIC_RELAXED);
+					return frame;
+				}
+				if (!ringRemaining(deadline))
+					return NULL;
+				break;
+			case RING_WAIT_EVENTFD:
+				/* Clear the fd before looking again, a push after this sets it anew. */
+				if (read(ring->efd, &v, sizeof(v)) < 0 && EAGAIN != errno)
+					log_errno("ring eventfd");
+				frame = ringDequeue(ring);
+				if (frame) {
+					__atomic_add_fetch(&ring->popped, 1, __ATOMIC_RELAXED);
+					eventSettle(ring);
+					return frame;
+				}
+				left = ringRemaining(deadline);
+				if (!left)
+					return NULL;
+				pfd.fd = ring->efd;
+				pfd.events = POLLIN;
+				pfd.revents = 0;
+				poll(&pfd, 1, UINT64_MAX == left ? -1 : (int)((left + 999999) / 1000000));
+				break;
+		}
+	}
+}
+
+/**
+	stop accepting frames and wake every waiter; pop drains what is left, then returns NULL
+*/
+void v4l2ring_close(v4l2_ring_t* ring)
+{
+	__atomic_store_n(&ring->closed, 1, __ATOMIC_RELEASE);
+
+	__atomic_add_fetch(&ring->items, 1, __ATOMIC_SEQ_CST);
+	futexWake(&ring->items, INT_MAX);
+	__atomic_add_fetch(&ring->space, 1, __ATOMIC_SEQ_CST);
+	futexWake(&ring->space, INT_MAX);
+	if (ring->efd >= 0)
+		eventSignal(ring);
+}
+
+/**
+	the eventfd consumers of a RING_WAIT_EVENTFD ring can poll, -1 for other rings
+*/
+int v4l2ring_fd(v4l2_ring_t* ring)
+{
+	return ring->efd;
+}
+
+ring_overflow v4l2ring_overflow(const v4l2_ring_t* ring)
+{
+	return ring->overflow;
+}
+
+void v4l2ring_stats(v4l2_ring_t* ring, FrameRingStats* stats)
+{
+	uint64_t head, tail;
+
+	stats->pushed = __atomic_load_n(&ring->pushed, __ATOMIC_RELAXED);
+	stats->popped = __atomic_load_n(&ring->popped, __ATOMIC_RELAXED);
+	stats->dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	stats->depth = tail > head ? tail - head : 0;
+}
@@ -0,0 +1,61 @@
+#ifndef V4L2RING_H_INCLUDED
+#define V4L2RING_H_INCLUDED
+#include "v4l2core.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+    Bounded lock-free queue of frame leases between a capture thread and
+    processing threads.  v4l2ring_push takes a lease on the frame, whoever
+    pops it owns that lease and hands it back with v4l2core_frame_release.
+    Frames from IO_METHOD_READ can't be leased and are never queued.
+*/
+typedef enum ring_mode{
+    RING_MODE_SPSC,     //one pushing thread, producer side without compare-and-swap
+    RING_MODE_MPMC,     //any number of pushing and popping threads
+}ring_mode;
+
+typedef enum ring_overflow{
+    RING_OVERFLOW_DROP_OLDEST,  //evict the oldest queued frame
+    RING_OVERFLOW_DROP_NEWEST,  //drop the frame being pushed
+    RING_OVERFLOW_BLOCK,        //wait for a consumer; v4l2core_subscribe refuses these, the capture thread never waits
+}ring_overflow;
+
+typedef enum ring_wait{
+    RING_WAIT_SPIN,     //busy poll, lowest latency, burns a core per waiter
+    RING_WAIT_FUTEX,    //sleep in the kernel, no syscall on push while nobody waits
+    RING_WAIT_EVENTFD,  //consumers wait on v4l2ring_fd, usable from poll/epoll
+}ring_wait;
+
+typedef struct FrameRingStats{
+    uint64_t pushed;
+    uint64_t popped;
+    uint64_t dropped;   //frames dropped or evicted on overflow
+    unsigned int depth; //frames queued right now
+}FrameRingStats;
+
+typedef struct v4l2_ring_t v4l2_ring_t;
+
+v4l2_ring_t* v4l2ring_create(unsigned int depth, ring_mode mode, ring_overflow overflow, ring_wait wait);
+
+void v4l2ring_destroy(v4l2_ring_t* ring);
+
+int v4l2ring_push(v4l2_ring_t* ring, const v4l2_frame_t* frame);
+
+const v4l2_frame_t* v4l2ring_pop(v4l2_ring_t* ring, int timeout_ms);
+
+void v4l2ring_close(v4l2_ring_t* ring);
+
+int v4l2ring_fd(v4l2_ring_t* ring);
+
+ring_overflow v4l2ring_overflow(const v4l2_ring_t* ring);
+
+void v4l2ring_stats(v4l2_ring_t* ring, FrameRingStats* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // V4L2RING_H_INCLUDED
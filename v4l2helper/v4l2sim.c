@@ -0,0 +1,1442 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <assert.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include "v4l2sim.h"
+#include "v4l2idx.h"
+#include "v4l2log.h"
+
+#define SIM_MAX_BUFFERS     VIDIOC_REQBUFS_MAX
+#define SIM_MAX_PLANES      3
+#define SIM_OFFSET_SHIFT    24          //mmap offset of buffer i plane p is i << SIM_OFFSET_SHIFT | p << SIM_PLANE_SHIFT
+#define SIM_PLANE_SHIFT     16
+#define SIM_MAX_TICKS       1024        //frames produced per call at most
+#define SIM_MIN_SIZE        16
+#define SIM_MAX_SIZE        8192
+
+typedef struct SimPlane{
+    uint32_t        length;
+    uint32_t        bytesused;      //of the frame written into it
+    int             memfd;          //MMAP backing store
+    void*           map;            //our view of MMAP and DMABUF memory
+    size_t          map_length;
+    int             map_fd;         //dmabuf that map belongs to
+    unsigned long   userptr;
+}SimPlane;
+
+typedef struct SimBuffer{
+    SimPlane        planes[SIM_MAX_PLANES];
+    uint8_t         queued;
+    struct v4l2_buffer done;        //metadata of the frame written into it
+    const uint8_t*  payload;        //replayed frame handed out in place of the buffer memory, or NULL
+}SimBuffer;
+
+typedef struct SimFrame{
+    size_t      offset;
+    uint32_t    size;
+    uint32_t    flags;
+    uint64_t    timestamp_ns;       //as recorded, never decreasing
+}SimFrame;
+
+typedef struct SimDev{
+    v4l2sim_config_t cfg;
+    struct v4l2_pix_format pix;     //whole frame, also for the multi-planar formats
+    uint32_t    buf_type;
+    unsigned int n_planes;
+    uint32_t    plane_size[SIM_MAX_PLANES];
+    uint32_t    plane_bpl[SIM_MAX_PLANES];
+    struct v4l2_fract tpf;
+    pthread_mutex_t lock;
+
+    int         timerfd;            //frame clock
+    uint64_t    epoch;              //when the clock was armed
+    uint64_t    expired;            //clock ticks consumed since epoch
+    int         readyfd;            //eventfd, set while frames are ready without a tick
+    uint8_t     ready;
+
+    uint8_t     streaming;
+    uint32_t    memory;
+    unsigned int n_buffers;
+    SimBuffer   bufs[SIM_MAX_BUFFERS];
+    unsigned int queue[SIM_MAX_BUFFERS];
+    unsigned int q_head, q_count;
+    unsigned int done[SIM_MAX_BUFFERS];
+    unsigned int d_head, d_count;
+    uint32_t    sequence;
+
+    //test pattern, or key and delta payloads for compressed formats
+    uint8_t*    pattern;
+    uint32_t    pattern_size;
+    uint8_t*    delta;
+    uint32_t    delta_size;
+
+    //replay
+    uint8_t*    file;
+    size_t      file_size;
+    SimFrame*   frames;
+    unsigned int n_frames;
+    unsigned int next_frame;
+    v4l2_idx_t* index;              //of a v4l2idx recording while it is being loaded
+    uint8_t     timed;              //frame seq is due at its recorded time, not on the fps clock
+    uint64_t    span;               //recording length plus a frame, the period a timed replay loops at
+}SimDev;
+
+static uint64_t simNow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int simCompressed(uint32_t pixfmt)
+{
+	return pixfmt == V4L2_PIX_FMT_MJPEG || pixfmt == V4L2_PIX_FMT_H264;
+}
+
+static int simMplane(uint32_t pixfmt)
+{
+	return pixfmt == V4L2_PIX_FMT_NV12M || pixfmt == V4L2_PIX_FMT_YUV420M;
+}
+
+/**
+	fill in line and image sizes, returns -1 for formats we can't generate
+*/
+static int simPixFormat(struct v4l2_pix_format* pix, uint32_t frame_size)
+{
+	pix->width &= ~1u;
+	pix->height &= ~1u;
+	if (pix->width < SIM_MIN_SIZE)
+		pix->width = SIM_MIN_SIZE;
+	if (pix->height < SIM_MIN_SIZE)
+		pix->height = SIM_MIN_SIZE;
+	if (pix->width > SIM_MAX_SIZE)
+		pix->width = SIM_MAX_SIZE;
+	if (pix->height > SIM_MAX_SIZE)
+		pix->height = SIM_MAX_SIZE;
+
+	pix->field = V4L2_FIELD_NONE;
+	pix->colorspace = simCompressed(pix->pixelformat) ? V4L2_COLORSPACE_JPEG : V4L2_COLORSPACE_REC709;
+
+	switch (pix->pixelformat) {
+		case V4L2_PIX_FMT_YUYV:
+		case V4L2_PIX_FMT_UYVY:
+			pix->bytesperline = pix->width * 2;
+			pix->sizeimage = pix->bytesperline * pix->height;
+			break;
+		case V4L2_PIX_FMT_GREY:
+			pix->bytesperline = pix->width;
+			pix->sizeimage = pix->bytesperline * pix->height;
+			break;
+		case V4L2_PIX_FMT_NV12:
+		case V4L2_PIX_FMT_YUV420:
+		case V4L2_PIX_FMT_NV12M:
+		case V4L2_PIX_FMT_YUV420M:
+			pix->bytesperline = pix->width;
+			pix->sizeimage = pix->width * pix->height * 3 / 2;
+			break;
+		case V4L2_PIX_FMT_RGB24:
+		case V4L2_PIX_FMT_BGR24:
+			pix->bytesperline = pix->width * 3;
+			pix->sizeimage = pix->bytesperline * pix->height;
+			break;
+		case V4L2_PIX_FMT_MJPEG:
+			pix->bytesperline = 0;
+			pix->sizeimage = frame_size ? frame_size : pix->width * pix->height / 4;
+			break;
+		case V4L2_PIX_FMT_H264:
+			pix->bytesperline = 0;
+			pix->sizeimage = frame_size ? frame_size : pix->width * pix->height / 6;
+			break;
+		default:
+			return -1;
+	}
+	return 0;
+}
+
+/**
+	split the frame into the memory planes of the active format
+*/
+static void simPlanes(SimDev* sim)
+{
+	const struct v4l2_pix_format* pix = &sim->pix;
+	uint32_t luma = pix->width * pix->height;
+
+	switch (pix->pixelformat) {
+		case V4L2_PIX_FMT_NV12M:
+			sim->n_planes = 2;
+			sim->plane_size[0] = luma;
+			sim->plane_size[1] = luma / 2;
+			sim->plane_bpl[0] = sim->plane_bpl[1] = pix->width;
+			break;
+		case V4L2_PIX_FMT_YUV420M:
+			sim->n_planes = 3;
+			sim->plane_size[0] = luma;
+			sim->plane_size[1] = sim->plane_size[2] = luma / 4;
+			sim->plane_bpl[0] = pix->width;
+			sim->plane_bpl[1] = sim->plane_bpl[2] = pix->width / 2;
+			break;
+		default:
+			sim->n_planes = 1;
+			sim->plane_size[0] = pix->sizeimage;
+			sim->plane_bpl[0] = pix->bytesperline;
+			break;
+	}
+}
+
+static void simToMplane(SimDev* sim, struct v4l2_pix_format_mplane* mp)
+{
+	unsigned int p;
+
+	memset(mp, 0, sizeof(*mp));
+	mp->pixelformat = sim->pix.pixelformat;
+	mp->width = sim->pix.width;
+	mp->height = sim->pix.height;
+	mp->field = sim->pix.field;
+	mp->colorspace = sim->pix.colorspace;
+	mp->num_planes = sim->n_planes;
+	for (p = 0; p < sim->n_planes; ++p) {
+		mp->plane_fmt[p].sizeimage = sim->plane_size[p];
+		mp->plane_fmt[p].bytesperline = sim->plane_bpl[p];
+	}
+}
+
+/**
+	eight vertical colour bars in the active raw format
+*/
+static void simBars(SimDev* sim)
+{
+	static const uint8_t rgb[8][3] = {
+		{ 235, 235, 235 }, { 235, 235, 16 }, { 16, 235, 235 }, { 16, 235, 16 },
+		{ 235, 16, 235 }, { 235, 16, 16 }, { 16, 16, 235 }, { 16, 16, 16 },
+	};
+	const struct v4l2_pix_format* pix = &sim->pix;
+	uint8_t yuv[8][3];
+	uint8_t* p = sim->pattern;
+	uint8_t* uv;
+	unsigned int x, y, b;
+
+	for (b = 0; b < 8; ++b) {
+		int r = rgb[b][0], g = rgb[b][1], bl = rgb[b][2];
+		yuv[b][0] = (uint8_t)((66 * r + 129 * g + 25 * bl + 128) / 256 + 16);
+		yuv[b][1] = (uint8_t)((-38 * r - 74 * g + 112 * bl + 128) / 256 + 128);
+		yuv[b][2] = (uint8_t)((112 * r - 94 * g - 18 * bl + 128) / 256 + 128);
+	}
+
+	for (y = 0; y < pix->height; ++y) {
+		for (x = 0; x < pix->width; ++x) {
+			b = x * 8 / pix->width;
+			switch (pix->pixelformat) {
+				case V4L2_PIX_FMT_YUYV:
+					*p++ = yuv[b][0];
+					*p++ = (x & 1) ? yuv[b][2] : yuv[b][1];
+					break;
+				case V4L2_PIX_FMT_UYVY:
+					*p++ = (x & 1) ? yuv[b][2] : yuv[b][1];
+					*p++ = yuv[b][0];
+					break;
+				case V4L2_PIX_FMT_RGB24:
+					*p++ = rgb[b][0];
+					*p++ = rgb[b][1];
+					*p++ = rgb[b][2];
+					break;
+				case V4L2_PIX_FMT_BGR24:
+					*p++ = rgb[b][2];
+					*p++ = rgb[b][1];
+					*p++ = rgb[b][0];
+					break;
+				default:
+					*p++ = yuv[b][0];
+					break;
+			}
+		}
+	}
+
+	if (pix->pixelformat != V4L2_PIX_FMT_NV12 && pix->pixelformat != V4L2_PIX_FMT_YUV420
+	 && pix->pixelformat != V4L2_PIX_FMT_NV12M && pix->pixelformat != V4L2_PIX_FMT_YUV420M)
+		return;
+
+	uv = sim->pattern + pix->width * pix->height;
+	for (y = 0; y < pix->height / 2; ++y) {
+		for (x = 0; x < pix->width / 2; ++x) {
+			b = x * 16 / pix->width;
+			if (pix->pixelformat == V4L2_PIX_FMT_NV12 || pix->pixelformat == V4L2_PIX_FMT_NV12M) {
+				uv[(y * pix->width / 2 + x) * 2] = yuv[b][1];
+				uv[(y * pix->width / 2 + x) * 2 + 1] = yuv[b][2];
+			} else {
+				uv[y * pix->width / 2 + x] = yuv[b][1];
+				uv[pix->width * pix->height / 4 + y * pix->width / 2 + x] = yuv[b][2];
+			}
+		}
+	}
+}
+
+/**
+	filler for compressed payloads without start code or marker emulation
+*/
+static void simFiller(uint8_t* p, uint32_t len, uint32_t seed)
+{
+	uint32_t i;
+
+	for (i = 0; i < len; ++i) {
+		seed = seed * 1103515245u + 12345u;
+		p[i] = 0x10 + ((seed >> 16) % 0xE0);
+	}
+}
+
+static uint32_t simPut(uint8_t* p, const uint8_t* src, uint32_t len)
+{
+	memcpy(p, src, len);
+	return len;
+}
+
+/**
+	build the frame(s) simFill copies from
+*/
+static int simPattern(SimDev* sim)
+{
+	static const uint8_t jpegHead[] = { 0xFF, 0xD8, 0xFF, 0xE0, 0x00, 0x10, 'J', 'F', 'I', 'F', 0x00,
+		0x01, 0x01, 0x00, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0xFF, 0xDA, 0x00, 0x08 };
+	static const uint8_t h264Sps[] = { 0x00, 0x00, 0x00, 0x01, 0x67, 0x42, 0xC0, 0x28, 0xDA, 0x01, 0xE0, 0x08, 0x9F, 0x96 };
+	static const uint8_t h264Pps[] = { 0x00, 0x00, 0x00, 0x01, 0x68, 0xCE, 0x38, 0x80 };
+	static const uint8_t h264Idr[] = { 0x00, 0x00, 0x00, 0x01, 0x65, 0x88, 0x84 };
+	static const uint8_t h264Slice[] = { 0x00, 0x00, 0x00, 0x01, 0x41, 0x9A, 0x02 };
+	uint32_t n;
+
+	free(sim->pattern);
+	free(sim->delta);
+	sim->pattern = NULL;
+	sim->delta = NULL;
+
+	if (sim->file)
+		return 0;
+
+	sim->pattern_size = sim->pix.sizeimage;
+	sim->pattern = malloc(sim->pattern_size);
+	if (!sim->pattern)
+		return -1;
+
+	switch (sim->pix.pixelformat) {
+		case V4L2_PIX_FMT_MJPEG:
+			n = simPut(sim->pattern, jpegHead, sizeof(jpegHead));
+			simFiller(sim->pattern + n, sim->pattern_size - n - 2, 1);
+			sim->pattern[sim->pattern_size - 2] = 0xFF;
+			sim->pattern[sim->pattern_size - 1] = 0xD9;
+			break;
+		case V4L2_PIX_FMT_H264:
+			n = simPut(sim->pattern, h264Sps, sizeof(h264Sps));
+			n += simPut(sim->pattern + n, h264Pps, sizeof(h264Pps));
+			n += simPut(sim->pattern + n, h264Idr, sizeof(h264Idr));
+			simFiller(sim->pattern + n, sim->pattern_size - n, 1);
+
+			sim->delta_size = sim->pattern_size / 8 > 64 ? sim->pattern_size / 8 : 64;
+			sim->delta = malloc(sim->delta_size);
+			if (!sim->delta)
+				return -1;
+			n = simPut(sim->delta, h264Slice, sizeof(h264Slice));
+			simFiller(sim->delta + n, sim->delta_size - n, 2);
+			break;
+		default:
+			simBars(sim);
+			break;
+	}
+	return 0;
+}
+
+/**
+	pick the payload of frame seq, returns its size
+*/
+static const uint8_t* simSource(SimDev* sim, uint32_t seq, uint32_t* size, uint32_t* flags)
+{
+	const uint8_t* src = sim->pattern;
+	uint32_t gop;
+
+	*size = sim->pattern_size;
+	*flags = 0;
+
+	if (sim->file) {
+		const SimFrame* f = &sim->frames[sim->next_frame];
+
+		/* Timed frames are tied to their sequence, so dropped ones get skipped like live ones. */
+		if (sim->timed)
+			f = &sim->frames[seq % sim->n_frames];
+		else
+			sim->next_frame = (sim->next_frame + 1) % sim->n_frames;
+		src = sim->file + f->offset;
+		*size = f->size;
+		*flags = f->flags;
+	} else if (sim->pix.pixelformat == V4L2_PIX_FMT_H264) {
+		gop = sim->cfg.fps ? sim->cfg.fps : 30;
+		if (seq % gop) {
+			src = sim->delta;
+			*size = sim->delta_size;
+			*flags = V4L2_BUF_FLAG_PFRAME;
+		} else {
+			*flags = V4L2_BUF_FLAG_KEYFRAME;
+		}
+	} else if (sim->pix.pixelformat == V4L2_PIX_FMT_MJPEG) {
+		/* Vary the size a little like a real encoder. */
+		*size -= (seq % 16) * (*size / 64);
+		*flags = V4L2_BUF_FLAG_KEYFRAME;
+	}
+	return src;
+}
+
+/**
+	write frame seq into dst, returns the payload size
+*/
+static uint32_t simFill(SimDev* sim, uint8_t* dst, uint32_t cap, uint32_t seq, uint32_t* flags)
+{
+	uint32_t size;
+	const uint8_t* src = simSource(sim, seq, &size, flags);
+
+	if (size > cap) {
+		size = cap;
+		*flags |= V4L2_BUF_FLAG_ERROR;
+	}
+
+	if (sim->pix.pixelformat == V4L2_PIX_FMT_MJPEG && !sim->file && size >= 4) {
+		memcpy(dst, src, size - 2);
+		dst[size - 2] = 0xFF;
+		dst[size - 1] = 0xD9;
+	} else {
+		memcpy(dst, src, size);
+	}
+
+	/* Stamp raw frames so consumers can tell them apart. */
+	if (!simCompressed(sim->pix.pixelformat) && !sim->file && size >= sizeof(seq))
+		memcpy(dst, &seq, sizeof(seq));
+	return size;
+}
+
+static void* simPlaneData(SimDev* sim, SimPlane* pl)
+{
+	if (sim->memory == V4L2_MEMORY_USERPTR)
+		return (void*)pl->userptr;
+	return pl->map;
+}
+
+/**
+	write frame seq into the planes of b
+*/
+static void simFillBuffer(SimDev* sim, SimBuffer* b, uint32_t seq, uint32_t* flags)
+{
+	/* A dmabuf importer expects the bytes in its buffer, everyone else can read them in place. */
+	int in_place = sim->file && sim->cfg.replay_zero_copy && sim->memory != V4L2_MEMORY_DMABUF;
+	const uint8_t* src;
+	uint32_t size, off = 0, n;
+	unsigned int p;
+
+	b->payload = NULL;
+	if (1 == sim->n_planes && !in_place) {
+		b->planes[0].bytesused = simFill(sim, simPlaneData(sim, &b->planes[0]), b->planes[0].length, seq, flags);
+		return;
+	}
+
+	src = simSource(sim, seq, &size, flags);
+	if (in_place)
+		b->payload = src;
+	for (p = 0; p < sim->n_planes; ++p) {
+		SimPlane* pl = &b->planes[p];
+		uint8_t* dst = simPlaneData(sim, pl);
+
+		n = sim->plane_size[p];
+		if (off + n > size)
+			n = off < size ? size - off : 0;
+		if (n > pl->length) {
+			n = pl->length;
+			*flags |= V4L2_BUF_FLAG_ERROR;
+		}
+		if (!in_place)
+			memcpy(dst, src + off, n);
+		if (0 == p && !sim->file && n >= sizeof(seq))
+			memcpy(dst, &seq, sizeof(seq));
+		pl->bytesused = n;
+		off += sim->plane_size[p];
+	}
+}
+
+/**
+	keep the ready eventfd in step with what DQBUF or read() would return
+*/
+static void simSignal(SimDev* sim)
+{
+	uint64_t v = 1;
+	int want;
+
+	if (!sim->cfg.fps)
+		want = !sim->streaming || sim->q_count || sim->d_count;
+	else
+		want = sim->d_count > 0;
+
+	if (want && !sim->ready) {
+		if (write(sim->readyfd, &v, sizeof(v)) == sizeof(v))
+			sim->ready = 1;
+	} else if (!want && sim->ready) {
+		if (read(sim->readyfd, &v, sizeof(v)) == sizeof(v) || EAGAIN == errno)
+			sim->ready = 0;
+	}
+}
+
+/**
+	when frame seq of a timed replay is due, relative to the epoch
+*/
+static uint64_t simOffset(SimDev* sim, uint64_t seq)
+{
+	return seq / sim->n_frames * sim->span + sim->frames[seq % sim->n_frames].timestamp_ns - sim->frames[0].timestamp_ns;
+}
+
+static uint64_t simDue(SimDev* sim, uint64_t seq)
+{
+	return sim->epoch + simOffset(sim, seq);
+}
+
+/**
+	fire the frame clock once at the monotonic time at
+*/
+static void simArmAt(SimDev* sim, uint64_t at)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = at / 1000000000ull;
+	its.it_value.tv_nsec = at % 1000000000ull;
+	timerfd_settime(sim->timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void simArm(SimDev* sim, int on)
+{
+	struct itimerspec its;
+	uint64_t period;
+
+	if (on && sim->timed) {
+		/* The next frame is due now, the ones after it as recorded. */
+		sim->epoch = simNow() - simOffset(sim, sim->sequence);
+		sim->expired = 0;
+		simArmAt(sim, simDue(sim, sim->sequence));
+		return;
+	}
+
+	memset(&its, 0, sizeof(its));
+	if (on && sim->cfg.fps && sim->tpf.denominator) {
+		period = 1000000000ull * sim->tpf.numerator / sim->tpf.denominator;
+		its.it_interval.tv_sec = period / 1000000000ull;
+		its.it_interval.tv_nsec = period % 1000000000ull;
+		its.it_value = its.it_interval;
+	}
+	sim->epoch = simNow();
+	sim->expired = 0;
+	timerfd_settime(sim->timerfd, 0, &its, NULL);
+}
+
+/**
+	frame clock expirations since the last call
+*/
+static uint64_t simTicks(SimDev* sim)
+{
+	uint64_t ticks = 0, now;
+
+	if (!sim->cfg.fps)
+		return 1;
+	if (sim->timed) {
+		if (read(sim->timerfd, &ticks, sizeof(ticks)) < 0 && EAGAIN != errno)
+			return 0;
+		now = simNow();
+		for (ticks = 0; ticks < SIM_MAX_TICKS && simDue(sim, (uint64_t)sim->sequence + ticks) <= now; ++ticks)
+			;
+		return ticks;
+	}
+	if (read(sim->timerfd, &ticks, sizeof(ticks)) != sizeof(ticks))
+		return 0;
+	return ticks;
+}
+
+/**
+	capture the frames that are due into queued buffers, dropping when none is queued
+*/
+static void simCapture(SimDev* sim)
+{
+	uint64_t ticks, now, period, i;
+
+	if (!sim->streaming)
+		return;
+
+	if (!sim->cfg.fps) {
+		ticks = sim->q_count;
+		period = 0;
+	} else {
+		ticks = simTicks(sim);
+		period = 1000000000ull * sim->tpf.numerator / sim->tpf.denominator;
+		sim->expired += ticks;
+	}
+	if (ticks > SIM_MAX_TICKS) {
+		sim->sequence += ticks - SIM_MAX_TICKS;
+		ticks = SIM_MAX_TICKS;
+	}
+
+	now = simNow();
+	for (i = 0; i < ticks; ++i) {
+		uint32_t seq = sim->sequence++;
+		/* Stamp ticks when they were due, like a sensor would, so late dequeues show as latency. */
+		uint64_t ts = sim->timed ? simDue(sim, seq) : period ? sim->epoch + (sim->expired - ticks + 1 + i) * period : now;
+		unsigned int index;
+		SimBuffer* b;
+		uint32_t flags;
+
+		if (!sim->q_count)
+			continue;
+
+		index = sim->queue[sim->q_head];
+		sim->q_head = (sim->q_head + 1) % SIM_MAX_BUFFERS;
+		sim->q_count--;
+
+		b = &sim->bufs[index];
+		memset(&b->done, 0, sizeof(b->done));
+		simFillBuffer(sim, b, seq, &flags);
+		b->done.bytesused = b->planes[0].bytesused;
+		b->done.flags = flags | V4L2_BUF_FLAG_DONE | V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC | V4L2_BUF_FLAG_TSTAMP_SRC_EOF;
+		b->done.sequence = seq;
+		b->done.field = V4L2_FIELD_NONE;
+		b->done.timestamp.tv_sec = ts / 1000000000ull;
+		b->done.timestamp.tv_usec = (ts % 1000000000ull) / 1000;
+		b->queued = 0;
+
+		sim->done[(sim->d_head + sim->d_count) % SIM_MAX_BUFFERS] = index;
+		sim->d_count++;
+	}
+	if (sim->timed)
+		simArmAt(sim, simDue(sim, sim->sequence));
+}
+
+static void simFreeBuffers(SimDev* sim)
+{
+	unsigned int i, p;
+
+	for (i = 0; i < SIM_MAX_BUFFERS; ++i) {
+		for (p = 0; p < SIM_MAX_PLANES; ++p) {
+			SimPlane* pl = &sim->bufs[i].planes[p];
+
+			if (i < sim->n_buffers && pl->map)
+				munmap(pl->map, pl->map_length);
+			if (i < sim->n_buffers && pl->memfd >= 0)
+				close(pl->memfd);
+		}
+	}
+	memset(sim->bufs, 0, sizeof(sim->bufs));
+	for (i = 0; i < SIM_MAX_BUFFERS; ++i) {
+		for (p = 0; p < SIM_MAX_PLANES; ++p) {
+			sim->bufs[i].planes[p].memfd = -1;
+			sim->bufs[i].planes[p].map_fd = -1;
+		}
+	}
+	sim->n_buffers = 0;
+	sim->q_count = sim->d_count = 0;
+}
+
+static int simAllocBuffers(SimDev* sim, unsigned int count, uint32_t memory, uint32_t length)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	unsigned int i, p;
+
+	if (sim->n_buffers + count > SIM_MAX_BUFFERS)
+		count = SIM_MAX_BUFFERS - sim->n_buffers;
+
+	for (i = sim->n_buffers; i < sim->n_buffers + count; ++i) {
+		for (p = 0; p < sim->n_planes; ++p) {
+			SimPlane* pl = &sim->bufs[i].planes[p];
+
+			pl->length = 1 == sim->n_planes ? length : sim->plane_size[p];
+			if (memory != V4L2_MEMORY_MMAP)
+				continue;
+
+			pl->map_length = (pl->length + page - 1) & ~(page - 1);
+			pl->memfd = memfd_create("v4l2sim", MFD_CLOEXEC);
+			if (pl->memfd < 0 || -1 == ftruncate(pl->memfd, pl->map_length))
+				return -1;
+			pl->map = mmap(NULL, pl->map_length, PROT_READ | PROT_WRITE, MAP_SHARED, pl->memfd, 0);
+			if (MAP_FAILED == pl->map) {
+				pl->map = NULL;
+				return -1;
+			}
+		}
+	}
+	sim->n_buffers += count;
+	sim->memory = memory;
+	return count;
+}
+
+static void simQueryBuf(SimDev* sim, struct v4l2_buffer* buf)
+{
+	SimBuffer* b = &sim->bufs[buf->index];
+	struct v4l2_plane* planes = buf->m.planes;
+	uint32_t index = buf->index;
+	unsigned int p;
+
+	if (!b->queued && b->done.flags & V4L2_BUF_FLAG_DONE)
+		*buf = b->done;
+	else
+		memset(buf, 0, sizeof(*buf));
+
+	buf->index = index;
+	buf->type = sim->buf_type;
+	buf->memory = sim->memory;
+	if (b->queued)
+		buf->flags |= V4L2_BUF_FLAG_QUEUED;
+
+	if (V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE == sim->buf_type) {
+		buf->m.planes = planes;
+		buf->length = sim->n_planes;
+		buf->bytesused = 0;
+		for (p = 0; p < sim->n_planes; ++p) {
+			SimPlane* pl = &b->planes[p];
+
+			memset(&planes[p], 0, sizeof(planes[p]));
+			planes[p].length = pl->length;
+			planes[p].bytesused = b->queued ? 0 : pl->bytesused;
+			switch (sim->memory) {
+				case V4L2_MEMORY_MMAP:
+					planes[p].m.mem_offset = index << SIM_OFFSET_SHIFT | p << SIM_PLANE_SHIFT;
+					break;
+				case V4L2_MEMORY_USERPTR:
+					planes[p].m.userptr = pl->userptr;
+					break;
+				case V4L2_MEMORY_DMABUF:
+					planes[p].m.fd = pl->map_fd;
+					break;
+			}
+		}
+		return;
+	}
+
+	buf->length = b->planes[0].length;
+	switch (sim->memory) {
+		case V4L2_MEMORY_MMAP:
+			buf->m.offset = index << SIM_OFFSET_SHIFT;
+			break;
+		case V4L2_MEMORY_USERPTR:
+			buf->m.userptr = b->planes[0].userptr;
+			break;
+		case V4L2_MEMORY_DMABUF:
+			buf->m.fd = b->planes[0].map_fd;
+			break;
+	}
+}
+
+/**
+	take the memory the application queues plane p with
+*/
+static int simQueuePlane(SimDev* sim, SimPlane* pl, unsigned int p, unsigned long userptr, int fd, uint32_t length)
+{
+	off_t size;
+
+	if (sim->memory == V4L2_MEMORY_USERPTR) {
+		if (!userptr || length < sim->plane_size[p])
+			return EINVAL;
+		pl->userptr = userptr;
+		pl->length = length;
+	} else if (sim->memory == V4L2_MEMORY_DMABUF && fd != pl->map_fd) {
+		size = lseek(fd, 0, SEEK_END);
+		if (size < (off_t)sim->plane_size[p])
+			return EINVAL;
+		if (pl->map)
+			munmap(pl->map, pl->map_length);
+		pl->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (MAP_FAILED == pl->map) {
+			pl->map = NULL;
+			pl->map_fd = -1;
+			return EINVAL;
+		}
+		pl->map_fd = fd;
+		pl->map_length = size;
+		pl->length = size;
+	}
+	return 0;
+}
+
+static int simQueue(SimDev* sim, struct v4l2_buffer* buf)
+{
+	SimBuffer* b;
+	unsigned int p;
+	int err;
+
+	if (buf->type != sim->buf_type || buf->index >= sim->n_buffers || buf->memory != sim->memory)
+		return EINVAL;
+	b = &sim->bufs[buf->index];
+	if (b->queued)
+		return EINVAL;
+
+	if (V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE == sim->buf_type) {
+		if (!buf->m.planes || buf->length < sim->n_planes)
+			return EINVAL;
+		for (p = 0; p < sim->n_planes; ++p) {
+			const struct v4l2_plane* plane = &buf->m.planes[p];
+
+			err = simQueuePlane(sim, &b->planes[p], p, plane->m.userptr, plane->m.fd, plane->length);
+			if (err)
+				return err;
+		}
+	} else {
+		err = simQueuePlane(sim, &b->planes[0], 0, buf->m.userptr, buf->m.fd, buf->length);
+		if (err)
+			return err;
+	}
+
+	b->queued = 1;
+	b->done.flags = 0;
+	sim->queue[(sim->q_head + sim->q_count) % SIM_MAX_BUFFERS] = buf->index;
+	sim->q_count++;
+	return 0;
+}
+
+static int simDequeue(SimDev* sim, struct v4l2_buffer* buf)
+{
+	unsigned int index;
+
+	if (!sim->streaming || buf->type != sim->buf_type || buf->memory != sim->memory)
+		return EINVAL;
+	if (V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE == sim->buf_type && (!buf->m.planes || buf->length < sim->n_planes))
+		return EINVAL;
+
+	simCapture(sim);
+	if (!sim->d_count)
+		return EAGAIN;
+
+	index = sim->done[sim->d_head];
+	sim->d_head = (sim->d_head + 1) % SIM_MAX_BUFFERS;
+	sim->d_count--;
+
+	buf->index = index;
+	simQueryBuf(sim, buf);
+	return 0;
+}
+
+static int simIoctlLocked(SimDev* sim, unsigned long request, void* arg)
+{
+	switch (request) {
+		case VIDIOC_QUERYCAP: {
+			struct v4l2_capability* cap = arg;
+
+			memset(cap, 0, sizeof(*cap));
+			snprintf((char*)cap->driver, sizeof(cap->driver), "v4l2sim");
+			snprintf((char*)cap->card, sizeof(cap->card), "%s", sim->file ? "Replay camera" : "Synthetic camera");
+			snprintf((char*)cap->bus_info, sizeof(cap->bus_info), "platform:v4l2sim");
+			cap->version = 0x060000;
+			if (V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE == sim->buf_type)
+				cap->device_caps = V4L2_CAP_VIDEO_CAPTURE_MPLANE | V4L2_CAP_STREAMING;
+			else
+				cap->device_caps = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_STREAMING | V4L2_CAP_READWRITE;
+			cap->capabilities = cap->device_caps | V4L2_CAP_DEVICE_CAPS;
+			return 0;
+		}
+		case VIDIOC_ENUM_FMT: {
+			struct v4l2_fmtdesc* desc = arg;
+			uint32_t f = sim->pix.pixelformat;
+
+			if (desc->index != 0 || desc->type != sim->buf_type)
+				return EINVAL;
+			desc->pixelformat = f;
+			desc->flags = simCompressed(f) ? V4L2_FMT_FLAG_COMPRESSED : 0;
+			snprintf((char*)desc->description, sizeof(desc->description), "%c%c%c%c (simulated)",
+				f & 0xFF, (f >> 8) & 0xFF, (f >> 16) & 0xFF, (f >> 24) & 0xFF);
+			return 0;
+		}
+		case VIDIOC_ENUM_FRAMESIZES: {
+			struct v4l2_frmsizeenum* fs = arg;
+
+			if (fs->index != 0 || fs->pixel_format != sim->pix.pixelformat)
+				return EINVAL;
+			fs->type = V4L2_FRMSIZE_TYPE_DISCRETE;
+			fs->discrete.width = sim->pix.width;
+			fs->discrete.height = sim->pix.height;
+			return 0;
+		}
+		case VIDIOC_G_FMT: {
+			struct v4l2_format* fmt = arg;
+
+			if (fmt->type != sim->buf_type)
+				return EINVAL;
+			if (V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE == sim->buf_type)
+				simToMplane(sim, &fmt->fmt.pix_mp);
+			else
+				fmt->fmt.pix = sim->pix;
+			return 0;
+		}
+		case VIDIOC_TRY_FMT:
+		case VIDIOC_S_FMT: {
+			struct v4l2_format* fmt = arg;
+			struct v4l2_pix_format pix = fmt->fmt.pix;
+			SimDev tried;
+
+			if (fmt->type != sim->buf_type)
+				return EINVAL;
+			if (V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE == sim->buf_type) {
+				memset(&pix, 0, sizeof(pix));
+				pix.pixelformat = fmt->fmt.pix_mp.pixelformat;
+				pix.width = fmt->fmt.pix_mp.width;
+				pix.height = fmt->fmt.pix_mp.height;
+			}
+			/* A replay has the format it was recorded in, and the
+			   memory layout can't change between single and multi-planar. */
+			if (sim->file || simPixFormat(&pix, sim->cfg.frame_size) < 0
+			 || simMplane(pix.pixelformat) != (V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE == sim->buf_type))
+				pix = sim->pix;
+			if (V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE == sim->buf_type) {
+				tried.pix = pix;
+				simPlanes(&tried);
+				simToMplane(&tried, &fmt->fmt.pix_mp);
+			} else {
+				fmt->fmt.pix = pix;
+			}
+			if (request == VIDIOC_TRY_FMT)
+				return 0;
+			if (sim->n_buffers)
+				return EBUSY;
+			sim->pix = pix;
+			simPlanes(sim);
+			return simPattern(sim) < 0 ? ENOMEM : 0;
+		}
+		case VIDIOC_G_PARM:
+		case VIDIOC_S_PARM: {
+			struct v4l2_streamparm* parm = arg;
+			struct v4l2_fract* tpf = &parm->parm.capture.timeperframe;
+
+			if (parm->type != sim->buf_type)
+				return EINVAL;
+			if (request == VIDIOC_S_PARM && sim->cfg.fps && !sim->timed && tpf->numerator && tpf->denominator) {
+				sim->tpf = *tpf;
+				sim->cfg.fps = tpf->denominator / tpf->numerator ? tpf->denominator / tpf->numerator : 1;
+				if (sim->streaming)
+					simArm(sim, 1);
+			}
+			memset(&parm->parm, 0, sizeof(parm->parm));
+			parm->parm.capture.capability = V4L2_CAP_TIMEPERFRAME;
+			parm->parm.capture.timeperframe = sim->tpf;
+			return 0;
+		}
+		case VIDIOC_REQBUFS: {
+			struct v4l2_requestbuffers* req = arg;
+
+			if (req->type != sim->buf_type)
+				return EINVAL;
+			if (req->memory != V4L2_MEMORY_MMAP && req->memory != V4L2_MEMORY_USERPTR && req->memory != V4L2_MEMORY_DMABUF)
+				return EINVAL;
+			if (sim->streaming)
+				return EBUSY;
+
+			simFreeBuffers(sim);
+			req->capabilities = V4L2_BUF_CAP_SUPPORTS_MMAP | V4L2_BUF_CAP_SUPPORTS_USERPTR | V4L2_BUF_CAP_SUPPORTS_DMABUF;
+			if (!req->count)
+				return 0;
+			if (simAllocBuffers(sim, req->count, req->memory, sim->pix.sizeimage) < 0) {
+				simFreeBuffers(sim);
+				return ENOMEM;
+			}
+			req->count = sim->n_buffers;
+			return 0;
+		}
+		case VIDIOC_CREATE_BUFS: {
+			struct v4l2_create_buffers* create = arg;
+			uint32_t length = create->format.fmt.pix.sizeimage;
+			int n;
+
+			if (create->format.type != sim->buf_type)
+				return EINVAL;
+			if (V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE == sim->buf_type)
+				length = 0;     /* planes always get their exact size */
+			if (sim->n_buffers && create->memory != sim->memory)
+				return EINVAL;
+			if (length < sim->pix.sizeimage)
+				length = sim->pix.sizeimage;
+			create->index = sim->n_buffers;
+			n = simAllocBuffers(sim, create->count, create->memory, length);
+			if (n < 0)
+				return ENOMEM;
+			create->count = n;
+			return 0;
+		}
+		case VIDIOC_QUERYBUF: {
+			struct v4l2_buffer* buf = arg;
+
+			if (buf->type != sim->buf_type || buf->index >= sim->n_buffers)
+				return EINVAL;
+			if (V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE == sim->buf_type && (!buf->m.planes || buf->length < sim->n_planes))
+				return EINVAL;
+			simQueryBuf(sim, buf);
+			return 0;
+		}
+		case VIDIOC_QBUF:
+			return simQueue(sim, arg);
+		case VIDIOC_DQBUF:
+			return simDequeue(sim, arg);
+		case VIDIOC_EXPBUF: {
+			struct v4l2_exportbuffer* exp = arg;
+
+			if (sim->memory != V4L2_MEMORY_MMAP || exp->index >= sim->n_buffers || exp->plane >= sim->n_planes)
+				return EINVAL;
+			exp->fd = fcntl(sim->bufs[exp->index].planes[exp->plane].memfd, (exp->flags & O_CLOEXEC) ? F_DUPFD_CLOEXEC : F_DUPFD, 0);
+			return exp->fd < 0 ? errno : 0;
+		}
+		case VIDIOC_STREAMON:
+			if (!sim->n_buffers)
+				return EINVAL;
+			if (!sim->streaming) {
+				sim->streaming = 1;
+				sim->sequence = 0;
+				simArm(sim, 1);
+			}
+			return 0;
+		case VIDIOC_STREAMOFF: {
+			unsigned int i;
+
+			sim->streaming = 0;
+			sim->q_count = sim->d_count = 0;
+			for (i = 0; i < sim->n_buffers; ++i)
+				sim->bufs[i].queued = 0;
+			simArm(sim, 1);     /* keep ticking for read() */
+			return 0;
+		}
+		default:
+			return ENOTTY;
+	}
+}
+
+static int simIoctl(v4l2_dev_t* vd, unsigned long request, void* arg)
+{
+	SimDev* sim = vd->backend_priv;
+	int err;
+
+	pthread_mutex_lock(&sim->lock);
+	err = simIoctlLocked(sim, request, arg);
+	simSignal(sim);
+	pthread_mutex_unlock(&sim->lock);
+
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+static void* simMmap(v4l2_dev_t* vd, size_t length, int prot, int flags, off_t offset)
+{
+	SimDev* sim = vd->backend_priv;
+	unsigned int index = offset >> SIM_OFFSET_SHIFT;
+	unsigned int plane = (offset >> SIM_PLANE_SHIFT) & 0xFF;
+
+	if (index >= sim->n_buffers || plane >= sim->n_planes || sim->bufs[index].planes[plane].memfd < 0) {
+		errno = EINVAL;
+		return MAP_FAILED;
+	}
+	return mmap(NULL, length, prot, flags, sim->bufs[index].planes[plane].memfd, 0);
+}
+
+static int simMunmap(v4l2_dev_t* vd, void* start, size_t length)
+{
+	return munmap(start, length);
+}
+
+static ssize_t simRead(v4l2_dev_t* vd, void* buf, size_t count)
+{
+	SimDev* sim = vd->backend_priv;
+	uint64_t ticks;
+	uint32_t flags, size;
+
+	pthread_mutex_lock(&sim->lock);
+	if (sim->streaming || V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE == sim->buf_type) {
+		pthread_mutex_unlock(&sim->lock);
+		errno = EBUSY;
+		return -1;
+	}
+
+	ticks = simTicks(sim);
+	if (!ticks) {
+		pthread_mutex_unlock(&sim->lock);
+		errno = EAGAIN;
+		return -1;
+	}
+
+	/* Frames that came and went since the last read are lost. */
+	sim->sequence += ticks - 1;
+	size = simFill(sim, buf, count, sim->sequence++, &flags);
+	if (sim->timed)
+		simArmAt(sim, simDue(sim, sim->sequence));
+	simSignal(sim);
+	pthread_mutex_unlock(&sim->lock);
+	return size;
+}
+
+static int simWait(v4l2_dev_t* vd, int timeout_ms)
+{
+	struct pollfd pfd;
+
+	pfd.fd = vd->fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	return poll(&pfd, 1, timeout_ms);
+}
+
+static void simClose(v4l2_dev_t* vd)
+{
+	SimDev* sim = vd->backend_priv;
+
+	if (!sim)
+		return;
+
+	simFreeBuffers(sim);
+	if (vd->fd >= 0)
+		close(vd->fd);
+	if (sim->timerfd >= 0)
+		close(sim->timerfd);
+	if (sim->readyfd >= 0)
+		close(sim->readyfd);
+	if (sim->file)
+		munmap(sim->file, sim->file_size);
+	v4l2idx_close(sim->index);
+	free(sim->frames);
+	free(sim->pattern);
+	free(sim->delta);
+	pthread_mutex_destroy(&sim->lock);
+	free(sim);
+	vd->backend_priv = NULL;
+}
+
+/**
+	a zero-copy replay's frame, straight from the file mapping
+*/
+static void* simPayload(v4l2_dev_t* vd, const struct v4l2_buffer* buf, unsigned int plane)
+{
+	SimDev* sim = vd->backend_priv;
+	const uint8_t* src;
+	unsigned int p;
+
+	if (buf->index >= sim->n_buffers || !sim->bufs[buf->index].payload)
+		return NULL;
+	src = sim->bufs[buf->index].payload;
+	for (p = 0; p < plane; ++p)
+		src += sim->plane_size[p];
+	return (void*)src;
+}
+
+static const v4l2_backend_t simBackend = {
+	.name   = "v4l2sim",
+	.ioctl  = simIoctl,
+	.mmap   = simMmap,
+	.munmap = simMunmap,
+	.read   = simRead,
+	.wait   = simWait,
+	.close  = simClose,
+	.payload = simPayload,
+};
+
+static int simAddFrame(SimDev* sim, unsigned int* cap, size_t offset, size_t size, uint32_t flags)
+{
+	if (!size)
+		return 0;
+	if (sim->n_frames == *cap) {
+		SimFrame* frames = realloc(sim->frames, (*cap ? *cap * 2 : 256) * sizeof(SimFrame));
+		if (!frames)
+			return -1;
+		sim->frames = frames;
+		*cap = *cap ? *cap * 2 : 256;
+	}
+	sim->frames[sim->n_frames].offset = offset;
+	sim->frames[sim->n_frames].size = size;
+	sim->frames[sim->n_frames].flags = flags;
+	sim->n_frames++;
+	return 0;
+}
+
+/**
+	split an Annex-B stream into access units: a new one starts at an
+	AUD, SPS or SEI, or at a slice once the current unit has one
+*/
+static int simIndexH264(SimDev* sim, unsigned int* cap)
+{
+	const uint8_t* p = sim->file;
+	size_t i, start = 0;
+	uint32_t flags = V4L2_BUF_FLAG_PFRAME;
+	int have_slice = 0, open = 0;
+
+	for (i = 0; i + 3 < sim->file_size; ++i) {
+		uint8_t type;
+		size_t nal;
+
+		if (p[i] || p[i + 1] || p[i + 2] != 1)
+			continue;
+
+		nal = (i && !p[i - 1]) ? i - 1 : i;
+		type = p[i + 3] & 0x1F;
+		if (type == 9 || type == 7 || type == 6 || ((type == 1 || type == 5) && have_slice)) {
+			if (open && simAddFrame(sim, cap, start, nal - start, flags) < 0)
+				return -1;
+			start = nal;
+			flags = V4L2_BUF_FLAG_PFRAME;
+			have_slice = 0;
+		}
+		open = 1;
+		if (type == 1 || type == 5)
+			have_slice = 1;
+		if (type == 5)
+			flags = V4L2_BUF_FLAG_KEYFRAME;
+		i += 2;
+	}
+	if (open)
+		return simAddFrame(sim, cap, start, sim->file_size - start, flags);
+	return 0;
+}
+
+static int simIndexJpeg(SimDev* sim, unsigned int* cap)
+{
+	const uint8_t* p = sim->file;
+	size_t i, start = 0;
+	int open = 0;
+
+	for (i = 0; i + 1 < sim->file_size; ++i) {
+		if (p[i] != 0xFF)
+			continue;
+		if (p[i + 1] == 0xD8 && !open) {
+			start = i;
+			open = 1;
+		} else if (p[i + 1] == 0xD9 && open) {
+			if (simAddFrame(sim, cap, start, i + 2 - start, V4L2_BUF_FLAG_KEYFRAME) < 0)
+				return -1;
+			open = 0;
+		}
+	}
+	return 0;
+}
+
+/**
+	take the frames of a v4l2idx recording from its index
+*/
+static int simIndexRecording(SimDev* sim, unsigned int* cap)
+{
+	size_t i, n = v4l2idx_count(sim->index);
+	uint64_t ts = 0;
+
+	for (i = 0; i < n; ++i) {
+		const v4l2_idx_entry_t* e = v4l2idx_entry(sim->index, i);
+
+		if (!e->size || e->offset + e->size > sim->file_size)
+			continue;
+		if (simAddFrame(sim, cap, e->offset, e->size,
+			(e->flags & V4L2IDX_KEYFRAME) ? V4L2_BUF_FLAG_KEYFRAME : V4L2_BUF_FLAG_PFRAME) < 0)
+			return -1;
+		if (e->timestamp_ns > ts)
+			ts = e->timestamp_ns;
+		sim->frames[sim->n_frames - 1].timestamp_ns = ts;
+	}
+	v4l2idx_close(sim->index);
+	sim->index = NULL;
+	return 0;
+}
+
+/**
+	play the frames back at their recorded spacing, and loop one
+	average frame interval after the last
+*/
+static void simReplayTiming(SimDev* sim)
+{
+	uint64_t len = sim->frames[sim->n_frames - 1].timestamp_ns - sim->frames[0].timestamp_ns;
+	uint64_t period = 1000000000ull / sim->cfg.fps;
+
+	if (sim->n_frames > 1 && len)
+		period = len / (sim->n_frames - 1);
+	sim->span = len + period;
+	sim->timed = 1;
+
+	/* Report the average rate, in microseconds per frame. */
+	sim->tpf.numerator = period / 1000 ? period / 1000 : 1;
+	sim->tpf.denominator = 1000000;
+}
+
+/**
+	use the format of a v4l2idx recording, if path is one
+*/
+static int simIndexOpen(SimDev* sim, const char* path)
+{
+	const v4l2_idx_header_t* h;
+	char ipath[PATH_MAX];
+
+	snprintf(ipath, sizeof(ipath), "%s.idx", path);
+	if (access(ipath, F_OK))
+		return 0;
+	sim->index = v4l2idx_open(path);
+	if (!sim->index)
+		return -1;
+	h = v4l2idx_header(sim->index);
+	if (!h->pixelformat) {
+		log_error("%s: no frames found", path);
+		return -1;
+	}
+	sim->cfg.pixelformat = h->pixelformat;
+	sim->cfg.width = h->width;
+	sim->cfg.height = h->height;
+	return 0;
+}
+
+/**
+	map a recorded stream and index its frames
+*/
+static int simReplayOpen(SimDev* sim, const char* path)
+{
+	unsigned int cap = 0;
+	struct stat st;
+	size_t off;
+	int fd, r = 0;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		log_errno(path);
+		return -1;
+	}
+	if (-1 == fstat(fd, &st) || 0 == st.st_size) {
+		log_error("%s: empty replay file", path);
+		close(fd);
+		return -1;
+	}
+	sim->file_size = st.st_size;
+	sim->file = mmap(NULL, sim->file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (MAP_FAILED == sim->file) {
+		sim->file = NULL;
+		log_errno("mmap");
+		return -1;
+	}
+
+	switch (sim->index ? 0 : sim->pix.pixelformat) {
+		case 0:
+			r = simIndexRecording(sim, &cap);
+			break;
+		case V4L2_PIX_FMT_MJPEG:
+			r = simIndexJpeg(sim, &cap);
+			break;
+		case V4L2_PIX_FMT_H264:
+			r = simIndexH264(sim, &cap);
+			break;
+		default:
+			for (off = 0; r == 0 && off + sim->pix.sizeimage <= sim->file_size; off += sim->pix.sizeimage)
+				r = simAddFrame(sim, &cap, off, sim->pix.sizeimage, V4L2_BUF_FLAG_KEYFRAME);
+			break;
+	}
+	if (r < 0 || !sim->n_frames) {
+		log_error("%s: no frames found", path);
+		return -1;
+	}
+
+	/* Buffers must hold the largest recorded frame. */
+	for (off = 0; off < sim->n_frames; ++off)
+		if (sim->frames[off].size > sim->pix.sizeimage)
+			sim->pix.sizeimage = sim->frames[off].size;
+
+	if (sim->cfg.replay_timed && sim->cfg.fps) {
+		if (sim->frames[sim->n_frames - 1].timestamp_ns)
+			simReplayTiming(sim);
+		else
+			log_warn("%s: no recorded timestamps, replaying at %u fps", path, sim->cfg.fps);
+	}
+	return 0;
+}
+
+/**
+	open a simulated camera generating cfg->pixelformat frames, or replaying cfg->replay_path
+*/
+v4l2_dev_t* v4l2sim_open(const v4l2sim_config_t* cfg)
+{
+	struct epoll_event ev;
+	char name[64];
+	v4l2_dev_t* vd;
+	SimDev* sim;
+	unsigned int i, p;
+	int epfd;
+
+	sim = calloc(1, sizeof(SimDev));
+	if (!sim) {
+		log_error("Out of memory");
+		return NULL;
+	}
+	sim->cfg = *cfg;
+	cfg = &sim->cfg;
+	if (cfg->replay_path && simIndexOpen(sim, cfg->replay_path) < 0) {
+		v4l2idx_close(sim->index);
+		free(sim);
+		return NULL;
+	}
+	sim->pix.pixelformat = cfg->pixelformat;
+	sim->pix.width = cfg->width;
+	sim->pix.height = cfg->height;
+	sim->tpf.numerator = 1;
+	sim->tpf.denominator = cfg->fps;
+	sim->timerfd = -1;
+	sim->readyfd = -1;
+	for (i = 0; i < SIM_MAX_BUFFERS; ++i) {
+		for (p = 0; p < SIM_MAX_PLANES; ++p) {
+			sim->bufs[i].planes[p].memfd = -1;
+			sim->bufs[i].planes[p].map_fd = -1;
+		}
+	}
+	sim->buf_type = simMplane(cfg->pixelformat) ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	pthread_mutex_init(&sim->lock, NULL);
+
+	if (cfg->replay_path)
+		snprintf(name, sizeof(name), "replay:%s", cfg->replay_path);
+	else
+		snprintf(name, sizeof(name), "sim:%c%c%c%c", cfg->pixelformat & 0xFF, (cfg->pixelformat >> 8) & 0xFF,
+			(cfg->pixelformat >> 16) & 0xFF, (cfg->pixelformat >> 24) & 0xFF);
+	vd = v4l2core_dev_open_backend(name, &simBackend, sim);
+	vd->buf_type = sim->buf_type;
+
+	if (simPixFormat(&sim->pix, cfg->frame_size) < 0) {
+		log_error("%s: pixel format not simulated", name);
+		goto fail;
+	}
+	if (cfg->replay_path && simReplayOpen(sim, cfg->replay_path) < 0)
+		goto fail;
+	simPlanes(sim);
+	if (simPattern(sim) < 0) {
+		log_error("Out of memory");
+		goto fail;
+	}
+
+	/* vd->fd is an epoll set over the frame clock and the ready flag,
+	   so select, poll and epoll users all see frames arrive. */
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	vd->fd = epfd;
+	sim->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	sim->readyfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (epfd < 0 || sim->timerfd < 0 || sim->readyfd < 0) {
+		log_errno("v4l2sim_open");
+		goto fail;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	if (-1 == epoll_ctl(epfd, EPOLL_CTL_ADD, sim->timerfd, &ev) || -1 == epoll_ctl(epfd, EPOLL_CTL_ADD, sim->readyfd, &ev)) {
+		log_errno("EPOLL_CTL_ADD");
+		goto fail;
+	}
+
+	simArm(sim, 1);
+	simSignal(sim);
+	return vd;
+
+fail:
+	v4l2core_dev_close(vd);
+	free(vd);
+	return NULL;
+}
@@ -0,0 +1,37 @@
+#ifndef V4L2SIM_H_INCLUDED
+#define V4L2SIM_H_INCLUDED
+#include "v4l2core.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+    Simulated capture devices behind the v4l2_backend_t interface. They
+    implement the V4L2 ioctls the capture path uses, including MMAP,
+    USERPTR, DMABUF and read() i/o, and expose a pollable vd->fd, so the
+    real buffer handling runs unchanged without a camera.
+
+    A replay reads raw frames, an MJPEG or H.264 stream, or a v4l2idx
+    recording, which brings its own format and timestamps.  At fps 0 it
+    runs as fast as buffers come back; timed, it keeps the recorded
+    cadence, gaps included.  Either way it loops at the end.
+*/
+typedef struct v4l2sim_config_t{
+    uint32_t    pixelformat;    //YUYV, UYVY, GREY, NV12, YUV420, RGB24, BGR24, MJPEG, H264, or the multi-planar NV12M and YUV420M
+    uint32_t    width;
+    uint32_t    height;
+    uint32_t    fps;            //0 delivers a frame for every queued buffer at once
+    uint32_t    frame_size;     //payload bytes for MJPEG/H264 key frames, 0 picks a default
+    const char* replay_path;    //feed frames recorded in this file instead of a test pattern
+    uint8_t     replay_timed;   //pace the replay of a v4l2idx recording by its timestamps, fps just needs to be non-zero
+    uint8_t     replay_zero_copy;   //hand MMAP and USERPTR frames out of the read-only file mapping instead of copying them
+}v4l2sim_config_t;
+
+v4l2_dev_t* v4l2sim_open(const v4l2sim_config_t* cfg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // V4L2SIM_H_INCLUDED
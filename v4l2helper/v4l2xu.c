@@ -11,6 +11,7 @@
 #include <sys/types.h>
 #include <assert.h>
 #include "v4l2xu.h"
+#include "v4l2log.h"
 
 #define DELAYQUERY      1            //is delay
 #define DELAYQUERY_IV   10000        //delay time us
@@ -18,11 +19,6 @@
 uint8_t u8unit=5;
 uint8_t u8ctrl=4;
 
-static void errno_show(const char* s)
-{
-	fprintf(stderr, "%s error %d, %s\n", s, errno, strerror(errno));
-}
-
 /*static void   Delay(int   time)//time*1000为秒数
 {
     clock_t   now   =   clock();
@@ -46,9 +42,9 @@ uint16_t get_length_xu_control(v4l2_dev_t *vd, uint8_t unit, uint8_t selector)
 		.data     = (uint8_t *) &length
 	};
 
-	if (xioctl(vd->fd, UVCIOC_CTRL_QUERY, &xu_ctrl_query) < 0)
+	if (v4l2core_ioctl(vd, UVCIOC_CTRL_QUERY, &xu_ctrl_query) < 0)
 	{
-		fprintf(stderr, "V4L2_CORE: UVCIOC_CTRL_QUERY (GET_LEN) - Error: %s\n", strerror(errno));
+		log_error("V4L2_CORE: UVCIOC_CTRL_QUERY (GET_LEN) - Error: %s", strerror(errno));
 		return 0;
 	}
 
@@ -70,9 +66,9 @@ int query_xu_control(v4l2_dev_t *vd, uint8_t unit, uint8_t selector, uint8_t que
 	};
 
 	/*get query data*/
-	if ((err=xioctl(vd->fd, UVCIOC_CTRL_QUERY, &xu_ctrl_query)) < 0)
+	if ((err=v4l2core_ioctl(vd, UVCIOC_CTRL_QUERY, &xu_ctrl_query)) < 0)
 	{
-		fprintf(stderr, "V4L2_CORE: UVCIOC_CTRL_QUERY (%i) - Error: %s\n", query, strerror(errno));
+		log_error("V4L2_CORE: UVCIOC_CTRL_QUERY (%i) - Error: %s", query, strerror(errno));
 	}
 
 	return err;